@@ -24,6 +24,7 @@
 #include "tcg/tcg.h"
 #include "qemu/bitops.h"
 #include "qemu/rcu.h"
+#include "qemu/seqlock.h"
 #include "accel/tcg/cpu-ldst-common.h"
 #include "accel/tcg/helper-retaddr.h"
 #include "accel/tcg/probe.h"
@@ -160,8 +161,22 @@ typedef struct PageFlagsNode {
     int flags;
 } PageFlagsNode;
 
+/* A copy of a PageFlagsNode, taken without holding the mmap_lock. */
+typedef struct PageFlagsRange {
+    vaddr start;
+    vaddr last;
+    int flags;
+} PageFlagsRange;
+
 static IntervalTreeRoot pageflags_root;
 
+/*
+ * Modifications of pageflags_root are serialized by the mmap_lock, and
+ * additionally bump pageflags_seq so that lockless readers can detect
+ * that their walk raced with a tree rotation or a flags update.
+ */
+static QemuSeqLock pageflags_seq;
+
 static PageFlagsNode *pageflags_find(vaddr start, vaddr last)
 {
     IntervalTreeNode *n;
@@ -170,6 +185,43 @@ static PageFlagsNode *pageflags_find(vaddr start, vaddr last)
     return n ? container_of(n, PageFlagsNode, itree) : NULL;
 }
 
+/*
+ * Find the first node overlapping [start,last] and copy it to @range.
+ *
+ * See util/interval-tree.c re lockless lookups: no false positives but
+ * there are false negatives, and a node found may be concurrently
+ * modified.  Rather than falling back to the mmap_lock, retry the lookup
+ * until it did not overlap with a writer, which makes the result exact.
+ */
+static bool pageflags_lookup(vaddr start, vaddr last, PageFlagsRange *range)
+{
+    PageFlagsNode *p;
+    unsigned seq;
+
+    if (have_mmap_lock()) {
+        p = pageflags_find(start, last);
+        if (p) {
+            range->start = p->itree.start;
+            range->last = p->itree.last;
+            range->flags = p->flags;
+        }
+        return p != NULL;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    do {
+        seq = seqlock_read_begin(&pageflags_seq);
+        p = pageflags_find(start, last);
+        if (p) {
+            range->start = p->itree.start;
+            range->last = p->itree.last;
+            range->flags = p->flags;
+        }
+    } while (seqlock_read_retry(&pageflags_seq, seq));
+
+    return p != NULL;
+}
+
 static PageFlagsNode *pageflags_next(PageFlagsNode *p, vaddr start, vaddr last)
 {
     IntervalTreeNode *n;
@@ -233,24 +285,9 @@ void page_dump(FILE *f)
 
 int page_get_flags(vaddr address)
 {
-    PageFlagsNode *p = pageflags_find(address, address);
-
-    /*
-     * See util/interval-tree.c re lockless lookups: no false positives but
-     * there are false negatives.  If we find nothing, retry with the mmap
-     * lock acquired.
-     */
-    if (p) {
-        return p->flags;
-    }
-    if (have_mmap_lock()) {
-        return 0;
-    }
+    PageFlagsRange range;
 
-    mmap_lock();
-    p = pageflags_find(address, address);
-    mmap_unlock();
-    return p ? p->flags : 0;
+    return pageflags_lookup(address, address, &range) ? range.flags : 0;
 }
 
 /* A subroutine of page_set_flags: insert a new node for [start,last]. */
@@ -529,12 +566,19 @@ void page_set_flags(vaddr start, vaddr last, int flags)
 
     if (!flags || reset) {
         page_reset_target_data(start, last);
+    }
+
+    /* Lockless readers must not observe the range between unset and set. */
+    seqlock_write_begin(&pageflags_seq);
+    if (!flags || reset) {
         inval_tb |= pageflags_unset(start, last);
     }
     if (flags) {
         inval_tb |= pageflags_set_clear(start, last, flags,
                                         ~(reset ? 0 : PAGE_STICKY));
     }
+    seqlock_write_end(&pageflags_seq);
+
     if (inval_tb) {
         tb_invalidate_phys_range(NULL, start, last);
     }
@@ -543,7 +587,6 @@ void page_set_flags(vaddr start, vaddr last, int flags)
 bool page_check_range(vaddr start, vaddr len, int flags)
 {
     vaddr last;
-    int locked;  /* tri-state: =0: unlocked, +1: global, -1: local */
     bool ret;
 
     if (len == 0) {
@@ -555,38 +598,26 @@ bool page_check_range(vaddr start, vaddr len, int flags)
         return false; /* wrap around */
     }
 
-    locked = have_mmap_lock();
     while (true) {
-        PageFlagsNode *p = pageflags_find(start, last);
+        PageFlagsRange p;
         int missing;
 
-        if (!p) {
-            if (!locked) {
-                /*
-                 * Lockless lookups have false negatives.
-                 * Retry with the lock held.
-                 */
-                mmap_lock();
-                locked = -1;
-                p = pageflags_find(start, last);
-            }
-            if (!p) {
-                ret = false; /* entire region invalid */
-                break;
-            }
+        if (!pageflags_lookup(start, last, &p)) {
+            ret = false; /* entire region invalid */
+            break;
         }
-        if (start < p->itree.start) {
+        if (start < p.start) {
             ret = false; /* initial bytes invalid */
             break;
         }
 
-        missing = flags & ~p->flags;
+        missing = flags & ~p.flags;
         if (missing & ~PAGE_WRITE) {
             ret = false; /* page doesn't match */
             break;
         }
         if (missing & PAGE_WRITE) {
-            if (!(p->flags & PAGE_WRITE_ORG)) {
+            if (!(p.flags & PAGE_WRITE_ORG)) {
                 ret = false; /* page not writable */
                 break;
             }
@@ -604,17 +635,13 @@ bool page_check_range(vaddr start, vaddr len, int flags)
             continue;
         }
 
-        if (last <= p->itree.last) {
+        if (last <= p.last) {
             ret = true; /* ok */
             break;
         }
-        start = p->itree.last + 1;
+        start = p.last + 1;
     }
 
-    /* Release the lock if acquired locally. */
-    if (locked < 0) {
-        mmap_unlock();
-    }
     return ret;
 }
 
@@ -697,7 +724,9 @@ void tb_lock_page0(tb_page_addr_t address)
     }
 
     if (prot & PAGE_WRITE) {
+        seqlock_write_begin(&pageflags_seq);
         pageflags_set_clear(start, last, 0, PAGE_WRITE);
+        seqlock_write_end(&pageflags_seq);
         mprotect(g2h_untagged(start), last - start + 1,
                  prot & (PAGE_READ | PAGE_EXEC) ? PROT_READ : PROT_NONE);
     }
@@ -754,7 +783,9 @@ int page_unprotect(CPUState *cpu, tb_page_addr_t address, uintptr_t pc)
             start = address & TARGET_PAGE_MASK;
             len = TARGET_PAGE_SIZE;
             prot = p->flags | PAGE_WRITE;
+            seqlock_write_begin(&pageflags_seq);
             pageflags_set_clear(start, start + len - 1, PAGE_WRITE, 0);
+            seqlock_write_end(&pageflags_seq);
             current_tb_invalidated =
                 tb_invalidate_phys_page_unwind(cpu, start, pc);
         } else {
@@ -770,8 +801,10 @@ int page_unprotect(CPUState *cpu, tb_page_addr_t address, uintptr_t pc)
                     prot |= p->flags;
                     if (p->flags & PAGE_WRITE_ORG) {
                         prot |= PAGE_WRITE;
+                        seqlock_write_begin(&pageflags_seq);
                         pageflags_set_clear(addr, addr + TARGET_PAGE_SIZE - 1,
                                             PAGE_WRITE, 0);
+                        seqlock_write_end(&pageflags_seq);
                     }
                 }
                 /*
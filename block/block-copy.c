@@ -28,7 +28,9 @@
 #include "block/aio_task.h"
 #include "qemu/error-report.h"
 #include "qemu/memalign.h"
+#include "qemu/timer.h"
 
+/* Task sizes before adaptive tuning, scaled by 2^chunk_shift */
 #define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
 #define BLOCK_COPY_MAX_MEM (128 * MiB)
@@ -36,6 +38,11 @@
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 #define BLOCK_COPY_CLUSTER_SIZE_DEFAULT (1 << 16)
 
+#define BLOCK_COPY_CHUNK_SHIFT_MIN (-2)
+#define BLOCK_COPY_CHUNK_SHIFT_MAX 2
+#define BLOCK_COPY_TUNE_WINDOW_NS (100 * SCALE_MS)
+#define BLOCK_COPY_TUNE_MIN_TASKS 8
+
 typedef enum {
     COPY_READ_WRITE_CLUSTER,
     COPY_READ_WRITE,
@@ -140,6 +147,35 @@ typedef struct BlockCopyState {
     bool discard_source;
     BlockReqList reqs;
     QLIST_HEAD(, BlockCopyCallState) calls;
+
+    /*
+     * Adaptive tuning of task size and parallelism, see block_copy_tune().
+     * Statistics are collected over windows of busy time, i.e. time with
+     * at least one task in flight, and each window adjusts one parameter.
+     */
+    struct {
+        /* Task size is the base size of the method times 2^chunk_shift */
+        int chunk_shift;
+        /* Limit for the parallel tasks of a call, read without lock */
+        int workers;
+        /* Largest max_workers of the calls so far, bounds @workers */
+        int max_workers;
+        /* Direction of the next change of each parameter, 1 or -1 */
+        int chunk_step;
+        int workers_step;
+        bool tune_workers;
+
+        int in_flight;
+        int64_t busy_since_ns;
+        int64_t busy_ns;
+        int64_t bytes;
+        int64_t latency_ns;
+        int tasks;
+
+        uint64_t last_rate;
+        int64_t last_latency_ns;
+    } tune;
+
     /*
      * skip_unallocated:
      *
@@ -165,20 +201,124 @@ typedef struct BlockCopyState {
 /* Called with lock held */
 static int64_t block_copy_chunk_size(BlockCopyState *s)
 {
+    int64_t chunk;
+
     switch (s->method) {
     case COPY_READ_WRITE_CLUSTER:
         return s->cluster_size;
     case COPY_READ_WRITE:
     case COPY_RANGE_SMALL:
-        return MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER),
-                   s->max_transfer);
+        chunk = BLOCK_COPY_MAX_BUFFER;
+        break;
     case COPY_RANGE_FULL:
-        return MIN(MAX(s->cluster_size, BLOCK_COPY_MAX_COPY_RANGE),
-                   s->max_transfer);
+        chunk = BLOCK_COPY_MAX_COPY_RANGE;
+        break;
     default:
         /* Cannot have COPY_WRITE_ZEROES here.  */
         abort();
     }
+
+    if (s->tune.chunk_shift >= 0) {
+        chunk <<= s->tune.chunk_shift;
+    } else {
+        chunk >>= -s->tune.chunk_shift;
+    }
+    return MIN(MAX(s->cluster_size, chunk), s->max_transfer);
+}
+
+/* Called with lock held, when a task starts copying data */
+static int64_t block_copy_tune_start(BlockCopyState *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (s->tune.in_flight++ == 0) {
+        s->tune.busy_since_ns = now;
+    }
+    return now;
+}
+
+/*
+ * Called with lock held, when a task that started at @start_ns finished
+ * copying @bytes.
+ *
+ * At the end of each window the throughput is compared with the previous
+ * window, to see whether the last change of a parameter was useful.  If it
+ * made things worse, the parameter goes back in the other direction.  If
+ * it made no difference but tasks became slower, the parameter is lowered
+ * since the larger value only delays the guest writes that wait for tasks.
+ * Otherwise it keeps moving in the same direction, so that the parameters
+ * settle around the point where throughput stops improving.
+ */
+static void block_copy_tune(BlockCopyState *s, int64_t bytes,
+                            int64_t start_ns)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t latency_ns;
+    uint64_t rate;
+    int *step;
+
+    s->tune.bytes += bytes;
+    s->tune.latency_ns += now - start_ns;
+    s->tune.tasks++;
+    if (--s->tune.in_flight == 0) {
+        s->tune.busy_ns += now - s->tune.busy_since_ns;
+    } else if (s->tune.busy_ns + now - s->tune.busy_since_ns >=
+               BLOCK_COPY_TUNE_WINDOW_NS) {
+        s->tune.busy_ns += now - s->tune.busy_since_ns;
+        s->tune.busy_since_ns = now;
+    }
+
+    if (s->tune.busy_ns < BLOCK_COPY_TUNE_WINDOW_NS ||
+        s->tune.tasks < BLOCK_COPY_TUNE_MIN_TASKS) {
+        return;
+    }
+
+    if (s->tune.max_workers <= 1) {
+        /* No caller allows parallel tasks, only the task size matters */
+        s->tune.tune_workers = false;
+    }
+
+    rate = muldiv64(s->tune.bytes, NANOSECONDS_PER_SECOND, s->tune.busy_ns);
+    latency_ns = s->tune.latency_ns / s->tune.tasks;
+    step = s->tune.tune_workers ? &s->tune.workers_step : &s->tune.chunk_step;
+
+    if (s->tune.last_rate) {
+        if (rate * 20 < s->tune.last_rate * 19) {
+            *step = -*step;
+        } else if (rate * 20 <= s->tune.last_rate * 21 &&
+                   latency_ns > s->tune.last_latency_ns) {
+            *step = -1;
+        }
+    }
+
+    if (s->tune.tune_workers) {
+        int workers = *step > 0 ? s->tune.workers * 2 : s->tune.workers / 2;
+
+        workers = MIN(MAX(workers, 1), s->tune.max_workers);
+        if (workers == s->tune.workers) {
+            *step = -*step;
+        }
+        qatomic_set(&s->tune.workers, workers);
+    } else {
+        int shift = s->tune.chunk_shift + *step;
+
+        shift = MIN(MAX(shift, BLOCK_COPY_CHUNK_SHIFT_MIN),
+                    BLOCK_COPY_CHUNK_SHIFT_MAX);
+        if (shift == s->tune.chunk_shift) {
+            *step = -*step;
+        }
+        s->tune.chunk_shift = shift;
+    }
+    trace_block_copy_tune(s, rate, latency_ns, block_copy_chunk_size(s),
+                          s->tune.workers);
+
+    s->tune.last_rate = rate;
+    s->tune.last_latency_ns = latency_ns;
+    s->tune.tune_workers = !s->tune.tune_workers;
+    s->tune.busy_ns = 0;
+    s->tune.bytes = 0;
+    s->tune.latency_ns = 0;
+    s->tune.tasks = 0;
 }
 
 /*
@@ -191,8 +331,13 @@ block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
 {
     BlockCopyTask *task;
     int64_t max_chunk;
+    int max_workers = MIN(call_state->max_workers, BLOCK_COPY_MAX_WORKERS);
 
     QEMU_LOCK_GUARD(&s->lock);
+    if (max_workers > s->tune.max_workers) {
+        s->tune.max_workers = max_workers;
+        qatomic_set(&s->tune.workers, MIN(s->tune.workers, max_workers));
+    }
     max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s), call_state->max_chunk);
     if (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
                                            offset, offset + bytes,
@@ -434,6 +579,12 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
         .max_transfer = QEMU_ALIGN_DOWN(
                                     block_copy_max_transfer(source, target),
                                     cluster_size),
+        .tune = {
+            /* Backup windows are dominated by small tasks, grow first */
+            .chunk_step = 1,
+            .workers = BLOCK_COPY_MAX_WORKERS,
+            .workers_step = -1,
+        },
     };
 
     s->discard_source = discard_source;
@@ -584,8 +735,17 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
     BlockCopyState *s = t->s;
     bool error_is_read = false;
     BlockCopyMethod method = t->method;
+    /* Zero writes say nothing about the speed of copying data */
+    bool tune = t->method != COPY_WRITE_ZEROES;
+    int64_t start_ns = 0;
     int ret = -1;
 
+    if (tune) {
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            start_ns = block_copy_tune_start(s);
+        }
+    }
+
     WITH_GRAPH_RDLOCK_GUARD() {
         ret = block_copy_do_copy(s, t->req.offset, t->req.bytes, &method,
                                  &error_is_read);
@@ -595,6 +755,9 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
         if (s->method == t->method) {
             s->method = method;
         }
+        if (tune) {
+            block_copy_tune(s, ret < 0 ? 0 : t->req.bytes, start_ns);
+        }
 
         if (ret < 0) {
             if (!t->call_state->ret) {
@@ -635,6 +798,26 @@ int block_copy_block_status(BlockCopyState *s, int64_t offset, int64_t bytes,
 
     ret = bdrv_co_block_status_above(s->source->bs, base, offset, bytes, &num,
                                      NULL, NULL);
+
+    /*
+     * Fragmented images report many small extents.  Merge the following
+     * ones as long as they are copied the same way, so that the task is not
+     * split in small requests.
+     */
+    while (ret >= 0 && num && num < bytes) {
+        const int mask = BDRV_BLOCK_ALLOCATED | BDRV_BLOCK_ZERO;
+        int64_t next;
+        int next_ret;
+
+        next_ret = bdrv_co_block_status_above(s->source->bs, base,
+                                              offset + num, bytes - num,
+                                              &next, NULL, NULL);
+        if (next_ret < 0 || !next || (next_ret & mask) != (ret & mask)) {
+            break;
+        }
+        num += next;
+    }
+
     if (ret < 0 || num < s->cluster_size) {
         /*
          * On error or if failed to obtain large enough chunk just fallback to
@@ -769,6 +952,7 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
            !qatomic_read(&call_state->cancelled)) {
         BlockCopyTask *task;
         int64_t status_bytes;
+        int max_workers;
 
         task = block_copy_task_create(s, call_state, offset, bytes);
         if (!task) {
@@ -821,8 +1005,12 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
         offset = task_end(task);
         bytes = end - offset;
 
+        max_workers = MIN(call_state->max_workers,
+                          qatomic_read(&s->tune.workers));
         if (!aio && bytes) {
-            aio = aio_task_pool_new(call_state->max_workers);
+            aio = aio_task_pool_new(max_workers);
+        } else if (aio) {
+            aio_task_pool_set_max_busy_tasks(aio, max_workers);
         }
 
         ret = block_copy_task_run(aio, task);
@@ -0,0 +1,1785 @@
+/*
+ * Block driver for deduplicating images backed by a content-addressed store
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * A dedup image consists of two parts:
+ *
+ *  - The map (the "file" child), which holds a header and one 32 bit big
+ *    endian entry per guest cluster.  0 is a cluster that reads as zeroes,
+ *    any other value n refers to block n - 1 of the store.
+ *
+ *  - The store (the "store" child), which is shared by any number of
+ *    images.  After a header cluster it is made of groups, each being one
+ *    metadata cluster followed by as many data clusters as the metadata
+ *    cluster has entries.  An entry holds the SHA-256 hash of the data
+ *    cluster and the number of map entries that refer to it.
+ *
+ * Data that is written is hashed, and if the store already has a block
+ * with the same hash the map just refers to it.  Hash matches are trusted
+ * without comparing the data, SHA-256 collisions are not a practical
+ * concern.
+ *
+ * All images that use the same store node share its in-memory state: the
+ * hash index, the reference counts and a cache of recently read blocks.
+ * To share a store, images must therefore refer to the same node.  The
+ * first image that opens the store owns it: all I/O to the store goes
+ * through the store child of the owner, which takes the write permission
+ * without sharing it.  Other nodes and processes, which would have their
+ * own state, are thus locked out of the store.  When the owner is closed,
+ * another image that uses the store takes over.
+ *
+ * Metadata updates are ordered so that a crash can only leak blocks:
+ *
+ *  - The data of a new block is written with FUA before its entry, so
+ *    that an entry on disk never names data that is not.
+ *  - A new reference is written to the store and flushed before the map
+ *    entry that uses it.
+ *  - The reference that a map entry held is only dropped after the map
+ *    has been flushed.
+ *  - A block whose reference count dropped to zero is only reused after
+ *    that has been flushed to the store.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "block/qdict.h"
+#include "block/thread-pool.h"
+#include "crypto/hash.h"
+#include "system/block-backend.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/bswap.h"
+#include "migration/blocker.h"
+#include "qemu/coroutine.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/memalign.h"
+
+#define DEDUP_MAP_MAGIC                 0x5144444d /* "QDDM" */
+#define DEDUP_STORE_MAGIC               0x51444453 /* "QDDS" */
+#define DEDUP_VERSION                   1
+
+/* The map header, the store file name and padding up to the table */
+#define DEDUP_HEADER_SIZE               4096
+#define DEDUP_STORE_NAME_MAX            1023
+
+#define DEDUP_MIN_CLUSTER_SIZE          4096
+#define DEDUP_MAX_CLUSTER_SIZE          (2 * MiB)
+#define DEDUP_DEFAULT_CLUSTER_SIZE      65536
+
+/* Limits the map table that is kept in memory to 1 GiB */
+#define DEDUP_MAX_CLUSTERS              (256 * MiB)
+
+#define DEDUP_HASH_SIZE                 32
+#define DEDUP_DEFAULT_CACHE_SIZE        (16 * MiB)
+
+/* Dropped references that are applied without waiting for a flush */
+#define DEDUP_MAX_PENDING_UNREFS        4096
+
+#define BLOCK_OPT_STORE                 "store"
+#define DEDUP_OPT_CACHE_SIZE            "cache-size"
+
+typedef struct DedupMapHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cluster_size;
+    uint32_t store_name_len;
+    uint64_t size;
+    uint64_t table_offset;
+    /* followed by the store file name, without terminating NUL */
+} QEMU_PACKED DedupMapHeader;
+
+typedef struct DedupStoreHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cluster_size;
+    uint32_t reserved;
+} QEMU_PACKED DedupStoreHeader;
+
+typedef struct DedupStoreEntry {
+    uint8_t hash[DEDUP_HASH_SIZE];
+    uint32_t refcount;
+    uint32_t reserved;
+} QEMU_PACKED DedupStoreEntry;
+
+typedef struct DedupGroup {
+    uint8_t (*hash)[DEDUP_HASH_SIZE];
+    uint32_t *refcount;
+    /* reads in flight, which keep a block from being freed */
+    uint32_t *pins;
+} DedupGroup;
+
+typedef struct DedupPendingBlock {
+    uint32_t block;
+    /* DedupStore.meta_gen after the block was freed */
+    uint64_t gen;
+} DedupPendingBlock;
+
+typedef struct DedupCacheEntry {
+    uint32_t block;
+    /* 0 for an empty entry */
+    uint64_t lru_counter;
+    void *data;
+} DedupCacheEntry;
+
+typedef struct BDRVDedupState BDRVDedupState;
+
+typedef struct DedupStore {
+    BlockDriverState *bs;
+    QLIST_ENTRY(DedupStore) next;
+    QLIST_HEAD(, BDRVDedupState) users;
+    /* the user whose store child is used for all I/O to the store */
+    BDRVDedupState *owner;
+
+    /* protects everything below, and the map tables of the users */
+    CoMutex lock;
+
+    uint32_t cluster_size;
+    uint32_t entries_per_group;
+    GPtrArray *groups;
+
+    /* hash -> block number + 1, for the blocks that are in use */
+    GHashTable *index;
+    /* blocks that can be reused right away */
+    GArray *free_blocks;
+    /* DedupPendingBlock for freed blocks that are not flushed yet */
+    GArray *pending_blocks;
+
+    /* incremented on each metadata write, and how far it is flushed */
+    uint64_t meta_gen;
+    uint64_t flushed_gen;
+    bool flushing;
+    CoQueue flush_queue;
+
+    DedupCacheEntry *cache;
+    int cache_entries;
+    /* block number + 1 -> DedupCacheEntry */
+    GHashTable *cache_index;
+    uint64_t lru_counter;
+} DedupStore;
+
+struct BDRVDedupState {
+    BlockDriverState *bs;
+    BdrvChild *store_child;
+    DedupStore *store;
+    QLIST_ENTRY(BDRVDedupState) store_next;
+
+    uint32_t cluster_size;
+    uint64_t nb_clusters;
+    uint64_t table_offset;
+    /* big endian, as on disk; protected by store->lock */
+    uint32_t *table;
+
+    /* protects busy_clusters and unrefs */
+    CoMutex lock;
+    /* clusters that are being written */
+    GArray *busy_clusters;
+    CoQueue busy_queue;
+    /* blocks whose reference is dropped after the next map flush */
+    GArray *unrefs;
+
+    Error *migration_blocker;
+};
+
+static QLIST_HEAD(, DedupStore) dedup_stores =
+    QLIST_HEAD_INITIALIZER(dedup_stores);
+
+static QemuOptsList dedup_create_opts;
+
+static int dedup_probe(const uint8_t *buf, int buf_size, const char *filename)
+{
+    if (buf_size >= 4 && ldl_be_p(buf) == DEDUP_MAP_MAGIC) {
+        return 100;
+    }
+    return 0;
+}
+
+static inline DedupGroup *dedup_group(DedupStore *st, uint32_t block)
+{
+    return g_ptr_array_index(st->groups, block / st->entries_per_group);
+}
+
+static inline uint32_t dedup_slot(DedupStore *st, uint32_t block)
+{
+    return block % st->entries_per_group;
+}
+
+static inline BdrvChild *dedup_store_child(DedupStore *st)
+{
+    return st->owner->store_child;
+}
+
+static inline uint64_t dedup_nb_blocks(DedupStore *st)
+{
+    return (uint64_t)st->groups->len * st->entries_per_group;
+}
+
+static inline uint64_t dedup_group_offset(DedupStore *st, uint64_t group)
+{
+    return st->cluster_size * (1 + group * (1 + st->entries_per_group));
+}
+
+static inline uint64_t dedup_entry_offset(DedupStore *st, uint32_t block)
+{
+    return dedup_group_offset(st, block / st->entries_per_group) +
+           dedup_slot(st, block) * sizeof(DedupStoreEntry);
+}
+
+static inline uint64_t dedup_block_offset(DedupStore *st, uint32_t block)
+{
+    return dedup_group_offset(st, block / st->entries_per_group) +
+           st->cluster_size * (1 + (uint64_t)dedup_slot(st, block));
+}
+
+static guint dedup_hash_hash(gconstpointer key)
+{
+    /* The key is a SHA-256 hash already */
+    return ldl_he_p(key);
+}
+
+static gboolean dedup_hash_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, DEDUP_HASH_SIZE);
+}
+
+static DedupGroup *dedup_group_new(uint32_t entries)
+{
+    DedupGroup *g = g_new0(DedupGroup, 1);
+
+    g->hash = g_malloc0(entries * DEDUP_HASH_SIZE);
+    g->refcount = g_new0(uint32_t, entries);
+    g->pins = g_new0(uint32_t, entries);
+    return g;
+}
+
+static void dedup_group_free(gpointer opaque)
+{
+    DedupGroup *g = opaque;
+
+    g_free(g->hash);
+    g_free(g->refcount);
+    g_free(g->pins);
+    g_free(g);
+}
+
+/* Returns the block that holds data with @hash, if any */
+static bool dedup_store_lookup(DedupStore *st, const uint8_t *hash,
+                               uint32_t *block)
+{
+    gpointer value = g_hash_table_lookup(st->index, hash);
+
+    if (!value) {
+        return false;
+    }
+    *block = GPOINTER_TO_UINT(value) - 1;
+    return true;
+}
+
+static void *dedup_cache_lookup(DedupStore *st, uint32_t block)
+{
+    DedupCacheEntry *e;
+
+    e = g_hash_table_lookup(st->cache_index, GUINT_TO_POINTER(block + 1));
+    if (!e) {
+        return NULL;
+    }
+    e->lru_counter = ++st->lru_counter;
+    return e->data;
+}
+
+/* Takes ownership of @data */
+static void dedup_cache_insert(DedupStore *st, uint32_t block, void *data)
+{
+    DedupCacheEntry *e = NULL;
+    int i;
+
+    if (!st->cache_entries ||
+        g_hash_table_contains(st->cache_index, GUINT_TO_POINTER(block + 1))) {
+        qemu_vfree(data);
+        return;
+    }
+
+    for (i = 0; i < st->cache_entries; i++) {
+        if (!e || st->cache[i].lru_counter < e->lru_counter) {
+            e = &st->cache[i];
+        }
+        if (!e->lru_counter) {
+            break;
+        }
+    }
+
+    if (e->lru_counter) {
+        g_hash_table_remove(st->cache_index, GUINT_TO_POINTER(e->block + 1));
+        qemu_vfree(e->data);
+    }
+    e->block = block;
+    e->data = data;
+    e->lru_counter = ++st->lru_counter;
+    g_hash_table_insert(st->cache_index, GUINT_TO_POINTER(block + 1), e);
+}
+
+static void dedup_cache_invalidate(DedupStore *st, uint32_t block)
+{
+    DedupCacheEntry *e;
+
+    e = g_hash_table_lookup(st->cache_index, GUINT_TO_POINTER(block + 1));
+    if (!e) {
+        return;
+    }
+    g_hash_table_remove(st->cache_index, GUINT_TO_POINTER(block + 1));
+    qemu_vfree(e->data);
+    e->data = NULL;
+    e->lru_counter = 0;
+}
+
+/* The block is not referenced by any map and no read is in flight */
+static void dedup_store_release(DedupStore *st, uint32_t block)
+{
+    DedupPendingBlock pending = {
+        .block = block,
+        .gen = st->meta_gen,
+    };
+
+    dedup_cache_invalidate(st, block);
+    g_array_append_val(st->pending_blocks, pending);
+}
+
+/*
+ * Make sure that all metadata written to the store so far is on disk.
+ * Concurrent callers share a single flush.  Called with st->lock held.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_store_co_sync(DedupStore *st, BdrvChild *child)
+{
+    uint64_t gen = st->meta_gen;
+    uint64_t target;
+    int ret;
+
+    while (st->flushed_gen < gen) {
+        if (st->flushing) {
+            qemu_co_queue_wait(&st->flush_queue, &st->lock);
+            continue;
+        }
+
+        st->flushing = true;
+        target = st->meta_gen;
+        qemu_co_mutex_unlock(&st->lock);
+        ret = bdrv_co_flush(child->bs);
+        qemu_co_mutex_lock(&st->lock);
+        st->flushing = false;
+        qemu_co_queue_restart_all(&st->flush_queue);
+
+        if (ret < 0) {
+            return ret;
+        }
+        st->flushed_gen = MAX(st->flushed_gen, target);
+    }
+    return 0;
+}
+
+/* Called with st->lock held */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_store_co_write_entry(DedupStore *st, BdrvChild *child, uint32_t block,
+                           uint32_t refcount)
+{
+    DedupGroup *g = dedup_group(st, block);
+    DedupStoreEntry entry = {
+        .refcount = cpu_to_be32(refcount),
+    };
+
+    memcpy(entry.hash, g->hash[dedup_slot(st, block)], DEDUP_HASH_SIZE);
+    st->meta_gen++;
+    return bdrv_co_pwrite(child, dedup_entry_offset(st, block), sizeof(entry),
+                          &entry, 0);
+}
+
+/* Called with st->lock held */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_store_co_ref(DedupStore *st, BdrvChild *child, uint32_t block)
+{
+    DedupGroup *g = dedup_group(st, block);
+    uint32_t slot = dedup_slot(st, block);
+    int ret;
+
+    if (g->refcount[slot] == UINT32_MAX) {
+        return -EOVERFLOW;
+    }
+    ret = dedup_store_co_write_entry(st, child, block, g->refcount[slot] + 1);
+    if (ret < 0) {
+        return ret;
+    }
+    g->refcount[slot]++;
+    return 0;
+}
+
+/* Called with st->lock held */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_store_co_unref(DedupStore *st, BdrvChild *child, uint32_t block)
+{
+    DedupGroup *g = dedup_group(st, block);
+    uint32_t slot = dedup_slot(st, block);
+    uint32_t indexed;
+    int ret;
+
+    assert(g->refcount[slot] > 0);
+
+    /*
+     * If this fails, the on-disk reference count may or may not have been
+     * decremented.  Keep the block: leaking it is safe, reusing it is not.
+     */
+    ret = dedup_store_co_write_entry(st, child, block, g->refcount[slot] - 1);
+    if (ret < 0) {
+        return ret;
+    }
+    if (--g->refcount[slot]) {
+        return 0;
+    }
+
+    if (dedup_store_lookup(st, g->hash[slot], &indexed) && indexed == block) {
+        g_hash_table_remove(st->index, g->hash[slot]);
+    }
+    if (!g->pins[slot]) {
+        dedup_store_release(st, block);
+    }
+    return 0;
+}
+
+/* Called with st->lock held */
+static void dedup_store_unpin(DedupStore *st, uint32_t block)
+{
+    DedupGroup *g = dedup_group(st, block);
+    uint32_t slot = dedup_slot(st, block);
+
+    assert(g->pins[slot] > 0);
+    if (!--g->pins[slot] && !g->refcount[slot]) {
+        dedup_store_release(st, block);
+    }
+}
+
+/*
+ * Find a block for new data.  The block is not referenced on disk until
+ * its entry is written, so it can go back to st->free_blocks directly if
+ * it ends up unused.  Called with st->lock held.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_store_co_alloc(DedupStore *st, BdrvChild *child, uint32_t *block)
+{
+    DedupGroup *g;
+    uint64_t group;
+    guint i, n;
+    int ret;
+
+    if (!st->free_blocks->len && st->pending_blocks->len) {
+        /* Freed blocks can be reused once their refcount of 0 is on disk */
+        ret = dedup_store_co_sync(st, child);
+        if (ret < 0) {
+            return ret;
+        }
+        for (n = 0; n < st->pending_blocks->len; n++) {
+            DedupPendingBlock *p = &g_array_index(st->pending_blocks,
+                                                  DedupPendingBlock, n);
+            if (p->gen > st->flushed_gen) {
+                break;
+            }
+            g_array_append_val(st->free_blocks, p->block);
+        }
+        g_array_remove_range(st->pending_blocks, 0, n);
+    }
+
+    if (st->free_blocks->len) {
+        *block = g_array_index(st->free_blocks, uint32_t,
+                               st->free_blocks->len - 1);
+        g_array_set_size(st->free_blocks, st->free_blocks->len - 1);
+        return 0;
+    }
+
+    /* Add a group, its metadata cluster must read as zeroes */
+    group = st->groups->len;
+    if ((group + 1) * st->entries_per_group >= UINT32_MAX) {
+        return -ENOSPC;
+    }
+    ret = bdrv_co_pwrite_zeroes(child, dedup_group_offset(st, group),
+                                st->cluster_size, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    g = dedup_group_new(st->entries_per_group);
+    g_ptr_array_add(st->groups, g);
+    for (i = st->entries_per_group - 1; i > 0; i--) {
+        uint32_t free_block = group * st->entries_per_group + i;
+        g_array_append_val(st->free_blocks, free_block);
+    }
+    *block = group * st->entries_per_group;
+    return 0;
+}
+
+/*
+ * Return in *@block a block of the store that holds the cluster @buf,
+ * whose SHA-256 hash is @hash, with a new reference taken for the caller.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_store_co_insert(DedupStore *st, BdrvChild *child, const uint8_t *hash,
+                      const uint8_t *buf, uint32_t *block)
+{
+    uint32_t new_block;
+    DedupGroup *g;
+    uint32_t slot;
+    int ret;
+
+    qemu_co_mutex_lock(&st->lock);
+    if (dedup_store_lookup(st, hash, block)) {
+        ret = dedup_store_co_ref(st, child, *block);
+        goto out;
+    }
+
+    ret = dedup_store_co_alloc(st, child, &new_block);
+    if (ret < 0) {
+        goto out;
+    }
+    qemu_co_mutex_unlock(&st->lock);
+
+    ret = bdrv_co_pwrite(child, dedup_block_offset(st, new_block),
+                         st->cluster_size, buf, BDRV_REQ_FUA);
+
+    qemu_co_mutex_lock(&st->lock);
+    if (ret < 0) {
+        g_array_append_val(st->free_blocks, new_block);
+        goto out;
+    }
+
+    if (dedup_store_lookup(st, hash, block)) {
+        /* The same data was stored concurrently */
+        g_array_append_val(st->free_blocks, new_block);
+        ret = dedup_store_co_ref(st, child, *block);
+        goto out;
+    }
+
+    g = dedup_group(st, new_block);
+    slot = dedup_slot(st, new_block);
+    memcpy(g->hash[slot], hash, DEDUP_HASH_SIZE);
+    ret = dedup_store_co_write_entry(st, child, new_block, 1);
+    if (ret < 0) {
+        /* The entry may be on disk anyway, so leak the block */
+        goto out;
+    }
+    g->refcount[slot] = 1;
+    g_hash_table_insert(st->index, g->hash[slot],
+                        GUINT_TO_POINTER(new_block + 1));
+    *block = new_block;
+
+out:
+    qemu_co_mutex_unlock(&st->lock);
+    return ret;
+}
+
+/* Read the metadata of all groups and build the hash index */
+static int GRAPH_RDLOCK
+dedup_store_load(DedupStore *st, BdrvChild *child, Error **errp)
+{
+    DedupStoreEntry *entries;
+    uint64_t nb_groups;
+    int64_t len;
+    uint64_t group;
+    uint32_t i;
+    int ret = 0;
+
+    len = bdrv_getlength(child->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the size of the store");
+        return len;
+    }
+    nb_groups = DIV_ROUND_UP(len - st->cluster_size,
+                             (uint64_t)st->cluster_size *
+                             (1 + st->entries_per_group));
+    if (nb_groups * st->entries_per_group >= UINT32_MAX) {
+        error_setg(errp, "The store is too large");
+        return -EFBIG;
+    }
+
+    entries = qemu_try_blockalign(child->bs, st->cluster_size);
+    if (!entries) {
+        error_setg(errp, "Could not allocate store metadata buffer");
+        return -ENOMEM;
+    }
+
+    for (group = 0; group < nb_groups; group++) {
+        DedupGroup *g = dedup_group_new(st->entries_per_group);
+
+        g_ptr_array_add(st->groups, g);
+        ret = bdrv_pread(child, dedup_group_offset(st, group),
+                         st->cluster_size, entries, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read store metadata");
+            goto out;
+        }
+
+        for (i = 0; i < st->entries_per_group; i++) {
+            uint32_t block = group * st->entries_per_group + i;
+
+            memcpy(g->hash[i], entries[i].hash, DEDUP_HASH_SIZE);
+            g->refcount[i] = be32_to_cpu(entries[i].refcount);
+            if (!g->refcount[i]) {
+                g_array_append_val(st->free_blocks, block);
+            } else if (!g_hash_table_contains(st->index, g->hash[i])) {
+                g_hash_table_insert(st->index, g->hash[i],
+                                    GUINT_TO_POINTER(block + 1));
+            }
+        }
+    }
+
+    /* Blocks are taken from the end, reuse the lowest ones first */
+    for (i = 0; i < st->free_blocks->len / 2; i++) {
+        uint32_t *a = &g_array_index(st->free_blocks, uint32_t, i);
+        uint32_t *b = &g_array_index(st->free_blocks, uint32_t,
+                                     st->free_blocks->len - 1 - i);
+        uint32_t tmp = *a;
+
+        *a = *b;
+        *b = tmp;
+    }
+
+out:
+    qemu_vfree(entries);
+    return ret < 0 ? ret : 0;
+}
+
+static void dedup_store_free(DedupStore *st)
+{
+    int i;
+
+    for (i = 0; i < st->cache_entries; i++) {
+        qemu_vfree(st->cache[i].data);
+    }
+    g_free(st->cache);
+    g_hash_table_destroy(st->cache_index);
+    g_hash_table_destroy(st->index);
+    g_ptr_array_free(st->groups, true);
+    g_array_free(st->free_blocks, true);
+    g_array_free(st->pending_blocks, true);
+    g_free(st);
+}
+
+/*
+ * Return the shared state of the store that the store child of @s refers
+ * to, loading it if @s is its first user.
+ */
+static DedupStore * GRAPH_RDLOCK
+dedup_store_get(BDRVDedupState *s, uint64_t cache_size, Error **errp)
+{
+    BdrvChild *child = s->store_child;
+    uint32_t cluster_size = s->cluster_size;
+    DedupStore *st;
+    DedupStoreHeader header;
+    int64_t len;
+    int ret;
+
+    QLIST_FOREACH(st, &dedup_stores, next) {
+        if (st->bs == child->bs) {
+            if (st->cluster_size != cluster_size) {
+                error_setg(errp, "Store cluster size %" PRIu32 " does not "
+                           "match the image cluster size %" PRIu32,
+                           st->cluster_size, cluster_size);
+                return NULL;
+            }
+            QLIST_INSERT_HEAD(&st->users, s, store_next);
+            return st;
+        }
+        if (!strcmp(st->bs->exact_filename, child->bs->exact_filename) &&
+            child->bs->exact_filename[0]) {
+            error_setg(errp, "Store '%s' is already in use by node '%s'",
+                       child->bs->exact_filename,
+                       bdrv_get_node_name(st->bs));
+            return NULL;
+        }
+    }
+
+    len = bdrv_getlength(child->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the size of the store");
+        return NULL;
+    }
+    if (len < cluster_size) {
+        error_setg(errp, "The store is not initialized");
+        return NULL;
+    }
+
+    ret = bdrv_pread(child, 0, sizeof(header), &header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the store header");
+        return NULL;
+    }
+    if (be32_to_cpu(header.magic) != DEDUP_STORE_MAGIC) {
+        error_setg(errp, "Not a dedup store");
+        return NULL;
+    }
+    if (be32_to_cpu(header.version) != DEDUP_VERSION) {
+        error_setg(errp, "Unsupported dedup store version %" PRIu32,
+                   be32_to_cpu(header.version));
+        return NULL;
+    }
+    if (be32_to_cpu(header.cluster_size) != cluster_size) {
+        error_setg(errp, "Store cluster size %" PRIu32 " does not match "
+                   "the image cluster size %" PRIu32,
+                   be32_to_cpu(header.cluster_size), cluster_size);
+        return NULL;
+    }
+
+    st = g_new0(DedupStore, 1);
+    st->bs = child->bs;
+    QLIST_INIT(&st->users);
+    QLIST_INSERT_HEAD(&st->users, s, store_next);
+    st->owner = s;
+    qemu_co_mutex_init(&st->lock);
+    qemu_co_queue_init(&st->flush_queue);
+    st->cluster_size = cluster_size;
+    st->entries_per_group = cluster_size / sizeof(DedupStoreEntry);
+    st->groups = g_ptr_array_new_with_free_func(dedup_group_free);
+    st->index = g_hash_table_new(dedup_hash_hash, dedup_hash_equal);
+    st->free_blocks = g_array_new(false, false, sizeof(uint32_t));
+    st->pending_blocks = g_array_new(false, false, sizeof(DedupPendingBlock));
+    st->cache_entries = MIN(cache_size / cluster_size, INT_MAX);
+    st->cache = g_new0(DedupCacheEntry, st->cache_entries);
+    st->cache_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    if (dedup_store_load(st, child, errp) < 0) {
+        dedup_store_free(st);
+        return NULL;
+    }
+
+    QLIST_INSERT_HEAD(&dedup_stores, st, next);
+    return st;
+}
+
+/* Returns true if a user other than the owner may write to the store */
+static bool GRAPH_RDLOCK dedup_store_has_writers(DedupStore *st)
+{
+    BDRVDedupState *s;
+
+    QLIST_FOREACH(s, &st->users, store_next) {
+        if (s != st->owner && bdrv_is_writable(s->bs)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Make the store child of the owner take the permissions for all users */
+static int GRAPH_RDLOCK dedup_store_refresh_perms(DedupStore *st,
+                                                  Error **errp)
+{
+    return bdrv_child_refresh_perms(st->owner->bs, st->owner->store_child,
+                                    errp);
+}
+
+static void dedup_store_put(BDRVDedupState *s)
+{
+    DedupStore *st = s->store;
+    Error *local_err = NULL;
+
+    QLIST_REMOVE(s, store_next);
+    if (QLIST_EMPTY(&st->users)) {
+        QLIST_REMOVE(st, next);
+        dedup_store_free(st);
+        return;
+    }
+    if (st->owner != s) {
+        return;
+    }
+
+    /*
+     * Hand the store over to another user.  No request may use the store
+     * child of @s while that happens.  The permissions of @s are dropped
+     * first, so that they do not conflict with those of the new owner.
+     */
+    bdrv_drained_begin(st->bs);
+    bdrv_graph_rdlock_main_loop();
+    st->owner = QLIST_FIRST(&st->users);
+    bdrv_child_refresh_perms(s->bs, s->store_child, NULL);
+    if (dedup_store_refresh_perms(st, &local_err) < 0) {
+        error_reportf_err(local_err, "Node '%s' cannot take over the store: ",
+                          bdrv_get_device_or_node_name(st->owner->bs));
+    }
+    bdrv_graph_rdunlock_main_loop();
+    bdrv_drained_end(st->bs);
+}
+
+typedef struct DedupHashData {
+    const uint8_t *buf;
+    size_t len;
+    uint8_t *hash;
+} DedupHashData;
+
+static int dedup_hash_func(void *opaque)
+{
+    DedupHashData *d = opaque;
+    g_autofree uint8_t *result = NULL;
+    size_t result_len = 0;
+
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALGO_SHA256, (const char *)d->buf,
+                           d->len, &result, &result_len, NULL) < 0) {
+        return -EIO;
+    }
+    assert(result_len == DEDUP_HASH_SIZE);
+    memcpy(d->hash, result, DEDUP_HASH_SIZE);
+    return 0;
+}
+
+/* Hash in a worker thread so that the AioContext keeps serving requests */
+static int coroutine_fn dedup_co_hash(const uint8_t *buf, size_t len,
+                                      uint8_t *hash)
+{
+    DedupHashData d = {
+        .buf = buf,
+        .len = len,
+        .hash = hash,
+    };
+
+    return thread_pool_submit_co(dedup_hash_func, &d);
+}
+
+static QemuOptsList dedup_runtime_opts = {
+    .name = "dedup",
+    .head = QTAILQ_HEAD_INITIALIZER(dedup_runtime_opts.head),
+    .desc = {
+        {
+            .name = DEDUP_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the read cache shared by the users of the "
+                    "store (only used by the first image that opens it)",
+        },
+        { /* end of list */ }
+    },
+};
+
+/* Read the cluster table and attach to the store */
+static int GRAPH_RDLOCK
+dedup_load(BlockDriverState *bs, uint64_t cache_size, Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+    size_t table_size;
+    int ret;
+
+    table_size = ROUND_UP(s->nb_clusters * sizeof(uint32_t), BDRV_SECTOR_SIZE);
+    s->table = qemu_try_blockalign(bs->file->bs,
+                                   MAX(table_size, BDRV_SECTOR_SIZE));
+    if (!s->table) {
+        error_setg(errp, "Could not allocate the cluster table");
+        return -ENOMEM;
+    }
+    if (table_size) {
+        ret = bdrv_pread(bs->file, s->table_offset, table_size, s->table, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the cluster table");
+            return ret;
+        }
+    }
+
+    s->store = dedup_store_get(s, cache_size, errp);
+    if (!s->store) {
+        return -EINVAL;
+    }
+
+    /*
+     * A new owner takes the store for itself, and an owner that is
+     * read-only has to take the write permission for a writable user.
+     */
+    if (s->store->owner == s || bdrv_is_writable(bs)) {
+        ret = dedup_store_refresh_perms(s->store, errp);
+        if (ret < 0) {
+            dedup_store_put(s);
+            s->store = NULL;
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Returns true if the store node is given in @options */
+static bool dedup_has_store_options(QDict *options)
+{
+    const QDictEntry *e;
+
+    for (e = qdict_first(options); e; e = qdict_next(options, e)) {
+        if (!strcmp(e->key, BLOCK_OPT_STORE) ||
+            strstart(e->key, BLOCK_OPT_STORE ".", NULL)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * A relative store name in the header is relative to the directory of the
+ * image, like the backing file name of a qcow2 image.
+ */
+static char * GRAPH_RDLOCK
+dedup_store_filename(BlockDriverState *bs, const char *name, Error **errp)
+{
+    g_autofree char *dir = NULL;
+
+    if (path_has_protocol(name) || path_is_absolute(name)) {
+        return g_strdup(name);
+    }
+
+    dir = bdrv_dirname(bs, errp);
+    if (!dir) {
+        return NULL;
+    }
+    return g_strconcat(dir, name, NULL);
+}
+
+static int dedup_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupMapHeader header;
+    g_autofree char *store_name = NULL;
+    QemuOpts *opts = NULL;
+    uint64_t cache_size;
+    int ret;
+
+    s->bs = bs;
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_METADATA | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    opts = qemu_opts_create(&dedup_runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+    cache_size = qemu_opt_get_size(opts, DEDUP_OPT_CACHE_SIZE,
+                                   DEDUP_DEFAULT_CACHE_SIZE);
+
+    bdrv_graph_rdlock_main_loop();
+    ret = bdrv_pread(bs->file, 0, sizeof(header), &header, 0);
+    bdrv_graph_rdunlock_main_loop();
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the image header");
+        goto fail;
+    }
+
+    header.magic = be32_to_cpu(header.magic);
+    header.version = be32_to_cpu(header.version);
+    header.cluster_size = be32_to_cpu(header.cluster_size);
+    header.store_name_len = be32_to_cpu(header.store_name_len);
+    header.size = be64_to_cpu(header.size);
+    header.table_offset = be64_to_cpu(header.table_offset);
+
+    if (header.magic != DEDUP_MAP_MAGIC) {
+        error_setg(errp, "Image not in dedup format");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (header.version != DEDUP_VERSION) {
+        error_setg(errp, "Unsupported dedup version %" PRIu32,
+                   header.version);
+        ret = -ENOTSUP;
+        goto fail;
+    }
+    if (header.cluster_size < DEDUP_MIN_CLUSTER_SIZE ||
+        header.cluster_size > DEDUP_MAX_CLUSTER_SIZE ||
+        !is_power_of_2(header.cluster_size)) {
+        error_setg(errp, "Unsupported cluster size %" PRIu32,
+                   header.cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (header.size % BDRV_SECTOR_SIZE ||
+        DIV_ROUND_UP(header.size, header.cluster_size) > DEDUP_MAX_CLUSTERS) {
+        error_setg(errp, "Unsupported image size %" PRIu64, header.size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (header.store_name_len > DEDUP_STORE_NAME_MAX ||
+        header.table_offset < sizeof(header) + header.store_name_len ||
+        header.table_offset % BDRV_SECTOR_SIZE) {
+        error_setg(errp, "Invalid dedup header");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (header.store_name_len) {
+        store_name = g_malloc0(header.store_name_len + 1);
+        bdrv_graph_rdlock_main_loop();
+        ret = bdrv_pread(bs->file, sizeof(header), header.store_name_len,
+                         store_name, 0);
+        bdrv_graph_rdunlock_main_loop();
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the store name");
+            goto fail;
+        }
+
+        if (!dedup_has_store_options(options)) {
+            char *full_name;
+
+            bdrv_graph_rdlock_main_loop();
+            full_name = dedup_store_filename(bs, store_name, errp);
+            bdrv_graph_rdunlock_main_loop();
+            if (!full_name) {
+                ret = -EINVAL;
+                goto fail;
+            }
+            g_free(store_name);
+            store_name = full_name;
+        }
+    }
+
+    s->store_child = bdrv_open_child(store_name, options, "store", bs,
+                                     &child_of_bds,
+                                     BDRV_CHILD_DATA | BDRV_CHILD_METADATA,
+                                     false, errp);
+    if (!s->store_child) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->cluster_size = header.cluster_size;
+    s->nb_clusters = DIV_ROUND_UP(header.size, header.cluster_size);
+    s->table_offset = header.table_offset;
+    bs->total_sectors = header.size / BDRV_SECTOR_SIZE;
+
+    bdrv_graph_rdlock_main_loop();
+    ret = dedup_load(bs, cache_size, errp);
+    bdrv_graph_rdunlock_main_loop();
+    if (ret < 0) {
+        goto fail;
+    }
+
+    qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->busy_queue);
+    s->busy_clusters = g_array_new(false, false, sizeof(uint64_t));
+    s->unrefs = g_array_new(false, false, sizeof(uint32_t));
+    bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK;
+
+    /* Disable migration when dedup images are used */
+    error_setg(&s->migration_blocker, "The dedup format used by node '%s' "
+               "does not support live migration",
+               bdrv_get_device_or_node_name(bs));
+    ret = migrate_add_blocker_normal(&s->migration_blocker, errp);
+    if (ret < 0) {
+        g_array_free(s->busy_clusters, true);
+        g_array_free(s->unrefs, true);
+        dedup_store_put(s);
+        goto fail;
+    }
+
+    qemu_opts_del(opts);
+    return 0;
+
+fail:
+    qemu_vfree(s->table);
+    s->table = NULL;
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static int dedup_reopen_prepare(BDRVReopenState *state,
+                                BlockReopenQueue *queue, Error **errp)
+{
+    BDRVDedupState *s = state->bs->opaque;
+    DedupStore *st = s->store;
+
+    /* The permissions of the owner are not part of this reopen */
+    if ((state->flags & BDRV_O_RDWR) && st->owner != s &&
+        !(dedup_store_child(st)->perm & BLK_PERM_WRITE)) {
+        error_setg(errp, "The store is opened read-only by node '%s'",
+                   bdrv_get_device_or_node_name(st->owner->bs));
+        return -EPERM;
+    }
+    return 0;
+}
+
+static void GRAPH_RDLOCK
+dedup_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    bs->bl.pwrite_zeroes_alignment = s->cluster_size;
+    bs->bl.pdiscard_alignment = s->cluster_size;
+}
+
+static void GRAPH_RDLOCK
+dedup_child_perm(BlockDriverState *bs, BdrvChild *c, BdrvChildRole role,
+                 BlockReopenQueue *reopen_queue, uint64_t perm, uint64_t shared,
+                 uint64_t *nperm, uint64_t *nshared)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupStore *st = s->store;
+
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    if (role & BDRV_CHILD_PRIMARY) {
+        return;
+    }
+    if (!st || st->owner != s) {
+        /* The owner of the store does all I/O and takes the permissions */
+        *nperm = 0;
+        *nshared = BLK_PERM_ALL;
+    } else if (dedup_store_has_writers(st)) {
+        *nperm |= BLK_PERM_WRITE | BLK_PERM_RESIZE;
+    }
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    bdi->cluster_size = s->cluster_size;
+    return 0;
+}
+
+/*
+ * Data clusters are reported without BDRV_BLOCK_OFFSET_VALID: the store
+ * is shared with other images, whose writes may free a store block and
+ * reuse it as soon as st->lock is dropped, so an offset into it would not
+ * stay valid for callers that read from it directly.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_block_status(BlockDriverState *bs, unsigned int mode,
+                      int64_t offset, int64_t bytes, int64_t *pnum,
+                      int64_t *map, BlockDriverState **file)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupStore *st = s->store;
+    uint64_t cluster = offset / s->cluster_size;
+    uint64_t offset_in_cluster = offset % s->cluster_size;
+    int64_t n = s->cluster_size - offset_in_cluster;
+    uint32_t entry;
+
+    qemu_co_mutex_lock(&st->lock);
+    entry = be32_to_cpu(s->table[cluster]);
+    if (entry > dedup_nb_blocks(st)) {
+        qemu_co_mutex_unlock(&st->lock);
+        return -EIO;
+    }
+
+    /* Merge clusters that are all allocated or all zero */
+    while (n < bytes && cluster + 1 < s->nb_clusters &&
+           !s->table[cluster + 1] == !entry) {
+        cluster++;
+        n += s->cluster_size;
+    }
+    qemu_co_mutex_unlock(&st->lock);
+
+    *pnum = MIN(n, bytes);
+    return entry ? BDRV_BLOCK_DATA : BDRV_BLOCK_ZERO;
+}
+
+/* Read part of a cluster, from the shared cache if possible */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_read_cluster(BlockDriverState *bs, uint64_t cluster,
+                      uint64_t offset_in_cluster, uint64_t bytes,
+                      QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupStore *st = s->store;
+    uint32_t entry, block;
+    uint8_t *data;
+    int ret;
+
+    qemu_co_mutex_lock(&st->lock);
+    entry = be32_to_cpu(s->table[cluster]);
+    if (!entry) {
+        qemu_co_mutex_unlock(&st->lock);
+        qemu_iovec_memset(qiov, qiov_offset, 0, bytes);
+        return 0;
+    }
+
+    block = entry - 1;
+    if (entry > dedup_nb_blocks(st) ||
+        !dedup_group(st, block)->refcount[dedup_slot(st, block)]) {
+        qemu_co_mutex_unlock(&st->lock);
+        return -EIO;
+    }
+
+    data = dedup_cache_lookup(st, block);
+    if (data) {
+        qemu_iovec_from_buf(qiov, qiov_offset, data + offset_in_cluster,
+                            bytes);
+        qemu_co_mutex_unlock(&st->lock);
+        return 0;
+    }
+    dedup_group(st, block)->pins[dedup_slot(st, block)]++;
+    qemu_co_mutex_unlock(&st->lock);
+
+    data = qemu_try_blockalign(s->store_child->bs, s->cluster_size);
+    if (!data) {
+        ret = -ENOMEM;
+    } else {
+        ret = bdrv_co_pread(dedup_store_child(st),
+                            dedup_block_offset(st, block), s->cluster_size,
+                            data, 0);
+    }
+    if (ret >= 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, data + offset_in_cluster,
+                            bytes);
+    }
+
+    qemu_co_mutex_lock(&st->lock);
+    if (ret >= 0) {
+        dedup_cache_insert(st, block, data);
+        data = NULL;
+    }
+    dedup_store_unpin(st, block);
+    qemu_co_mutex_unlock(&st->lock);
+
+    qemu_vfree(data);
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                QEMUIOVector *qiov, BdrvRequestFlags flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    size_t qiov_offset = 0;
+    int ret;
+
+    while (bytes > 0) {
+        uint64_t cluster = offset / s->cluster_size;
+        uint64_t offset_in_cluster = offset % s->cluster_size;
+        uint64_t n = MIN(bytes, s->cluster_size - offset_in_cluster);
+
+        ret = dedup_co_read_cluster(bs, cluster, offset_in_cluster, n,
+                                    qiov, qiov_offset);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    return 0;
+}
+
+static bool dedup_cluster_busy(BDRVDedupState *s, uint64_t cluster)
+{
+    guint i;
+
+    for (i = 0; i < s->busy_clusters->len; i++) {
+        if (g_array_index(s->busy_clusters, uint64_t, i) == cluster) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Serialize updates of a cluster */
+static void coroutine_fn dedup_lock_cluster(BDRVDedupState *s,
+                                            uint64_t cluster)
+{
+    qemu_co_mutex_lock(&s->lock);
+    while (dedup_cluster_busy(s, cluster)) {
+        qemu_co_queue_wait(&s->busy_queue, &s->lock);
+    }
+    g_array_append_val(s->busy_clusters, cluster);
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+static void coroutine_fn dedup_unlock_cluster(BDRVDedupState *s,
+                                              uint64_t cluster)
+{
+    guint i;
+
+    qemu_co_mutex_lock(&s->lock);
+    for (i = 0; i < s->busy_clusters->len; i++) {
+        if (g_array_index(s->busy_clusters, uint64_t, i) == cluster) {
+            g_array_remove_index_fast(s->busy_clusters, i);
+            break;
+        }
+    }
+    qemu_co_queue_restart_all(&s->busy_queue);
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+/*
+ * Drop the references of the clusters that were remapped since the last
+ * call, once the map that no longer uses them is on disk.
+ */
+static int coroutine_fn GRAPH_RDLOCK dedup_co_apply_unrefs(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupStore *st = s->store;
+    GArray *unrefs;
+    guint i;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    unrefs = s->unrefs;
+    s->unrefs = g_array_new(false, false, sizeof(uint32_t));
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (!unrefs->len) {
+        g_array_free(unrefs, true);
+        return 0;
+    }
+
+    ret = bdrv_co_flush(bs->file->bs);
+    if (ret < 0) {
+        qemu_co_mutex_lock(&s->lock);
+        g_array_append_vals(s->unrefs, unrefs->data, unrefs->len);
+        qemu_co_mutex_unlock(&s->lock);
+        g_array_free(unrefs, true);
+        return ret;
+    }
+
+    qemu_co_mutex_lock(&st->lock);
+    for (i = 0; i < unrefs->len; i++) {
+        int r = dedup_store_co_unref(st, dedup_store_child(st),
+                                     g_array_index(unrefs, uint32_t, i));
+        if (r < 0 && !ret) {
+            ret = r;
+        }
+    }
+    qemu_co_mutex_unlock(&st->lock);
+
+    g_array_free(unrefs, true);
+    return ret;
+}
+
+/*
+ * Point @cluster to @entry.  The caller holds the cluster lock and a
+ * reference to the block that @entry refers to, which is handed over to
+ * the map.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_set_entry(BlockDriverState *bs, uint64_t cluster, uint32_t entry)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupStore *st = s->store;
+    uint32_t be_entry = cpu_to_be32(entry);
+    uint32_t old;
+    guint pending;
+    int ret;
+
+    qemu_co_mutex_lock(&st->lock);
+    old = be32_to_cpu(s->table[cluster]);
+    if (old == entry) {
+        ret = entry ? dedup_store_co_unref(st, dedup_store_child(st),
+                                           entry - 1) : 0;
+        qemu_co_mutex_unlock(&st->lock);
+        return ret;
+    }
+
+    /* The new reference must be on disk before the map uses it */
+    ret = entry ? dedup_store_co_sync(st, dedup_store_child(st)) : 0;
+    qemu_co_mutex_unlock(&st->lock);
+    if (ret < 0) {
+        /* Leaks the reference of the caller */
+        return ret;
+    }
+
+    ret = bdrv_co_pwrite(bs->file, s->table_offset + cluster * sizeof(uint32_t),
+                         sizeof(uint32_t), &be_entry, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_co_mutex_lock(&st->lock);
+    s->table[cluster] = be_entry;
+    qemu_co_mutex_unlock(&st->lock);
+
+    if (!old) {
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    old--;
+    g_array_append_val(s->unrefs, old);
+    pending = s->unrefs->len;
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (pending >= DEDUP_MAX_PENDING_UNREFS) {
+        return dedup_co_apply_unrefs(bs);
+    }
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_write_cluster(BlockDriverState *bs, uint64_t cluster,
+                       const uint8_t *buf)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint8_t hash[DEDUP_HASH_SIZE];
+    uint32_t block;
+    int ret;
+
+    if (buffer_is_zero(buf, s->cluster_size)) {
+        return dedup_co_set_entry(bs, cluster, 0);
+    }
+
+    ret = dedup_co_hash(buf, s->cluster_size, hash);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = dedup_store_co_insert(s->store, dedup_store_child(s->store), hash,
+                                buf, &block);
+    if (ret < 0) {
+        return ret;
+    }
+    return dedup_co_set_entry(bs, cluster, block + 1);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                 QEMUIOVector *qiov, BdrvRequestFlags flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    size_t qiov_offset = 0;
+    uint8_t *buf;
+    int ret = 0;
+
+    buf = qemu_try_blockalign(s->store_child->bs, s->cluster_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    while (bytes > 0) {
+        uint64_t cluster = offset / s->cluster_size;
+        uint64_t offset_in_cluster = offset % s->cluster_size;
+        uint64_t n = MIN(bytes, s->cluster_size - offset_in_cluster);
+        uint64_t cluster_bytes = MIN(s->cluster_size,
+                                     bs->total_sectors * BDRV_SECTOR_SIZE -
+                                     cluster * s->cluster_size);
+
+        dedup_lock_cluster(s, cluster);
+
+        if (n < cluster_bytes) {
+            QEMUIOVector local_qiov;
+
+            qemu_iovec_init_buf(&local_qiov, buf, s->cluster_size);
+            ret = dedup_co_read_cluster(bs, cluster, 0, s->cluster_size,
+                                        &local_qiov, 0);
+        } else if (cluster_bytes < s->cluster_size) {
+            /* The tail of the last cluster is not part of the image */
+            memset(buf + cluster_bytes, 0, s->cluster_size - cluster_bytes);
+        }
+        if (ret >= 0) {
+            qemu_iovec_to_buf(qiov, qiov_offset, buf + offset_in_cluster, n);
+            ret = dedup_co_write_cluster(bs, cluster, buf);
+        }
+
+        dedup_unlock_cluster(s, cluster);
+        if (ret < 0) {
+            break;
+        }
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    qemu_vfree(buf);
+    return ret < 0 ? ret : 0;
+}
+
+/* Only whole clusters are handled, the rest is left to the caller */
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_zero_clusters(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    uint64_t cluster;
+    int ret;
+
+    if (offset % s->cluster_size ||
+        (end % s->cluster_size &&
+         end != bs->total_sectors * BDRV_SECTOR_SIZE)) {
+        return -ENOTSUP;
+    }
+
+    for (cluster = offset / s->cluster_size;
+         cluster < DIV_ROUND_UP(end, s->cluster_size); cluster++)
+    {
+        dedup_lock_cluster(s, cluster);
+        ret = dedup_co_set_entry(bs, cluster, 0);
+        dedup_unlock_cluster(s, cluster);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                       BdrvRequestFlags flags)
+{
+    return dedup_co_zero_clusters(bs, offset, bytes);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+dedup_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    return dedup_co_zero_clusters(bs, offset, bytes);
+}
+
+static int coroutine_fn GRAPH_RDLOCK dedup_co_flush_to_os(BlockDriverState *bs)
+{
+    return dedup_co_apply_unrefs(bs);
+}
+
+static int GRAPH_RDLOCK dedup_has_zero_init(BlockDriverState *bs)
+{
+    return 1;
+}
+
+static void dedup_close(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    /* References that could not be dropped are leaked */
+    g_array_free(s->unrefs, true);
+    g_array_free(s->busy_clusters, true);
+    dedup_store_put(s);
+    qemu_vfree(s->table);
+
+    migrate_del_blocker(&s->migration_blocker);
+}
+
+/* Initialize the store @filename unless it is already in use */
+static int coroutine_fn GRAPH_UNLOCKED
+dedup_co_create_store(const char *filename, uint32_t cluster_size,
+                      Error **errp)
+{
+    BlockBackend *blk;
+    DedupStoreHeader header;
+    int64_t len;
+    int ret;
+
+    blk = blk_co_new_open(filename, NULL, NULL,
+                          BDRV_O_RDWR | BDRV_O_RESIZE | BDRV_O_PROTOCOL, NULL);
+    if (!blk) {
+        QemuOpts *opts = qemu_opts_create(&dedup_create_opts, NULL, 0,
+                                          &error_abort);
+
+        qemu_opt_set_number(opts, BLOCK_OPT_SIZE, 0, &error_abort);
+        ret = bdrv_co_create_file(filename, opts, errp);
+        qemu_opts_del(opts);
+        if (ret < 0) {
+            return ret;
+        }
+
+        blk = blk_co_new_open(filename, NULL, NULL,
+                              BDRV_O_RDWR | BDRV_O_RESIZE | BDRV_O_PROTOCOL,
+                              errp);
+        if (!blk) {
+            return -EIO;
+        }
+    }
+    blk_set_allow_write_beyond_eof(blk, true);
+
+    len = blk_co_getlength(blk);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the size of the store");
+        ret = len;
+        goto out;
+    }
+
+    if (len) {
+        ret = blk_co_pread(blk, 0, sizeof(header), &header, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the store header");
+            goto out;
+        }
+        if (be32_to_cpu(header.magic) != DEDUP_STORE_MAGIC) {
+            error_setg(errp, "'%s' is not a dedup store", filename);
+            ret = -EINVAL;
+        } else if (be32_to_cpu(header.cluster_size) != cluster_size) {
+            error_setg(errp, "Store cluster size %" PRIu32 " does not match "
+                       "the image cluster size %" PRIu32,
+                       be32_to_cpu(header.cluster_size), cluster_size);
+            ret = -EINVAL;
+        }
+        goto out;
+    }
+
+    header = (DedupStoreHeader) {
+        .magic = cpu_to_be32(DEDUP_STORE_MAGIC),
+        .version = cpu_to_be32(DEDUP_VERSION),
+        .cluster_size = cpu_to_be32(cluster_size),
+    };
+    ret = blk_co_pwrite(blk, 0, sizeof(header), &header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the store header");
+        goto out;
+    }
+    ret = blk_co_pwrite_zeroes(blk, sizeof(header),
+                               cluster_size - sizeof(header), 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the store header");
+        goto out;
+    }
+
+out:
+    blk_co_unref(blk);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_UNLOCKED
+dedup_co_create_opts(BlockDriver *drv, const char *filename,
+                     QemuOpts *opts, Error **errp)
+{
+    BlockBackend *blk = NULL;
+    g_autofree char *store = NULL;
+    g_autofree char *full_store = NULL;
+    g_autofree uint8_t *buf = NULL;
+    DedupMapHeader *header;
+    uint64_t size, cluster_size, nb_clusters, table_size;
+    size_t store_len;
+    int ret;
+
+    size = ROUND_UP(qemu_opt_get_size_del(opts, BLOCK_OPT_SIZE, 0),
+                    BDRV_SECTOR_SIZE);
+    cluster_size = qemu_opt_get_size_del(opts, BLOCK_OPT_CLUSTER_SIZE,
+                                         DEDUP_DEFAULT_CLUSTER_SIZE);
+    store = qemu_opt_get_del(opts, BLOCK_OPT_STORE);
+
+    if (cluster_size < DEDUP_MIN_CLUSTER_SIZE ||
+        cluster_size > DEDUP_MAX_CLUSTER_SIZE ||
+        !is_power_of_2(cluster_size)) {
+        error_setg(errp, "Cluster size must be a power of two between "
+                   "%d and %dk", DEDUP_MIN_CLUSTER_SIZE,
+                   (int)(DEDUP_MAX_CLUSTER_SIZE / KiB));
+        return -EINVAL;
+    }
+    nb_clusters = DIV_ROUND_UP(size, cluster_size);
+    if (nb_clusters > DEDUP_MAX_CLUSTERS) {
+        error_setg(errp, "Image size is too large for cluster size %" PRIu64,
+                   cluster_size);
+        return -EINVAL;
+    }
+    if (!store || !store[0]) {
+        error_setg(errp, "The '" BLOCK_OPT_STORE "' option is required");
+        return -EINVAL;
+    }
+    store_len = strlen(store);
+    if (store_len > DEDUP_STORE_NAME_MAX) {
+        error_setg(errp, "Store file name is too long");
+        return -EINVAL;
+    }
+
+    /* The store name in the header is relative to the image */
+    full_store = bdrv_get_full_backing_filename_from_filename(filename, store,
+                                                              errp);
+    if (!full_store) {
+        return -EINVAL;
+    }
+    ret = dedup_co_create_store(full_store, cluster_size, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Create and open the file (protocol layer) */
+    ret = bdrv_co_create_file(filename, opts, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    blk = blk_co_new_open(filename, NULL, NULL,
+                          BDRV_O_RDWR | BDRV_O_RESIZE | BDRV_O_PROTOCOL, errp);
+    if (!blk) {
+        return -EIO;
+    }
+    blk_set_allow_write_beyond_eof(blk, true);
+
+    buf = g_malloc0(DEDUP_HEADER_SIZE);
+    header = (DedupMapHeader *)buf;
+    header->magic = cpu_to_be32(DEDUP_MAP_MAGIC);
+    header->version = cpu_to_be32(DEDUP_VERSION);
+    header->cluster_size = cpu_to_be32(cluster_size);
+    header->store_name_len = cpu_to_be32(store_len);
+    header->size = cpu_to_be64(size);
+    header->table_offset = cpu_to_be64(DEDUP_HEADER_SIZE);
+    memcpy(buf + sizeof(*header), store, store_len);
+
+    ret = blk_co_pwrite(blk, 0, DEDUP_HEADER_SIZE, buf, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the image header");
+        goto out;
+    }
+
+    table_size = ROUND_UP(nb_clusters * sizeof(uint32_t), BDRV_SECTOR_SIZE);
+    if (table_size) {
+        ret = blk_co_pwrite_zeroes(blk, DEDUP_HEADER_SIZE, table_size, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write the cluster table");
+            goto out;
+        }
+    }
+
+out:
+    blk_co_unref(blk);
+    return ret;
+}
+
+static QemuOptsList dedup_create_opts = {
+    .name = "dedup-create-opts",
+    .head = QTAILQ_HEAD_INITIALIZER(dedup_create_opts.head),
+    .desc = {
+        {
+            .name = BLOCK_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Virtual disk size"
+        },
+        {
+            .name = BLOCK_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Deduplication granularity, must match the store",
+            .def_value_str = stringify(DEDUP_DEFAULT_CLUSTER_SIZE)
+        },
+        {
+            .name = BLOCK_OPT_STORE,
+            .type = QEMU_OPT_STRING,
+            .help = "File name of the shared store, which is created "
+                    "if it does not exist"
+        },
+        { /* end of list */ }
+    }
+};
+
+static BlockDriver bdrv_dedup = {
+    .format_name = "dedup",
+    .instance_size = sizeof(BDRVDedupState),
+    .bdrv_probe = dedup_probe,
+    .bdrv_open = dedup_open,
+    .bdrv_close = dedup_close,
+    .bdrv_reopen_prepare = dedup_reopen_prepare,
+    .bdrv_child_perm = dedup_child_perm,
+    .bdrv_refresh_limits = dedup_refresh_limits,
+    .bdrv_co_create_opts = dedup_co_create_opts,
+    .bdrv_has_zero_init = dedup_has_zero_init,
+    .bdrv_co_block_status = dedup_co_block_status,
+
+    .bdrv_co_preadv = dedup_co_preadv,
+    .bdrv_co_pwritev = dedup_co_pwritev,
+    .bdrv_co_pwrite_zeroes = dedup_co_pwrite_zeroes,
+    .bdrv_co_pdiscard = dedup_co_pdiscard,
+    .bdrv_co_flush_to_os = dedup_co_flush_to_os,
+
+    .bdrv_co_get_info = dedup_co_get_info,
+
+    .is_format = true,
+    .create_opts = &dedup_create_opts,
+};
+
+static void bdrv_dedup_init(void)
+{
+    bdrv_register(&bdrv_dedup);
+}
+
+block_init(bdrv_dedup_init);
@@ -36,6 +36,7 @@
 #include "block/thread-pool.h"
 #include "qemu/iov.h"
 #include "block/raw-aio.h"
+#include "system/memory.h" /* for ram_block_discard_disable() */
 #include "qobject/qdict.h"
 #include "qobject/qstring.h"
 
@@ -184,6 +185,15 @@ typedef struct BDRVRawState {
     bool has_laio_fdsync:1;
     bool use_linux_io_uring:1;
     bool use_mpath:1;
+#ifdef CONFIG_LINUX_IO_URING
+    /*
+     * Memory registered with io_uring through this node, which only
+     * happens with aio-fixed-buffers.  RAM discard is disabled while it is
+     * not empty.
+     */
+    GArray *luring_bufs;
+    bool luring_fixed_bufs;
+#endif
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
     bool needs_alignment;
@@ -585,6 +595,14 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+#ifdef CONFIG_LINUX_IO_URING
+        {
+            .name = "aio-fixed-buffers",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest memory with io_uring, which disables "
+                    "RAM discard (default: off)",
+        },
+#endif
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -662,6 +680,12 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+    s->luring_fixed_bufs = qemu_opt_get_bool(opts, "aio-fixed-buffers", false);
+    if (s->luring_fixed_bufs && !s->use_linux_io_uring) {
+        error_setg(errp, "aio-fixed-buffers requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
 #endif
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
@@ -829,6 +853,13 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        s->luring_bufs = g_array_new(false, false, sizeof(struct iovec));
+        luring_register_file(s->fd);
+    }
+#endif
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -2704,6 +2735,85 @@ static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
     return raw_thread_pool_submit(handle_aiocb_flush, &acb);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static bool raw_register_buf(BlockDriverState *bs, void *host, size_t size,
+                             Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+    struct iovec iov = { .iov_base = host, .iov_len = size };
+
+    if (!s->luring_bufs || !s->luring_fixed_bufs) {
+        return true;
+    }
+
+    /*
+     * Registered memory stays pinned, so a discarded page would still be
+     * used for I/O instead of the one that the guest sees afterwards.  If
+     * something relies on discarding RAM, e.g. virtio-mem, keep using plain
+     * buffers.
+     */
+    if (!s->luring_bufs->len && ram_block_discard_disable(true) < 0) {
+        warn_report_once("aio-fixed-buffers: RAM discard is in use, "
+                         "guest memory is not registered with io_uring");
+        return true;
+    }
+
+    luring_register_buf(host, size);
+    g_array_append_val(s->luring_bufs, iov);
+    return true;
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+    guint i;
+
+    if (!s->luring_bufs) {
+        return;
+    }
+
+    for (i = 0; i < s->luring_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->luring_bufs, struct iovec, i);
+
+        if (iov->iov_base == host && iov->iov_len == size) {
+            luring_unregister_buf(host, size);
+            g_array_remove_index_fast(s->luring_bufs, i);
+            if (!s->luring_bufs->len) {
+                ram_block_discard_disable(false);
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * The node may be closed without its buffers being unregistered, e.g. when
+ * it is replaced in the graph.  Registered memory stays pinned and must not
+ * outlive the RAMBlock, so drop it here.
+ */
+static void raw_luring_cleanup(BDRVRawState *s)
+{
+    guint i;
+
+    if (!s->luring_bufs) {
+        return;
+    }
+
+    for (i = 0; i < s->luring_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->luring_bufs, struct iovec, i);
+
+        luring_unregister_buf(iov->iov_base, iov->iov_len);
+    }
+    if (s->luring_bufs->len) {
+        ram_block_discard_disable(false);
+    }
+    g_array_free(s->luring_bufs, true);
+    s->luring_bufs = NULL;
+
+    luring_unregister_file(s->fd);
+}
+#endif
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
@@ -2711,6 +2821,9 @@ static void raw_close(BlockDriverState *bs)
     if (s->fd >= 0) {
 #if defined(CONFIG_BLKZONED)
         g_free(bs->wps);
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+        raw_luring_cleanup(s);
 #endif
         qemu_close(s->fd);
         s->fd = -1;
@@ -3904,6 +4017,12 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+#ifdef CONFIG_LINUX_IO_URING
+        if (s->luring_bufs) {
+            luring_unregister_file(s->fd);
+            luring_register_file(s->perm_change_fd);
+        }
+#endif
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
@@ -3998,6 +4117,10 @@ BlockDriver bdrv_file = {
     .bdrv_co_pwritev        = raw_co_pwritev,
     .bdrv_co_flush_to_disk  = raw_co_flush_to_disk,
     .bdrv_co_pdiscard       = raw_co_pdiscard,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
+#endif
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
     .bdrv_refresh_limits = raw_refresh_limits,
@@ -4456,6 +4579,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_pwritev        = raw_co_pwritev,
     .bdrv_co_flush_to_disk  = raw_co_flush_to_disk,
     .bdrv_co_pdiscard       = hdev_co_pdiscard,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
+#endif
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
     .bdrv_refresh_limits = raw_refresh_limits,
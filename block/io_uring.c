@@ -16,6 +16,10 @@
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "qemu/defer-call.h"
+#include "qemu/lockable.h"
+#include "qemu/bitmap.h"
+#include "qemu/rcu.h"
+#include "qemu/units.h"
 #include "qapi/error.h"
 #include "system/block-backend.h"
 #include "trace.h"
@@ -26,6 +30,13 @@
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Size of the registered buffer and file tables of each ring */
+#define MAX_FIXED_BUFS 1024
+#define MAX_FIXED_FILES 64
+
+/* The kernel does not accept larger registered buffers */
+#define MAX_FIXED_BUF_SIZE (1 * GiB)
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -49,6 +60,19 @@ typedef struct LuringQueue {
     QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
 } LuringQueue;
 
+/*
+ * The buffers and files that a ring has in its registered tables.  The
+ * table is replaced as a whole with luring_fixed_lock held, and submission
+ * looks entries up under RCU.
+ */
+typedef struct LuringFixedTable {
+    struct rcu_head rcu;
+    struct iovec bufs[MAX_FIXED_BUFS];
+    int files[MAX_FIXED_FILES];
+    DECLARE_BITMAP(buf_map, MAX_FIXED_BUFS);
+    DECLARE_BITMAP(file_map, MAX_FIXED_FILES);
+} LuringFixedTable;
+
 struct LuringState {
     AioContext *aio_context;
 
@@ -58,8 +82,277 @@ struct LuringState {
     LuringQueue io_q;
 
     QEMUBH *completion_bh;
+
+    /*
+     * Whether the ring has sparse registered buffer and file tables.  Set
+     * before the ring is added to luring_states.
+     */
+    bool has_fixed_bufs;
+    bool has_fixed_files;
+    /* NULL if the ring has neither table */
+    LuringFixedTable *fixed;
+    QLIST_ENTRY(LuringState) next;
 };
 
+/*
+ * Buffers and files registered with luring_register_buf() and
+ * luring_register_file() are registered with every ring, at the same index
+ * in all of them.  This way, requests can use READ_FIXED/WRITE_FIXED and
+ * fixed files whichever AioContext they are submitted from.
+ *
+ * The process-wide tables below are protected by luring_fixed_lock.
+ * Submission only reads the LuringFixedTable of its ring.
+ */
+typedef struct {
+    struct iovec iov;
+    unsigned refcnt;
+} LuringFixedBuf;
+
+static QemuMutex luring_fixed_lock;
+static QLIST_HEAD(, LuringState) luring_states =
+    QLIST_HEAD_INITIALIZER(luring_states);
+static LuringFixedBuf luring_fixed_bufs[MAX_FIXED_BUFS];
+static int luring_fixed_files[MAX_FIXED_FILES];
+
+static void __attribute__((__constructor__)) luring_fixed_init(void)
+{
+    int i;
+
+    qemu_mutex_init(&luring_fixed_lock);
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        luring_fixed_files[i] = -1;
+    }
+}
+
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+/*
+ * Update entry @slot of the ring's registered buffer table, and record the
+ * result in @t.  Called with luring_fixed_lock held.
+ */
+static void luring_update_fixed_buf(LuringState *s, LuringFixedTable *t,
+                                    int slot)
+{
+    struct iovec *iov = &luring_fixed_bufs[slot].iov;
+    int ret;
+
+    clear_bit(slot, t->buf_map);
+    t->bufs[slot] = *iov;
+    ret = io_uring_register_buffers_update_tag(&s->ring, slot, iov, NULL, 1);
+    trace_luring_update_fixed_buf(s, slot, iov->iov_base, iov->iov_len, ret);
+    if (ret == 1 && iov->iov_base) {
+        set_bit(slot, t->buf_map);
+    }
+}
+
+/* Same for the registered file table */
+static void luring_update_fixed_file(LuringState *s, LuringFixedTable *t,
+                                     int slot)
+{
+    int fd = luring_fixed_files[slot];
+    int ret;
+
+    clear_bit(slot, t->file_map);
+    t->files[slot] = fd;
+    ret = io_uring_register_files_update(&s->ring, slot, &fd, 1);
+    trace_luring_update_fixed_file(s, slot, fd, ret);
+    if (ret == 1 && fd >= 0) {
+        set_bit(slot, t->file_map);
+    }
+}
+
+/*
+ * Create the registered buffer and file tables of a new ring.  This needs
+ * Linux 5.19; with older kernels all requests use plain buffers and fds.
+ */
+static void luring_setup_fixed(LuringState *s)
+{
+    s->has_fixed_bufs =
+        io_uring_register_buffers_sparse(&s->ring, MAX_FIXED_BUFS) == 0;
+    s->has_fixed_files =
+        io_uring_register_files_sparse(&s->ring, MAX_FIXED_FILES) == 0;
+}
+#else
+static void luring_update_fixed_buf(LuringState *s, LuringFixedTable *t,
+                                    int slot)
+{
+    g_assert_not_reached();
+}
+
+static void luring_update_fixed_file(LuringState *s, LuringFixedTable *t,
+                                     int slot)
+{
+    g_assert_not_reached();
+}
+
+static void luring_setup_fixed(LuringState *s)
+{
+}
+#endif
+
+/*
+ * Update entry @slot of the buffer (@file false) or file table in every
+ * ring.  Requests that are being submitted may still use the old table, so
+ * each ring gets a new copy.  Called with luring_fixed_lock held.
+ */
+static void luring_update_fixed_all(int slot, bool file)
+{
+    LuringState *s;
+
+    QLIST_FOREACH(s, &luring_states, next) {
+        LuringFixedTable *old = s->fixed;
+        LuringFixedTable *t;
+
+        if (!(file ? s->has_fixed_files : s->has_fixed_bufs)) {
+            continue;
+        }
+
+        t = g_memdup2(old, sizeof(*old));
+        if (file) {
+            luring_update_fixed_file(s, t, slot);
+        } else {
+            luring_update_fixed_buf(s, t, slot);
+        }
+        qatomic_rcu_set(&s->fixed, t);
+        g_free_rcu(old, rcu);
+    }
+}
+
+void luring_register_buf(void *host, size_t size)
+{
+    QEMU_LOCK_GUARD(&luring_fixed_lock);
+
+    while (size > 0) {
+        size_t len = MIN(size, MAX_FIXED_BUF_SIZE);
+        int slot, free_slot = -1;
+
+        for (slot = 0; slot < MAX_FIXED_BUFS; slot++) {
+            LuringFixedBuf *buf = &luring_fixed_bufs[slot];
+
+            if (!buf->refcnt) {
+                free_slot = free_slot < 0 ? slot : free_slot;
+            } else if (buf->iov.iov_base == host && buf->iov.iov_len == len) {
+                break;
+            }
+        }
+
+        if (slot < MAX_FIXED_BUFS) {
+            luring_fixed_bufs[slot].refcnt++;
+        } else if (free_slot >= 0) {
+            slot = free_slot;
+            luring_fixed_bufs[slot].iov = (struct iovec) {
+                .iov_base = host,
+                .iov_len = len,
+            };
+            luring_fixed_bufs[slot].refcnt = 1;
+            luring_update_fixed_all(slot, false);
+        } else {
+            /* The rest is accessed through plain buffers */
+            return;
+        }
+
+        host += len;
+        size -= len;
+    }
+}
+
+void luring_unregister_buf(void *host, size_t size)
+{
+    QEMU_LOCK_GUARD(&luring_fixed_lock);
+
+    while (size > 0) {
+        size_t len = MIN(size, MAX_FIXED_BUF_SIZE);
+        int slot;
+
+        for (slot = 0; slot < MAX_FIXED_BUFS; slot++) {
+            LuringFixedBuf *buf = &luring_fixed_bufs[slot];
+
+            if (buf->refcnt && buf->iov.iov_base == host &&
+                buf->iov.iov_len == len) {
+                break;
+            }
+        }
+
+        if (slot < MAX_FIXED_BUFS && --luring_fixed_bufs[slot].refcnt == 0) {
+            luring_fixed_bufs[slot].iov = (struct iovec) {};
+            luring_update_fixed_all(slot, false);
+        }
+
+        host += len;
+        size -= len;
+    }
+}
+
+void luring_register_file(int fd)
+{
+    int slot;
+
+    QEMU_LOCK_GUARD(&luring_fixed_lock);
+
+    for (slot = 0; slot < MAX_FIXED_FILES; slot++) {
+        if (luring_fixed_files[slot] < 0) {
+            break;
+        }
+    }
+    if (slot == MAX_FIXED_FILES) {
+        return;
+    }
+
+    luring_fixed_files[slot] = fd;
+    luring_update_fixed_all(slot, true);
+}
+
+void luring_unregister_file(int fd)
+{
+    int slot;
+
+    QEMU_LOCK_GUARD(&luring_fixed_lock);
+
+    for (slot = 0; slot < MAX_FIXED_FILES; slot++) {
+        if (luring_fixed_files[slot] == fd) {
+            break;
+        }
+    }
+    if (slot == MAX_FIXED_FILES) {
+        return;
+    }
+
+    luring_fixed_files[slot] = -1;
+    luring_update_fixed_all(slot, true);
+}
+
+/* Index of the registered buffer in @t that contains @iov, or -1 */
+static int luring_fixed_buf_index(LuringFixedTable *t, struct iovec *iov)
+{
+    int slot;
+
+    for (slot = find_first_bit(t->buf_map, MAX_FIXED_BUFS);
+         slot < MAX_FIXED_BUFS;
+         slot = find_next_bit(t->buf_map, MAX_FIXED_BUFS, slot + 1)) {
+        struct iovec *buf = &t->bufs[slot];
+
+        if (iov->iov_base >= buf->iov_base &&
+            iov->iov_base + iov->iov_len <= buf->iov_base + buf->iov_len) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/* Index of @fd in the registered file table @t, or -1 */
+static int luring_fixed_file_index(LuringFixedTable *t, int fd)
+{
+    int slot;
+
+    for (slot = find_first_bit(t->file_map, MAX_FIXED_FILES);
+         slot < MAX_FIXED_FILES;
+         slot = find_next_bit(t->file_map, MAX_FIXED_FILES, slot + 1)) {
+        if (t->files[slot] == fd) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
 /**
  * luring_resubmit:
  *
@@ -90,6 +383,15 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luringcb->total_read += nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
 
+    /* A registered buffer is contiguous, just skip what was read */
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        luringcb->sqeq.off += nread;
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len = remaining;
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
     /* Shorten qiov */
     resubmit_qiov = &luringcb->resubmit_qiov;
     if (resubmit_qiov->iov == NULL) {
@@ -339,9 +641,36 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    struct iovec *iov = luringcb->qiov ? luringcb->qiov->iov : NULL;
+    int buf_index = -1;
+    int file_index = -1;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        LuringFixedTable *fixed = qatomic_rcu_read(&s->fixed);
+
+        if (fixed) {
+            /* READ_FIXED and WRITE_FIXED take a single buffer */
+            if ((flags & BDRV_REQ_REGISTERED_BUF) && iov &&
+                luringcb->qiov->niov == 1) {
+                buf_index = luring_fixed_buf_index(fixed, iov);
+            }
+            file_index = luring_fixed_file_index(fixed, fd);
+        }
+    }
+    flags &= ~BDRV_REQ_REGISTERED_BUF;
 
     switch (type) {
     case QEMU_AIO_WRITE:
+        if (buf_index >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, iov->iov_base, iov->iov_len,
+                                      offset, buf_index);
+#ifdef HAVE_IO_URING_PREP_WRITEV2
+            sqes->rw_flags = (flags & BDRV_REQ_FUA) ? RWF_DSYNC : 0;
+#else
+            assert(flags == 0);
+#endif
+            break;
+        }
 #ifdef HAVE_IO_URING_PREP_WRITEV2
     {
         int luring_flags = (flags & BDRV_REQ_FUA) ? RWF_DSYNC : 0;
@@ -359,6 +688,11 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                              luringcb->qiov->niov, offset);
         break;
     case QEMU_AIO_READ:
+        if (buf_index >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, iov->iov_base, iov->iov_len,
+                                     offset, buf_index);
+            break;
+        }
         io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
                             luringcb->qiov->niov, offset);
         break;
@@ -370,6 +704,11 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+
+    if (file_index >= 0) {
+        sqes->fd = file_index;
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -432,15 +771,21 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_poll_cb, qemu_luring_poll_ready, s);
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(int64_t sqpoll_idle, Error **errp)
 {
-    int rc;
+    int rc, i;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    struct io_uring_params params = {};
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    if (sqpoll_idle) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = MIN(sqpoll_idle, UINT32_MAX);
+    }
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
     if (rc < 0) {
         error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
@@ -448,12 +793,34 @@ LuringState *luring_init(Error **errp)
     }
 
     ioq_init(&s->io_q);
-    return s;
 
+    QEMU_LOCK_GUARD(&luring_fixed_lock);
+    luring_setup_fixed(s);
+    if (s->has_fixed_bufs || s->has_fixed_files) {
+        /* Not visible to submission yet, so fill it in place */
+        s->fixed = g_new0(LuringFixedTable, 1);
+    }
+    for (i = 0; s->has_fixed_bufs && i < MAX_FIXED_BUFS; i++) {
+        if (luring_fixed_bufs[i].refcnt) {
+            luring_update_fixed_buf(s, s->fixed, i);
+        }
+    }
+    for (i = 0; s->has_fixed_files && i < MAX_FIXED_FILES; i++) {
+        if (luring_fixed_files[i] >= 0) {
+            luring_update_fixed_file(s, s->fixed, i);
+        }
+    }
+    QLIST_INSERT_HEAD(&luring_states, s, next);
+    return s;
 }
 
 void luring_cleanup(LuringState *s)
 {
+    WITH_QEMU_LOCK_GUARD(&luring_fixed_lock) {
+        QLIST_REMOVE(s, next);
+    }
+    /* Only this ring's own AioContext submits, so no reader is left */
+    g_free(s->fixed);
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
@@ -37,6 +37,7 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_DOORBELL_SIZE 4096
+#define NVME_MAX_IO_QUEUES 64
 
 /*
  * We have to leave one slot empty as that is the full queue case where
@@ -80,6 +81,13 @@ typedef struct {
     BDRVNVMeState   *s;
     int             index;
 
+    /*
+     * The AioContext that processes completions, or NULL for an I/O queue
+     * that no AioContext has claimed yet.  Set under s->queue_lock and
+     * cleared with the node drained.
+     */
+    AioContext  *ctx;
+
     /* Fields protected by BQL */
     uint8_t     *prp_list_pages;
 
@@ -94,6 +102,9 @@ typedef struct {
 
     /* Thread-safe, no lock necessary */
     QEMUBH      *completion_bh;
+
+    /* Kicked by the shared IRQ handler if @ctx is not s->aio_context */
+    EventNotifier notifier;
 } NVMeQueuePair;
 
 struct BDRVNVMeState {
@@ -107,10 +118,13 @@ struct BDRVNVMeState {
     } *doorbells;
     /* The submission/completion queue pairs.
      * [0]: admin queue.
-     * [1..]: io queues.
+     * [1]: io queue of s->aio_context.
+     * [2..]: io queues claimed by other AioContexts on first use.
      */
     NVMeQueuePair **queues;
     unsigned queue_count;
+    /* Serializes claiming io queues */
+    QemuMutex queue_lock;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -144,6 +158,7 @@ struct BDRVNVMeState {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_IO_QUEUES "io-queues"
 
 static void nvme_process_completion_bh(void *opaque);
 
@@ -161,6 +176,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_IO_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of I/O queue pairs (default: 1)",
+        },
         { /* end of list */ }
     },
 };
@@ -202,6 +222,7 @@ static void nvme_free_queue_pair(NVMeQueuePair *q)
     nvme_free_queue(&q->sq);
     nvme_free_queue(&q->cq);
     qemu_vfree(q->prp_list_pages);
+    event_notifier_cleanup(&q->notifier);
     qemu_mutex_destroy(&q->lock);
     g_free(q);
 }
@@ -245,10 +266,18 @@ static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
     }
     memset(q->prp_list_pages, 0, bytes);
     qemu_mutex_init(&q->lock);
+    if (event_notifier_init(&q->notifier, 0)) {
+        error_setg(errp, "Failed to init event notifier");
+        goto fail;
+    }
     q->s = s;
     q->index = idx;
+    q->ctx = aio_context;
     qemu_co_queue_init(&q->free_req_queue);
-    q->completion_bh = aio_bh_new(aio_context, nvme_process_completion_bh, q);
+    if (aio_context) {
+        q->completion_bh = aio_bh_new(aio_context, nvme_process_completion_bh,
+                                      q);
+    }
     r = qemu_vfio_dma_map(s->vfio, q->prp_list_pages, bytes,
                           false, &prp_list_iova, errp);
     if (r) {
@@ -345,7 +374,7 @@ static void nvme_put_free_req_locked(NVMeQueuePair *q, NVMeRequest *req)
 static void nvme_wake_free_req_locked(NVMeQueuePair *q)
 {
     if (!qemu_co_queue_empty(&q->free_req_queue)) {
-        replay_bh_schedule_oneshot_event(q->s->aio_context,
+        replay_bh_schedule_oneshot_event(qatomic_read(&q->ctx),
                 nvme_free_req_queue_cb, q);
     }
 }
@@ -487,7 +516,11 @@ static void nvme_deferred_fn(void *opaque)
 
     QEMU_LOCK_GUARD(&q->lock);
     nvme_kick(q);
-    nvme_process_completion(q);
+
+    /* Completions of a shared queue are only processed by its owner */
+    if (qatomic_read(&q->ctx) == qemu_get_current_aio_context()) {
+        nvme_process_completion(q);
+    }
 }
 
 static void nvme_submit_command(NVMeQueuePair *q, NVMeRequest *req,
@@ -626,18 +659,24 @@ out:
     return ret;
 }
 
-static void nvme_poll_queue(NVMeQueuePair *q)
+/*
+ * Check whether the device posted a completion.  q->lock isn't needed
+ * because nvme_process_completion() only runs in the thread of q->ctx and
+ * cannot race with itself.
+ */
+static bool nvme_cq_pending(NVMeQueuePair *q)
 {
     const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
     NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
 
+    return (le16_to_cpu(cqe->status) & 0x1) != q->cq_phase;
+}
+
+static void nvme_poll_queue(NVMeQueuePair *q)
+{
     trace_nvme_poll_queue(q->s, q->index);
-    /*
-     * Do an early check for completions. q->lock isn't needed because
-     * nvme_process_completion() only runs in the event loop thread and
-     * cannot race with itself.
-     */
-    if ((le16_to_cpu(cqe->status) & 0x1) == q->cq_phase) {
+    /* Do an early check for completions. */
+    if (!nvme_cq_pending(q)) {
         return;
     }
 
@@ -648,12 +687,17 @@ static void nvme_poll_queue(NVMeQueuePair *q)
     qemu_mutex_unlock(&q->lock);
 }
 
+/* Process the completions of the queues owned by s->aio_context */
 static void nvme_poll_queues(BDRVNVMeState *s)
 {
     int i;
 
     for (i = 0; i < s->queue_count; i++) {
-        nvme_poll_queue(s->queues[i]);
+        NVMeQueuePair *q = s->queues[i];
+
+        if (qatomic_read(&q->ctx) == s->aio_context) {
+            nvme_poll_queue(q);
+        }
     }
 }
 
@@ -661,13 +705,137 @@ static void nvme_handle_event(EventNotifier *n)
 {
     BDRVNVMeState *s = container_of(n, BDRVNVMeState,
                                     irq_notifier[MSIX_SHARED_IRQ_IDX]);
+    int i;
 
     trace_nvme_handle_event(s);
     event_notifier_test_and_clear(n);
     nvme_poll_queues(s);
+
+    /*
+     * All queues share one interrupt vector, wake up the AioContexts of the
+     * other queues.  While they are polling they usually have reaped the
+     * completions already.
+     */
+    for (i = INDEX_IO(1); i < s->queue_count; i++) {
+        NVMeQueuePair *q = s->queues[i];
+        AioContext *ctx = qatomic_load_acquire(&q->ctx);
+
+        if (ctx && ctx != s->aio_context) {
+            event_notifier_set(&q->notifier);
+        }
+    }
+}
+
+static void nvme_queue_handle_event(EventNotifier *n)
+{
+    NVMeQueuePair *q = container_of(n, NVMeQueuePair, notifier);
+
+    event_notifier_test_and_clear(n);
+    nvme_poll_queue(q);
+}
+
+static bool nvme_queue_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NVMeQueuePair *q = container_of(e, NVMeQueuePair, notifier);
+
+    return nvme_cq_pending(q);
 }
 
-static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
+static void nvme_queue_poll_ready(EventNotifier *e)
+{
+    NVMeQueuePair *q = container_of(e, NVMeQueuePair, notifier);
+
+    nvme_poll_queue(q);
+}
+
+/*
+ * Let the current AioContext process the completions of an io queue that
+ * no other AioContext uses yet.  Polling the completion queue from
+ * aio_poll() lets IOThreads reap completions without waiting for the
+ * interrupt to be forwarded by s->aio_context.
+ */
+static NVMeQueuePair *nvme_claim_io_queue(BDRVNVMeState *s, AioContext *ctx)
+{
+    NVMeQueuePair *q;
+    int i;
+
+    QEMU_LOCK_GUARD(&s->queue_lock);
+    for (i = INDEX_IO(1); i < s->queue_count; i++) {
+        q = s->queues[i];
+        if (q->ctx == ctx) {
+            return q;
+        }
+        if (!q->ctx) {
+            trace_nvme_claim_io_queue(s, q->index, ctx);
+            q->completion_bh = aio_bh_new(ctx, nvme_process_completion_bh, q);
+            aio_set_event_notifier(ctx, &q->notifier, nvme_queue_handle_event,
+                                   nvme_queue_poll_cb, nvme_queue_poll_ready);
+            qatomic_store_release(&q->ctx, ctx);
+            return q;
+        }
+    }
+    return NULL;
+}
+
+/* Return the io queue for requests submitted from the current AioContext */
+static NVMeQueuePair *nvme_get_io_queue(BDRVNVMeState *s)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    unsigned n = s->queue_count - INDEX_IO(0);
+    NVMeQueuePair *q;
+    int i;
+
+    assert(n > 0);
+    for (i = INDEX_IO(0); i < s->queue_count; i++) {
+        q = s->queues[i];
+        if (qatomic_load_acquire(&q->ctx) == ctx) {
+            return q;
+        }
+    }
+
+    q = nvme_claim_io_queue(s, ctx);
+    if (q) {
+        return q;
+    }
+
+    /* More AioContexts than queues, share one with another AioContext */
+    return s->queues[INDEX_IO(((uintptr_t)ctx >> 6) % n)];
+}
+
+static void nvme_release_io_queue_bh(void *opaque)
+{
+    NVMeQueuePair *q = opaque;
+
+    aio_set_event_notifier(q->ctx, &q->notifier, NULL, NULL, NULL);
+    qemu_bh_delete(q->completion_bh);
+    q->completion_bh = NULL;
+    qatomic_set(&q->ctx, NULL);
+}
+
+/*
+ * Take back the io queues claimed by other AioContexts, which may go away
+ * once the node is no longer used from them.  Called with the node drained.
+ */
+static void nvme_release_io_queues(BDRVNVMeState *s)
+{
+    int i;
+
+    for (i = INDEX_IO(1); i < s->queue_count; i++) {
+        NVMeQueuePair *q = s->queues[i];
+
+        if (q->ctx) {
+            aio_wait_bh_oneshot(q->ctx, nvme_release_io_queue_bh, q);
+        }
+    }
+}
+
+/*
+ * Create an io queue whose completions are processed in @aio_context, or
+ * in the AioContext that claims it if @aio_context is NULL.
+ */
+static bool nvme_add_io_queue(BlockDriverState *bs, AioContext *aio_context,
+                              Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     unsigned n = s->queue_count;
@@ -676,8 +844,7 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     unsigned queue_size = NVME_QUEUE_SIZE;
 
     assert(n <= UINT16_MAX);
-    q = nvme_create_queue_pair(s, bdrv_get_aio_context(bs),
-                               n, queue_size, errp);
+    q = nvme_create_queue_pair(s, aio_context, n, queue_size, errp);
     if (!q) {
         return false;
     }
@@ -699,12 +866,18 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     };
     if (nvme_admin_cmd_sync(bs, &cmd)) {
         error_setg(errp, "Failed to create SQ io queue [%u]", n);
-        goto out_error;
+        goto out_delete_cq;
     }
     s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
     s->queues[n] = q;
     s->queue_count++;
     return true;
+out_delete_cq:
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_DELETE_CQ,
+        .cdw10 = cpu_to_le32(n),
+    };
+    nvme_admin_cmd_sync(bs, &cmd);
 out_error:
     nvme_free_queue_pair(q);
     return false;
@@ -719,14 +892,8 @@ static bool nvme_poll_cb(void *opaque)
 
     for (i = 0; i < s->queue_count; i++) {
         NVMeQueuePair *q = s->queues[i];
-        const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
-        NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
 
-        /*
-         * q->lock isn't needed because nvme_process_completion() only runs in
-         * the event loop thread and cannot race with itself.
-         */
-        if ((le16_to_cpu(cqe->status) & 0x1) != q->cq_phase) {
+        if (qatomic_read(&q->ctx) == s->aio_context && nvme_cq_pending(q)) {
             return true;
         }
     }
@@ -742,7 +909,7 @@ static void nvme_poll_ready(EventNotifier *e)
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     unsigned io_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q;
@@ -754,9 +921,11 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     uint64_t timeout_ms;
     uint64_t deadline, now;
     NvmeBar *regs = NULL;
+    unsigned requested;
 
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
+    qemu_mutex_init(&s->queue_lock);
     s->device = g_strdup(device);
     s->nsid = namespace;
     s->aio_context = bdrv_get_aio_context(bs);
@@ -885,10 +1054,43 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         goto out;
     }
 
+    /* Each queue pair takes one entry in the doorbell area */
+    requested = io_queues;
+    io_queues = MIN(io_queues, NVME_DOORBELL_SIZE /
+                    (sizeof(*s->doorbells) * s->doorbell_scale) - 1);
+    if (io_queues > 1) {
+        NvmeCmd cmd = {
+            .opcode = NVME_ADM_CMD_SET_FEATURES,
+            .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+            .cdw11 = cpu_to_le32(((io_queues - 1) << 16) | (io_queues - 1)),
+        };
+
+        /*
+         * The controller may allocate fewer queues than requested, creating
+         * the extra ones below fails then.
+         */
+        nvme_admin_cmd_sync(bs, &cmd);
+    }
+
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    if (!nvme_add_io_queue(bs, aio_context, errp)) {
         ret = -EIO;
+        goto out;
     }
+    for (unsigned i = 1; i < io_queues; i++) {
+        Error *local_err = NULL;
+
+        if (!nvme_add_io_queue(bs, NULL, &local_err)) {
+            /*
+             * Not worth a warning: the queues are spread over the
+             * AioContexts that submit requests, and any number works.
+             */
+            trace_nvme_add_io_queue_failed(s, i, error_get_pretty(local_err));
+            error_free(local_err);
+            break;
+        }
+    }
+    trace_nvme_io_queues(s, requested, s->queue_count - INDEX_IO(0));
 out:
     if (regs) {
         qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)regs, 0, sizeof(NvmeBar));
@@ -957,10 +1159,12 @@ static void nvme_close(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
 
+    nvme_release_io_queues(s);
     for (unsigned i = 0; i < s->queue_count; ++i) {
         nvme_free_queue_pair(s->queues[i]);
     }
     g_free(s->queues);
+    qemu_mutex_destroy(&s->queue_lock);
     aio_set_event_notifier(bdrv_get_aio_context(bs),
                            &s->irq_notifier[MSIX_SHARED_IRQ_IDX],
                            NULL, NULL, NULL);
@@ -978,6 +1182,7 @@ static int nvme_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    uint64_t io_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -993,7 +1198,14 @@ static int nvme_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    io_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_IO_QUEUES, 1);
+    if (io_queues < 1 || io_queues > NVME_MAX_IO_QUEUES) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_IO_QUEUES "' must be between 1 "
+                   "and %d", NVME_MAX_IO_QUEUES);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, io_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -1193,7 +1405,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1206,7 +1418,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw12 = cpu_to_le32(cdw12),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1314,14 +1526,14 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1345,7 +1557,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     uint32_t cdw12;
 
@@ -1372,7 +1584,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1408,7 +1620,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int64_t bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     QEMU_AUTO_VFREE NvmeDsmRange *buf = NULL;
     QEMUIOVector local_qiov;
@@ -1422,7 +1634,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1552,7 +1764,8 @@ static void nvme_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
 
-    for (unsigned i = 0; i < s->queue_count; i++) {
+    nvme_release_io_queues(s);
+    for (unsigned i = 0; i < INDEX_IO(1); i++) {
         NVMeQueuePair *q = s->queues[i];
 
         qemu_bh_delete(q->completion_bh);
@@ -1574,9 +1787,10 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
                            nvme_handle_event, nvme_poll_cb,
                            nvme_poll_ready);
 
-    for (unsigned i = 0; i < s->queue_count; i++) {
+    for (unsigned i = 0; i < INDEX_IO(1); i++) {
         NVMeQueuePair *q = s->queues[i];
 
+        q->ctx = new_context;
         q->completion_bh =
             aio_bh_new(new_context, nvme_process_completion_bh, q);
     }
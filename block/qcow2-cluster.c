@@ -70,6 +70,7 @@ int coroutine_fn qcow2_shrink_l1_table(BlockDriverState *bs,
                             s->cluster_size, QCOW2_DISCARD_ALWAYS);
         s->l1_table[i] = 0;
     }
+    qcow2_map_cache_invalidate(s);
     return 0;
 
 fail:
@@ -80,6 +81,7 @@ fail:
      */
     memset(s->l1_table + new_l1_size, 0,
            (s->l1_size - new_l1_size) * L1E_SIZE);
+    qcow2_map_cache_invalidate(s);
     return ret;
 }
 
@@ -347,6 +349,7 @@ static int GRAPH_RDLOCK l2_allocate(BlockDriverState *bs, int l1_index)
 
         trace_qcow2_l2_allocate_write_l2(bs, l1_index);
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        qcow2_map_cache_invalidate(s);
         qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
     }
 
@@ -874,6 +877,7 @@ qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     BLKDBG_CO_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    qcow2_map_cache_invalidate(s);
     set_l2_entry(s, l2_slice, l2_index, cluster_offset);
     if (has_subclusters(s)) {
         set_l2_bitmap(s, l2_slice, l2_index, 0);
@@ -1062,6 +1066,7 @@ int coroutine_fn qcow2_alloc_cluster_link_l2(BlockDriverState *bs,
         goto err;
     }
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    qcow2_map_cache_invalidate(s);
 
     assert(l2_index + m->nb_clusters <= s->l2_slice_size);
     assert(m->cow_end.offset + m->cow_end.nb_bytes <=
@@ -1971,6 +1976,7 @@ discard_in_l2_slice(BlockDriverState *bs, uint64_t offset, uint64_t nb_clusters,
 
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        qcow2_map_cache_invalidate(s);
         set_l2_entry(s, l2_slice, l2_index + i, new_l2_entry);
         if (has_subclusters(s)) {
             set_l2_bitmap(s, l2_slice, l2_index + i, new_l2_bitmap);
@@ -2083,6 +2089,7 @@ zero_in_l2_slice(BlockDriverState *bs, uint64_t offset,
 
         /* First update L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        qcow2_map_cache_invalidate(s);
         set_l2_entry(s, l2_slice, l2_index + i, new_l2_entry);
         if (has_subclusters(s)) {
             set_l2_bitmap(s, l2_slice, l2_index + i, new_l2_bitmap);
@@ -2145,6 +2152,7 @@ zero_l2_subclusters(BlockDriverState *bs, uint64_t offset,
     if (old_l2_bitmap != l2_bitmap) {
         set_l2_bitmap(s, l2_slice, l2_index, l2_bitmap);
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        qcow2_map_cache_invalidate(s);
     }
 
     ret = 0;
@@ -2415,6 +2423,7 @@ expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             if (is_active_l1) {
                 if (l2_dirty) {
                     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+                    qcow2_map_cache_invalidate(s);
                     qcow2_cache_depends_on_flush(s->l2_table_cache);
                 }
                 qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
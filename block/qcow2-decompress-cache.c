@@ -0,0 +1,487 @@
+/*
+ * Cache and read-ahead of compressed clusters for the QCOW2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "block/aio_task.h"
+#include "block/block-io.h"
+#include "block/block_int-io.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/*
+ * Guests usually read compressed images with requests smaller than a
+ * cluster, so without a cache every request decompresses the whole
+ * cluster again.  The cache keeps the most recently decompressed clusters,
+ * keyed by their L2 entry.
+ *
+ * Entries are tagged with s->map_gen at the time the L2 entry was looked
+ * up, like the mapping cache, and are only valid while no L2 table was
+ * modified since.  This covers compressed clusters being freed and their
+ * host clusters reused.  Compressed images are mostly read-only backing
+ * files, where the entries stay valid forever.
+ *
+ * When a request reads the compressed cluster that follows the previous
+ * one, the next clusters are read ahead in a background coroutine: their
+ * compressed data is read with a single request if it is contiguous in
+ * the image file, which it is for images written by qemu-img convert, and
+ * decompressed in parallel on the thread pool.
+ */
+#define QCOW2_DECOMPRESS_CACHE_SIZE (2 * MiB)
+#define QCOW2_DECOMPRESS_CACHE_MIN_ENTRIES 4
+#define QCOW2_DECOMPRESS_CACHE_MAX_ENTRIES 32
+#define QCOW2_READAHEAD_CLUSTERS 8
+
+typedef struct Qcow2DecompressEntry {
+    /* L2 entry of the compressed cluster, 0 for an unused entry */
+    uint64_t l2_entry;
+    unsigned gen;
+    /* The data is being decompressed, wait on c->loaded */
+    bool loading;
+    uint64_t lru_counter;
+    uint8_t *data;
+} Qcow2DecompressEntry;
+
+struct Qcow2DecompressCache {
+    QemuMutex lock;
+    CoQueue loaded;
+    uint64_t lru_counter;
+
+    /* Guest cluster index of the last compressed cluster that was read */
+    uint64_t last_cluster;
+    /* End of the clusters that were read ahead, as a guest cluster index */
+    uint64_t readahead_end;
+    bool readahead_running;
+
+    int size;
+    Qcow2DecompressEntry entries[];
+};
+
+Qcow2DecompressCache *qcow2_decompress_cache_new(BDRVQcow2State *s)
+{
+    Qcow2DecompressCache *c;
+    int size = QCOW2_DECOMPRESS_CACHE_SIZE / s->cluster_size;
+
+    size = MIN(MAX(size, QCOW2_DECOMPRESS_CACHE_MIN_ENTRIES),
+               QCOW2_DECOMPRESS_CACHE_MAX_ENTRIES);
+    c = g_malloc0(sizeof(*c) + size * sizeof(c->entries[0]));
+    c->size = size;
+    qemu_mutex_init(&c->lock);
+    qemu_co_queue_init(&c->loaded);
+    return c;
+}
+
+void qcow2_decompress_cache_free(Qcow2DecompressCache *c)
+{
+    int i;
+
+    if (!c) {
+        return;
+    }
+
+    assert(!c->readahead_running);
+    for (i = 0; i < c->size; i++) {
+        assert(!c->entries[i].loading);
+        g_free(c->entries[i].data);
+    }
+    qemu_mutex_destroy(&c->lock);
+    g_free(c);
+}
+
+/* Drop all cached clusters that are not being loaded */
+void qcow2_decompress_cache_clear(Qcow2DecompressCache *c)
+{
+    int i;
+
+    if (!c) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&c->lock);
+    for (i = 0; i < c->size; i++) {
+        if (!c->entries[i].loading) {
+            c->entries[i].l2_entry = 0;
+        }
+    }
+}
+
+/* Called with c->lock held */
+static Qcow2DecompressEntry *
+qcow2_decompress_cache_find(BDRVQcow2State *s, Qcow2DecompressCache *c,
+                            uint64_t l2_entry)
+{
+    unsigned gen = qatomic_read(&s->map_gen);
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2DecompressEntry *e = &c->entries[i];
+
+        if (e->l2_entry == l2_entry && e->gen == gen) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Evict the least recently used entry that is not being loaded and mark it
+ * as loading @l2_entry, looked up with generation @gen.  Returns NULL if
+ * the data must not be cached, or if all entries are being loaded.
+ *
+ * Called with c->lock held.
+ */
+static Qcow2DecompressEntry *
+qcow2_decompress_cache_reserve(BDRVQcow2State *s, Qcow2DecompressCache *c,
+                               uint64_t l2_entry, unsigned gen)
+{
+    Qcow2DecompressEntry *victim = NULL;
+    int i;
+
+    if (!gen || gen != qatomic_read(&s->map_gen)) {
+        return NULL;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2DecompressEntry *e = &c->entries[i];
+
+        if (e->loading) {
+            continue;
+        }
+        if (!e->l2_entry) {
+            victim = e;
+            break;
+        }
+        if (!victim || e->lru_counter < victim->lru_counter) {
+            victim = e;
+        }
+    }
+    if (!victim) {
+        return NULL;
+    }
+
+    if (!victim->data) {
+        victim->data = g_try_malloc(s->cluster_size);
+        if (!victim->data) {
+            return NULL;
+        }
+    }
+    victim->l2_entry = l2_entry;
+    victim->gen = gen;
+    victim->loading = true;
+    victim->lru_counter = ++c->lru_counter;
+    return victim;
+}
+
+/* Called with c->lock held */
+static void coroutine_fn
+qcow2_decompress_cache_loaded(BDRVQcow2State *s, Qcow2DecompressCache *c,
+                              Qcow2DecompressEntry *e, bool success)
+{
+    e->loading = false;
+    if (!success || e->gen != qatomic_read(&s->map_gen)) {
+        e->l2_entry = 0;
+    }
+    qemu_co_queue_restart_all(&c->loaded);
+}
+
+/*
+ * Read the compressed data of @l2_entry, or take it from @buf if the caller
+ * already read it, and decompress it to @dest.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_decompress_cluster(BlockDriverState *bs, uint64_t l2_entry,
+                            const uint8_t *buf, uint8_t *dest)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autofree uint8_t *local_buf = NULL;
+    uint64_t coffset;
+    int csize;
+    int ret;
+
+    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+
+    if (!buf) {
+        local_buf = g_try_malloc(csize);
+        if (!local_buf) {
+            return -ENOMEM;
+        }
+
+        BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+        ret = bdrv_co_pread(bs->file, coffset, csize, local_buf, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        buf = local_buf;
+    }
+
+    if (qcow2_co_decompress(bs, dest, s->cluster_size, buf, csize) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+typedef struct Qcow2ReadaheadTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    Qcow2DecompressEntry *entry;
+    uint64_t l2_entry;
+    /* Compressed data if it was read in a batch, else NULL */
+    const uint8_t *buf;
+} Qcow2ReadaheadTask;
+
+/*
+ * This function can count as GRAPH_RDLOCK because
+ * qcow2_co_readahead_entry() holds the graph lock and keeps it until this
+ * coroutine has terminated.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_readahead_task_entry(AioTask *task)
+{
+    Qcow2ReadaheadTask *t = container_of(task, Qcow2ReadaheadTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+    Qcow2DecompressCache *c = s->decompress_cache;
+    int ret;
+
+    ret = qcow2_co_decompress_cluster(t->bs, t->l2_entry, t->buf,
+                                      t->entry->data);
+
+    WITH_QEMU_LOCK_GUARD(&c->lock) {
+        qcow2_decompress_cache_loaded(s, c, t->entry, ret == 0);
+    }
+
+    /* Errors are reported when the guest reads the cluster */
+    return 0;
+}
+
+typedef struct Qcow2Readahead {
+    BlockDriverState *bs;
+    uint64_t cluster;
+    uint64_t end;
+} Qcow2Readahead;
+
+static void coroutine_fn qcow2_co_readahead_entry(void *opaque)
+{
+    Qcow2Readahead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressCache *c = s->decompress_cache;
+    Qcow2DecompressEntry *entries[QCOW2_READAHEAD_CLUSTERS];
+    uint64_t l2_entries[QCOW2_READAHEAD_CLUSTERS];
+    uint64_t first = ra->cluster;
+    uint64_t start = 0, end = 0, prev = 0;
+    g_autofree uint8_t *buf = NULL;
+    AioTaskPool *aio;
+    bool contiguous = true;
+    int n = 0, i;
+
+    GRAPH_RDLOCK_GUARD();
+
+    for (; ra->cluster < ra->end; ra->cluster++) {
+        uint64_t offset = ra->cluster << s->cluster_bits;
+        unsigned int bytes = s->cluster_size;
+        QCow2SubclusterType type;
+        uint64_t l2_entry, coffset;
+        unsigned gen;
+        int csize;
+        int ret;
+
+        if (offset >= bs->total_sectors * BDRV_SECTOR_SIZE) {
+            break;
+        }
+
+        qemu_co_mutex_lock(&s->lock);
+        gen = qcow2_map_cache_generation(s);
+        ret = qcow2_get_host_offset(bs, offset, &bytes, &l2_entry, &type);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0 || type != QCOW2_SUBCLUSTER_COMPRESSED) {
+            break;
+        }
+
+        qemu_mutex_lock(&c->lock);
+        if (qcow2_decompress_cache_find(s, c, l2_entry)) {
+            qemu_mutex_unlock(&c->lock);
+            continue;
+        }
+        entries[n] = qcow2_decompress_cache_reserve(s, c, l2_entry, gen);
+        qemu_mutex_unlock(&c->lock);
+        if (!entries[n]) {
+            break;
+        }
+        l2_entries[n++] = l2_entry;
+
+        /*
+         * The size in the L2 entry is rounded up to sectors, so the data
+         * of packed clusters overlaps by up to a sector.
+         */
+        qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+        if (n == 1) {
+            start = coffset;
+        } else if (coffset < prev || coffset > end + BDRV_SECTOR_SIZE) {
+            contiguous = false;
+        }
+        prev = coffset;
+        end = MAX(end, coffset + csize);
+    }
+
+    if (!n) {
+        goto out;
+    }
+
+    trace_qcow2_readahead(bs, first, n, contiguous);
+
+    /*
+     * Compressed clusters written in guest order are packed in the image
+     * file, so a single request can fetch all of them.
+     */
+    if (n > 1 && contiguous &&
+        end - start <= (uint64_t)n * s->cluster_size) {
+        buf = g_try_malloc(end - start);
+        if (buf) {
+            BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+            if (bdrv_co_pread(bs->file, start, end - start, buf, 0) < 0) {
+                g_free(g_steal_pointer(&buf));
+            }
+        }
+    }
+
+    aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+    for (i = 0; i < n; i++) {
+        Qcow2ReadaheadTask *t = g_new(Qcow2ReadaheadTask, 1);
+        const uint8_t *src = NULL;
+
+        if (buf) {
+            uint64_t coffset;
+            int csize;
+
+            qcow2_parse_compressed_l2_entry(bs, l2_entries[i], &coffset,
+                                            &csize);
+            src = buf + (coffset - start);
+        }
+
+        *t = (Qcow2ReadaheadTask) {
+            .task.func = qcow2_co_readahead_task_entry,
+            .bs = bs,
+            .entry = entries[i],
+            .l2_entry = l2_entries[i],
+            .buf = src,
+        };
+        aio_task_pool_start_task(aio, &t->task);
+    }
+    aio_task_pool_wait_all(aio);
+    aio_task_pool_free(aio);
+
+out:
+    WITH_QEMU_LOCK_GUARD(&c->lock) {
+        c->readahead_running = false;
+    }
+    g_free(ra);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Called after a request read the compressed cluster @cluster.  Starts
+ * read-ahead of the following clusters if the guest reads sequentially
+ * and is getting close to the end of the clusters read ahead so far.
+ */
+static void coroutine_fn
+qcow2_decompress_cache_readahead(BlockDriverState *bs, uint64_t cluster)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressCache *c = s->decompress_cache;
+    Qcow2Readahead *ra;
+    uint64_t start, end;
+
+    WITH_QEMU_LOCK_GUARD(&c->lock) {
+        bool sequential = cluster == c->last_cluster + 1;
+
+        c->last_cluster = cluster;
+        if (!sequential || c->readahead_running ||
+            cluster + QCOW2_READAHEAD_CLUSTERS / 2 < c->readahead_end) {
+            return;
+        }
+
+        start = MAX(cluster + 1, c->readahead_end);
+        end = cluster + 1 + QCOW2_READAHEAD_CLUSTERS;
+        c->readahead_end = end;
+        c->readahead_running = true;
+    }
+
+    ra = g_new(Qcow2Readahead, 1);
+    *ra = (Qcow2Readahead) {
+        .bs = bs,
+        .cluster = start,
+        .end = end,
+    };
+
+    /* Keep drain waiting until the read-ahead is done */
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(qemu_get_current_aio_context(),
+                 qemu_coroutine_create(qcow2_co_readahead_entry, ra));
+}
+
+/*
+ * Read @bytes at guest @offset from the compressed cluster described by
+ * @l2_entry, which was looked up with generation @gen, into @qiov.
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_preadv_compressed_cached(BlockDriverState *bs, unsigned gen,
+                                  uint64_t l2_entry, uint64_t offset,
+                                  uint64_t bytes, QEMUIOVector *qiov,
+                                  size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressCache *c = s->decompress_cache;
+    Qcow2DecompressEntry *e;
+    uint8_t *out_buf = NULL;
+    int offset_in_cluster = offset_into_cluster(s, offset);
+    int ret;
+
+    qemu_mutex_lock(&c->lock);
+    while ((e = qcow2_decompress_cache_find(s, c, l2_entry)) && e->loading) {
+        qemu_co_queue_wait(&c->loaded, &c->lock);
+    }
+    if (e) {
+        e->lru_counter = ++c->lru_counter;
+        qemu_iovec_from_buf(qiov, qiov_offset, e->data + offset_in_cluster,
+                            bytes);
+        qemu_mutex_unlock(&c->lock);
+        ret = 0;
+        goto out;
+    }
+    e = qcow2_decompress_cache_reserve(s, c, l2_entry, gen);
+    qemu_mutex_unlock(&c->lock);
+
+    if (!e) {
+        out_buf = qemu_blockalign(bs, s->cluster_size);
+    }
+
+    ret = qcow2_co_decompress_cluster(bs, l2_entry, NULL,
+                                      e ? e->data : out_buf);
+
+    if (e) {
+        WITH_QEMU_LOCK_GUARD(&c->lock) {
+            if (ret == 0) {
+                qemu_iovec_from_buf(qiov, qiov_offset,
+                                    e->data + offset_in_cluster, bytes);
+            }
+            qcow2_decompress_cache_loaded(s, c, e, ret == 0);
+        }
+    } else {
+        if (ret == 0) {
+            qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster,
+                                bytes);
+        }
+        qemu_vfree(out_buf);
+    }
+
+out:
+    if (ret == 0) {
+        qcow2_decompress_cache_readahead(bs, offset >> s->cluster_bits);
+    }
+    return ret;
+}
@@ -0,0 +1,219 @@
+/*
+ * Cluster mapping cache for the QCOW2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "block/aio.h"
+#include "qcow2.h"
+
+/*
+ * The mapping cache remembers the host offsets of data clusters that were
+ * recently found to be allocated, so that I/O to them does not need to look
+ * up the L2 tables under s->lock.
+ *
+ * It is split in shards, each protected by a spinlock.  AioContexts are
+ * spread over the shards by hashing their address, so IOThreads mostly
+ * use different shards, but two of them may share one.  Each shard is a
+ * direct-mapped table indexed by guest cluster.
+ *
+ * Entries are tagged with the value of s->map_gen at the time the mapping
+ * was looked up.  The counter is incremented whenever an L2 table is
+ * modified or the L1 table is replaced, which invalidates every entry at
+ * once.  Steady state I/O to allocated clusters does not modify any table,
+ * so it is served entirely from the cache.
+ */
+#define QCOW2_MAP_SHARD_BITS    4
+#define QCOW2_MAP_SHARDS        (1 << QCOW2_MAP_SHARD_BITS)
+#define QCOW2_MAP_ENTRIES       1024
+
+typedef struct Qcow2MapEntry {
+    /* s->map_gen when the entry was filled, 0 for an empty entry */
+    unsigned gen;
+    /* Whether the cluster can be written in place */
+    bool writable;
+    uint64_t guest_cluster;
+    uint64_t host_cluster_offset;
+} Qcow2MapEntry;
+
+typedef struct Qcow2MapShard {
+    QemuSpin lock;
+    Qcow2MapEntry entries[QCOW2_MAP_ENTRIES];
+} Qcow2MapShard;
+
+struct Qcow2MapCache {
+    Qcow2MapShard shards[QCOW2_MAP_SHARDS];
+};
+
+Qcow2MapCache *qcow2_map_cache_new(void)
+{
+    Qcow2MapCache *mc = g_new0(Qcow2MapCache, 1);
+    int i;
+
+    for (i = 0; i < QCOW2_MAP_SHARDS; i++) {
+        qemu_spin_init(&mc->shards[i].lock);
+    }
+    return mc;
+}
+
+void qcow2_map_cache_free(Qcow2MapCache *mc)
+{
+    g_free(mc);
+}
+
+/*
+ * Drop all cached mappings.  Must be called whenever the guest to host
+ * mapping of a cluster changes.
+ */
+void qcow2_map_cache_invalidate(BDRVQcow2State *s)
+{
+    int i;
+
+    if (qatomic_fetch_inc(&s->map_gen) != UINT_MAX) {
+        return;
+    }
+
+    /*
+     * The counter wrapped around: 0 marks empty entries, and entries from
+     * the previous round must not become valid again.
+     */
+    qatomic_inc(&s->map_gen);
+    qcow2_decompress_cache_clear(s->decompress_cache);
+    if (!s->map_cache) {
+        return;
+    }
+    for (i = 0; i < QCOW2_MAP_SHARDS; i++) {
+        Qcow2MapShard *shard = &s->map_cache->shards[i];
+
+        qemu_spin_lock(&shard->lock);
+        memset(shard->entries, 0, sizeof(shard->entries));
+        qemu_spin_unlock(&shard->lock);
+    }
+}
+
+/*
+ * Return the generation to pass to qcow2_map_cache_insert().  Must be
+ * called with s->lock held, before the mapping is looked up.
+ */
+unsigned qcow2_map_cache_generation(BDRVQcow2State *s)
+{
+    return qatomic_read(&s->map_gen);
+}
+
+static Qcow2MapShard *qcow2_map_cache_shard(BDRVQcow2State *s)
+{
+    uint64_t ctx = (uintptr_t)qemu_get_current_aio_context();
+
+    ctx *= 0x9e3779b97f4a7c15ULL;
+    return &s->map_cache->shards[ctx >> (64 - QCOW2_MAP_SHARD_BITS)];
+}
+
+static inline Qcow2MapEntry *qcow2_map_cache_entry(Qcow2MapShard *shard,
+                                                   uint64_t guest_cluster)
+{
+    return &shard->entries[guest_cluster % QCOW2_MAP_ENTRIES];
+}
+
+/*
+ * Look up the host offset of the data at guest @offset without taking
+ * s->lock.
+ *
+ * On a hit, returns true, stores the host offset in *host_offset and
+ * shrinks *bytes to the number of bytes starting at @offset that are
+ * known to be allocated and contiguous in the data file.  If @write is
+ * true, only clusters that can be written in place are considered.
+ */
+bool qcow2_map_cache_lookup(BlockDriverState *bs, uint64_t offset,
+                            unsigned int *bytes, uint64_t *host_offset,
+                            bool write)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2MapShard *shard;
+    uint64_t cluster = offset >> s->cluster_bits;
+    uint64_t end = offset + *bytes;
+    uint64_t host_cluster_offset = 0;
+    uint64_t available = 0;
+    unsigned gen;
+
+    if (!s->map_cache) {
+        return false;
+    }
+
+    gen = qatomic_read(&s->map_gen);
+    if (!gen) {
+        return false;
+    }
+    shard = qcow2_map_cache_shard(s);
+
+    qemu_spin_lock(&shard->lock);
+    do {
+        Qcow2MapEntry *e = qcow2_map_cache_entry(shard, cluster);
+
+        if (e->gen != gen || e->guest_cluster != cluster ||
+            (write && !e->writable)) {
+            break;
+        }
+        if (!available) {
+            host_cluster_offset = e->host_cluster_offset;
+        } else if (e->host_cluster_offset != host_cluster_offset + available) {
+            break;
+        }
+        available += s->cluster_size;
+        cluster++;
+    } while ((cluster << s->cluster_bits) < end);
+    qemu_spin_unlock(&shard->lock);
+
+    if (!available) {
+        return false;
+    }
+
+    available -= offset_into_cluster(s, offset);
+    *host_offset = host_cluster_offset + offset_into_cluster(s, offset);
+    *bytes = MIN(*bytes, available);
+    return true;
+}
+
+/*
+ * Remember that the @bytes starting at guest @offset are stored
+ * contiguously at @host_offset in fully allocated data clusters.
+ *
+ * @gen is the value returned by qcow2_map_cache_generation() before the
+ * mapping was looked up; nothing is cached if the mapping may have changed
+ * since.  Must be called with s->lock held.
+ */
+void qcow2_map_cache_insert(BlockDriverState *bs, unsigned gen,
+                            uint64_t offset, unsigned int bytes,
+                            uint64_t host_offset, bool writable)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2MapShard *shard;
+    uint64_t cluster = offset >> s->cluster_bits;
+    uint64_t last = (offset + bytes - 1) >> s->cluster_bits;
+    uint64_t host_cluster_offset = start_of_cluster(s, host_offset);
+
+    if (!s->map_cache || !bytes || !gen || gen != qatomic_read(&s->map_gen)) {
+        return;
+    }
+
+    shard = qcow2_map_cache_shard(s);
+
+    qemu_spin_lock(&shard->lock);
+    for (; cluster <= last; cluster++) {
+        Qcow2MapEntry *e = qcow2_map_cache_entry(shard, cluster);
+
+        /* Reads must not forget that a cluster is writable */
+        if (e->gen != gen || e->guest_cluster != cluster) {
+            e->writable = false;
+        }
+        e->gen = gen;
+        e->guest_cluster = cluster;
+        e->host_cluster_offset = host_cluster_offset;
+        e->writable |= writable;
+        host_cluster_offset += s->cluster_size;
+    }
+    qemu_spin_unlock(&shard->lock);
+}
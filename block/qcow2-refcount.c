@@ -23,6 +23,8 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "block/aio_task.h"
 #include "block/block-io.h"
 #include "qapi/error.h"
 #include "qcow2.h"
@@ -1390,6 +1392,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                         set_l2_entry(s, l2_slice, j, entry);
                         qcow2_cache_entry_mark_dirty(s->l2_table_cache,
                                                      l2_slice);
+                        qcow2_map_cache_invalidate(s);
                     }
                 }
 
@@ -1653,8 +1656,8 @@ fail:
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table @l2_table, read from @l2_offset. While doing
+ * so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1663,24 +1666,15 @@ static int coroutine_fn GRAPH_RDLOCK
 check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                    void **refcount_table,
                    int64_t *refcount_table_size, int64_t l2_offset,
-                   int flags, BdrvCheckMode fix, bool active)
+                   uint64_t *l2_table, int flags, BdrvCheckMode fix,
+                   bool active)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
     int i, ret;
-    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
-    g_autofree uint64_t *l2_table = g_malloc(l2_size_bytes);
     bool metadata_overlap;
 
-    /* Read L2 table from disk */
-    ret = bdrv_co_pread(bs->file, l2_offset, l2_size_bytes, l2_table, 0);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        return ret;
-    }
-
     /* Do the actual checks */
     for (i = 0; i < s->l2_size; i++) {
         uint64_t coffset;
@@ -1851,11 +1845,76 @@ check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     return 0;
 }
 
+/* Memory used for L2 tables that are read ahead by the check */
+#define CHECK_L2_READAHEAD_SIZE (4 * MiB)
+#define CHECK_L2_READAHEAD_MAX  64
+
+typedef struct CheckL2ReadTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    uint64_t l2_offset;
+    uint64_t *l2_table;
+    int *ret;
+} CheckL2ReadTask;
+
+/*
+ * This function can count as GRAPH_RDLOCK because check_read_l2_tables()
+ * holds the graph lock and keeps it until this coroutine has terminated.
+ */
+static int coroutine_fn GRAPH_RDLOCK check_read_l2_task_entry(AioTask *task)
+{
+    CheckL2ReadTask *t = container_of(task, CheckL2ReadTask, task);
+    BDRVQcow2State *s = t->bs->opaque;
+
+    *t->ret = bdrv_co_pread(t->bs->file, t->l2_offset,
+                            s->l2_size * l2_entry_size(s), t->l2_table, 0);
+    return 0;
+}
+
+/*
+ * Reads the L2 tables referenced by the @n entries of @l1_table in
+ * parallel, into @l2_tables.  @l2_ret receives the result of each read.
+ */
+static void coroutine_fn GRAPH_RDLOCK
+check_read_l2_tables(BlockDriverState *bs, const uint64_t *l1_table, int n,
+                     uint64_t **l2_tables, int *l2_ret)
+{
+    AioTaskPool *aio = aio_task_pool_new(n);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        CheckL2ReadTask *t;
+
+        l2_ret[i] = 0;
+        if (!l1_table[i]) {
+            continue;
+        }
+
+        t = g_new(CheckL2ReadTask, 1);
+        *t = (CheckL2ReadTask) {
+            .task.func = check_read_l2_task_entry,
+            .bs = bs,
+            .l2_offset = l1_table[i] & L1E_OFFSET_MASK,
+            .l2_table = l2_tables[i],
+            .ret = &l2_ret[i],
+        };
+        aio_task_pool_start_task(aio, &t->task);
+    }
+
+    aio_task_pool_wait_all(aio);
+    aio_task_pool_free(aio);
+}
+
 /*
  * Increases the refcount for the L1 table, its L2 tables and all referenced
  * clusters in the given refcount table. While doing so, performs some checks
  * on L1 and L2 entries.
  *
+ * The L2 tables are read in batches of parallel requests, which use at most
+ * CHECK_L2_READAHEAD_SIZE of memory.  When repairing, a fix may modify an L2
+ * table that is referenced again later, so then they are read one by one.
+ *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
@@ -1867,9 +1926,13 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
 {
     BDRVQcow2State *s = bs->opaque;
     size_t l1_size_bytes = l1_size * L1E_SIZE;
+    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
     g_autofree uint64_t *l1_table = NULL;
+    g_autofree uint64_t **l2_tables = NULL;
+    g_autofree int *l2_ret = NULL;
     uint64_t l2_offset;
-    int i, ret;
+    int batch, n = 0;
+    int i, j, ret;
 
     if (!l1_size) {
         return 0;
@@ -1900,8 +1963,32 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
         be64_to_cpus(&l1_table[i]);
     }
 
+    if (fix & BDRV_FIX_ERRORS) {
+        batch = 1;
+    } else {
+        batch = MIN(MAX(CHECK_L2_READAHEAD_SIZE / l2_size_bytes, 1),
+                    CHECK_L2_READAHEAD_MAX);
+    }
+    batch = MIN(batch, l1_size);
+    l2_tables = g_new0(uint64_t *, batch);
+    l2_ret = g_new(int, batch);
+    for (j = 0; j < batch; j++) {
+        l2_tables[j] = g_try_malloc(l2_size_bytes);
+        if (!l2_tables[j]) {
+            res->check_errors++;
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
     /* Do the actual checks */
     for (i = 0; i < l1_size; i++) {
+        j = i % batch;
+        if (j == 0) {
+            n = MIN(batch, l1_size - i);
+            check_read_l2_tables(bs, &l1_table[i], n, l2_tables, l2_ret);
+        }
+
         if (!l1_table[i]) {
             continue;
         }
@@ -1919,7 +2006,7 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
                                        refcount_table, refcount_table_size,
                                        l2_offset, s->cluster_size);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
 
         /* L2 tables are cluster aligned */
@@ -1929,16 +2016,28 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
             res->corruptions++;
         }
 
+        if (l2_ret[j] < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            res->check_errors++;
+            ret = l2_ret[j];
+            goto out;
+        }
+
         /* Process and check L2 entries */
         ret = check_refcounts_l2(bs, res, refcount_table,
-                                 refcount_table_size, l2_offset, flags,
-                                 fix, active);
+                                 refcount_table_size, l2_offset, l2_tables[j],
+                                 flags, fix, active);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
     }
 
-    return 0;
+    ret = 0;
+out:
+    for (j = 0; j < batch; j++) {
+        g_free(l2_tables[j]);
+    }
+    return ret;
 }
 
 /*
@@ -1995,6 +2094,7 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
                 s->l1_table[i] = refcount == 1
                                ? l1_entry |  QCOW_OFLAG_COPIED
                                : l1_entry & ~QCOW_OFLAG_COPIED;
+                qcow2_map_cache_invalidate(s);
                 ret = qcow2_write_l1_entry(bs, i);
                 if (ret < 0) {
                     res->check_errors++;
@@ -2049,6 +2149,7 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
         }
 
         if (l2_dirty > 0) {
+            qcow2_map_cache_invalidate(s);
             ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
                                                 l2_offset, s->cluster_size,
                                                 false);
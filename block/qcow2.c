@@ -74,14 +74,6 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
 
-static int coroutine_fn
-qcow2_co_preadv_compressed(BlockDriverState *bs,
-                           uint64_t l2_entry,
-                           uint64_t offset,
-                           uint64_t bytes,
-                           QEMUIOVector *qiov,
-                           size_t qiov_offset);
-
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
     const QCowHeader *cow_header = (const void *)buf;
@@ -701,6 +693,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_THREADS,
     NULL
 };
 
@@ -734,6 +727,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Do not unreference discarded clusters",
         },
+        {
+            .name = QCOW2_OPT_MAPPING_CACHE,
+            .type = QEMU_OPT_BOOL,
+            .help = "Look up allocated clusters without taking the image lock",
+        },
         {
             .name = QCOW2_OPT_OVERLAP,
             .type = QEMU_OPT_STRING,
@@ -817,6 +815,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of clusters that are compressed, "
+                    "decompressed or encrypted in parallel",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -978,7 +982,9 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     bool discard_no_unref;
+    bool mapping_cache;
     uint64_t cache_clean_interval;
+    uint64_t max_threads;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1079,6 +1085,15 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    r->max_threads = qemu_opt_get_number(opts, QCOW2_OPT_THREADS,
+                                         QCOW2_MAX_THREADS);
+    if (r->max_threads < 1 || r->max_threads > INT_MAX) {
+        error_setg(errp, QCOW2_OPT_THREADS " must be between 1 and %d",
+                   INT_MAX);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1157,6 +1172,14 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    r->mapping_cache = qemu_opt_get_bool(opts, QCOW2_OPT_MAPPING_CACHE, false);
+    if (r->mapping_cache && has_subclusters(s)) {
+        error_setg(errp, "mapping-cache is not supported for images with "
+                   "extended L2 entries");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     switch (s->crypt_method_header) {
     case QCOW_CRYPT_NONE:
         if (encryptfmt) {
@@ -1238,6 +1261,16 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
 
     s->discard_no_unref = r->discard_no_unref;
+    s->max_threads = r->max_threads;
+
+    if (r->mapping_cache && !s->map_cache) {
+        s->map_cache = qcow2_map_cache_new();
+    } else if (!r->mapping_cache && s->map_cache) {
+        qcow2_map_cache_free(s->map_cache);
+        s->map_cache = NULL;
+    }
+    /* The L2 table cache may have been replaced */
+    qcow2_map_cache_invalidate(s);
 
     if (s->cache_clean_interval != r->cache_clean_interval) {
         cache_clean_timer_del(bs);
@@ -1372,6 +1405,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 
     s->cluster_bits = header.cluster_bits;
     s->cluster_size = 1 << s->cluster_bits;
+    s->decompress_cache = qcow2_decompress_cache_new(s);
 
     /* Initialise version 3 header fields */
     if (header.version == 2) {
@@ -1915,6 +1949,10 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    qcow2_map_cache_free(s->map_cache);
+    s->map_cache = NULL;
+    qcow2_decompress_cache_free(s->decompress_cache);
+    s->decompress_cache = NULL;
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -2280,6 +2318,7 @@ typedef struct Qcow2AioTask {
     BlockDriverState *bs;
     QCow2SubclusterType subcluster_type; /* only for read */
     uint64_t host_offset; /* or l2_entry for compressed read */
+    unsigned map_gen; /* only for compressed read */
     uint64_t offset;
     uint64_t bytes;
     QEMUIOVector *qiov;
@@ -2293,6 +2332,7 @@ static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
                                        AioTaskFunc func,
                                        QCow2SubclusterType subcluster_type,
                                        uint64_t host_offset,
+                                       unsigned map_gen,
                                        uint64_t offset,
                                        uint64_t bytes,
                                        QEMUIOVector *qiov,
@@ -2308,6 +2348,7 @@ static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
         .subcluster_type = subcluster_type,
         .qiov = qiov,
         .host_offset = host_offset,
+        .map_gen = map_gen,
         .offset = offset,
         .bytes = bytes,
         .qiov_offset = qiov_offset,
@@ -2330,8 +2371,8 @@ static coroutine_fn int qcow2_add_task(BlockDriverState *bs,
 
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_co_preadv_task(BlockDriverState *bs, QCow2SubclusterType subc_type,
-                     uint64_t host_offset, uint64_t offset, uint64_t bytes,
-                     QEMUIOVector *qiov, size_t qiov_offset)
+                     uint64_t host_offset, unsigned map_gen, uint64_t offset,
+                     uint64_t bytes, QEMUIOVector *qiov, size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
 
@@ -2350,8 +2391,9 @@ qcow2_co_preadv_task(BlockDriverState *bs, QCow2SubclusterType subc_type,
                                    qiov, qiov_offset, 0);
 
     case QCOW2_SUBCLUSTER_COMPRESSED:
-        return qcow2_co_preadv_compressed(bs, host_offset,
-                                          offset, bytes, qiov, qiov_offset);
+        return qcow2_co_preadv_compressed_cached(bs, map_gen, host_offset,
+                                                 offset, bytes,
+                                                 qiov, qiov_offset);
 
     case QCOW2_SUBCLUSTER_NORMAL:
         if (bs->encrypted) {
@@ -2381,8 +2423,8 @@ static int coroutine_fn GRAPH_RDLOCK qcow2_co_preadv_task_entry(AioTask *task)
     assert(!t->l2meta);
 
     return qcow2_co_preadv_task(t->bs, t->subcluster_type,
-                                t->host_offset, t->offset, t->bytes,
-                                t->qiov, t->qiov_offset);
+                                t->host_offset, t->map_gen, t->offset,
+                                t->bytes, t->qiov, t->qiov_offset);
 }
 
 static int coroutine_fn GRAPH_RDLOCK
@@ -2396,6 +2438,7 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
     uint64_t host_offset = 0;
     QCow2SubclusterType type;
     AioTaskPool *aio = NULL;
+    unsigned map_gen = 0;
 
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
         /* prepare next request */
@@ -2405,12 +2448,22 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
-                                    &host_offset, &type);
-        qemu_co_mutex_unlock(&s->lock);
-        if (ret < 0) {
-            goto out;
+        if (qcow2_map_cache_lookup(bs, offset, &cur_bytes, &host_offset,
+                                   false)) {
+            type = QCOW2_SUBCLUSTER_NORMAL;
+        } else {
+            qemu_co_mutex_lock(&s->lock);
+            map_gen = qcow2_map_cache_generation(s);
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                        &host_offset, &type);
+            if (ret == 0 && type == QCOW2_SUBCLUSTER_NORMAL) {
+                qcow2_map_cache_insert(bs, map_gen, offset, cur_bytes,
+                                       host_offset, false);
+            }
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret < 0) {
+                goto out;
+            }
         }
 
         if (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
@@ -2424,7 +2477,7 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                 aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
             }
             ret = qcow2_add_task(bs, aio, qcow2_co_preadv_task_entry, type,
-                                 host_offset, offset, cur_bytes,
+                                 host_offset, map_gen, offset, cur_bytes,
                                  qiov, qiov_offset, NULL);
             if (ret < 0) {
                 goto out;
@@ -2643,18 +2696,27 @@ int qcow2_co_pwritev_task(BlockDriverState *bs, uint64_t host_offset,
         }
     }
 
+    /* Writes in place have no metadata to update, don't take the lock */
+    if (!l2meta) {
+        goto out;
+    }
+
     qemu_co_mutex_lock(&s->lock);
 
     ret = qcow2_handle_l2meta(bs, &l2meta, true);
     goto out_locked;
 
 out_unlocked:
+    if (!l2meta) {
+        goto out;
+    }
     qemu_co_mutex_lock(&s->lock);
 
 out_locked:
     qcow2_handle_l2meta(bs, &l2meta, false);
     qemu_co_mutex_unlock(&s->lock);
 
+out:
     qemu_vfree(crypt_buf);
 
     return ret;
@@ -2687,6 +2749,7 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
     uint64_t host_offset;
     QCowL2Meta *l2meta = NULL;
     AioTaskPool *aio = NULL;
+    unsigned map_gen;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
@@ -2703,27 +2766,37 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             - offset_in_cluster);
         }
 
-        qemu_co_mutex_lock(&s->lock);
+        if (!qcow2_map_cache_lookup(bs, offset, &cur_bytes, &host_offset,
+                                    true)) {
+            qemu_co_mutex_lock(&s->lock);
+            map_gen = qcow2_map_cache_generation(s);
 
-        ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes,
-                                      &host_offset, &l2meta);
-        if (ret < 0) {
-            goto out_locked;
-        }
+            ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes,
+                                          &host_offset, &l2meta);
+            if (ret < 0) {
+                goto out_locked;
+            }
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, host_offset,
-                                            cur_bytes, true);
-        if (ret < 0) {
-            goto out_locked;
-        }
+            ret = qcow2_pre_write_overlap_check(bs, 0, host_offset,
+                                                cur_bytes, true);
+            if (ret < 0) {
+                goto out_locked;
+            }
 
-        qemu_co_mutex_unlock(&s->lock);
+            /* Without l2meta, all clusters are written in place */
+            if (!l2meta) {
+                qcow2_map_cache_insert(bs, map_gen, offset, cur_bytes,
+                                       host_offset, true);
+            }
+
+            qemu_co_mutex_unlock(&s->lock);
+        }
 
         if (!aio && cur_bytes != bytes) {
             aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
         }
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_task_entry, 0,
-                             host_offset, offset,
+                             host_offset, 0, offset,
                              cur_bytes, qiov, qiov_offset, l2meta);
         l2meta = NULL; /* l2meta is consumed by qcow2_co_pwritev_task() */
         if (ret < 0) {
@@ -2736,8 +2809,7 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
         trace_qcow2_writev_done_part(qemu_coroutine_self(), cur_bytes);
     }
     ret = 0;
-
-    qemu_co_mutex_lock(&s->lock);
+    goto fail_nometa;
 
 out_locked:
     qcow2_handle_l2meta(bs, &l2meta, false);
@@ -2808,6 +2880,10 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_map_cache_free(s->map_cache);
+    s->map_cache = NULL;
+    qcow2_decompress_cache_free(s->decompress_cache);
+    s->decompress_cache = NULL;
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -4800,7 +4876,8 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         }
 
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
-                             0, 0, offset, chunk_size, qiov, qiov_offset, NULL);
+                             0, 0, 0, offset, chunk_size, qiov, qiov_offset,
+                             NULL);
         if (ret < 0) {
             break;
         }
@@ -4820,49 +4897,6 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
-static int coroutine_fn GRAPH_RDLOCK
-qcow2_co_preadv_compressed(BlockDriverState *bs,
-                           uint64_t l2_entry,
-                           uint64_t offset,
-                           uint64_t bytes,
-                           QEMUIOVector *qiov,
-                           size_t qiov_offset)
-{
-    BDRVQcow2State *s = bs->opaque;
-    int ret = 0, csize;
-    uint64_t coffset;
-    uint8_t *buf, *out_buf;
-    int offset_in_cluster = offset_into_cluster(s, offset);
-
-    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
-
-    buf = g_try_malloc(csize);
-    if (!buf) {
-        return -ENOMEM;
-    }
-
-    out_buf = qemu_blockalign(bs, s->cluster_size);
-
-    BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-    ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
-    if (ret < 0) {
-        goto fail;
-    }
-
-    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
-        ret = -EIO;
-        goto fail;
-    }
-
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
-
-fail:
-    qemu_vfree(out_buf);
-    g_free(buf);
-
-    return ret;
-}
-
 static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -4877,6 +4911,8 @@ static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
         uint32_t reftable_clusters;
     } QEMU_PACKED l1_ofs_rt_ofs_cls;
 
+    qcow2_map_cache_invalidate(s);
+
     ret = qcow2_cache_empty(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -134,6 +134,7 @@
 #define QCOW2_OPT_DISCARD_SNAPSHOT "pass-discard-snapshot"
 #define QCOW2_OPT_DISCARD_OTHER "pass-discard-other"
 #define QCOW2_OPT_DISCARD_NO_UNREF "discard-no-unref"
+#define QCOW2_OPT_MAPPING_CACHE "mapping-cache"
 #define QCOW2_OPT_OVERLAP "overlap-check"
 #define QCOW2_OPT_OVERLAP_TEMPLATE "overlap-check.template"
 #define QCOW2_OPT_OVERLAP_MAIN_HEADER "overlap-check.main-header"
@@ -150,6 +151,7 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_THREADS "threads"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -231,6 +233,9 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+typedef struct Qcow2MapCache Qcow2MapCache;
+typedef struct Qcow2DecompressCache Qcow2DecompressCache;
+
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
     uint64_t length;
@@ -322,6 +327,7 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
+/* Default of the "threads" option */
 #define QCOW2_MAX_THREADS 4
 
 typedef struct BDRVQcow2State {
@@ -348,6 +354,13 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    /* Cache of allocated cluster mappings, or NULL */
+    Qcow2MapCache *map_cache;
+    /* Incremented whenever a cluster mapping may change */
+    unsigned map_gen;
+    /* Recently decompressed clusters and compressed read-ahead */
+    Qcow2DecompressCache *decompress_cache;
+
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -410,6 +423,7 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int max_threads;    /* Limit for nb_threads */
 
     BdrvChild *data_file;
 
@@ -1022,6 +1036,28 @@ void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
+/* qcow2-map-cache.c functions */
+Qcow2MapCache *qcow2_map_cache_new(void);
+void qcow2_map_cache_free(Qcow2MapCache *mc);
+void qcow2_map_cache_invalidate(BDRVQcow2State *s);
+unsigned qcow2_map_cache_generation(BDRVQcow2State *s);
+bool qcow2_map_cache_lookup(BlockDriverState *bs, uint64_t offset,
+                            unsigned int *bytes, uint64_t *host_offset,
+                            bool write);
+void qcow2_map_cache_insert(BlockDriverState *bs, unsigned gen,
+                            uint64_t offset, unsigned int bytes,
+                            uint64_t host_offset, bool writable);
+
+/* qcow2-decompress-cache.c functions */
+Qcow2DecompressCache *qcow2_decompress_cache_new(BDRVQcow2State *s);
+void qcow2_decompress_cache_free(Qcow2DecompressCache *c);
+void qcow2_decompress_cache_clear(Qcow2DecompressCache *c);
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_preadv_compressed_cached(BlockDriverState *bs, unsigned gen,
+                                  uint64_t l2_entry, uint64_t offset,
+                                  uint64_t bytes, QEMUIOVector *qiov,
+                                  size_t qiov_offset);
+
 /* qcow2-bitmap.c functions */
 int coroutine_fn GRAPH_RDLOCK
 qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
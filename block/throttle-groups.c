@@ -62,7 +62,21 @@ static void timer_cb(ThrottleGroupMember *tgm, ThrottleDirection direction);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * To keep members in different IOThreads from contending on the lock,
+ * each member borrows part of the group's budget in advance (see
+ * throttle_borrow()) and keeps it in its token_cache.  As long as no
+ * member of the group has to wait, requests are accounted against that
+ * budget without taking the lock.  The borrowed budget is already
+ * accounted in the group, so the limits are never exceeded; it is given
+ * back the next time the member takes the lock.  Since a member can keep
+ * it for as long as it is idle, the members together never hold more
+ * than 1/THROTTLE_GROUP_CACHE_DIVISOR of each bucket.  A member's requests can
+ * run in several threads at once (e.g. with virtio-blk iothread-vq-mapping),
+ * so its token_cache has a spinlock of its own.
  */
+#define THROTTLE_GROUP_CACHE_DIVISOR 16
+
 struct ThrottleGroup {
     Object parent_obj;
 
@@ -70,13 +84,19 @@ struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
+    unsigned nb_members;
     ThrottleGroupMember *tokens[THROTTLE_MAX];
-    bool any_timer_armed[THROTTLE_MAX];
     QEMUClockType clock_type;
 
+    /* These are also read without the lock, with atomic operations */
+    bool any_timer_armed[THROTTLE_MAX];
+    unsigned pending_reqs[THROTTLE_MAX];
+    /* incremented when the budget borrowed by the members is void */
+    unsigned cache_gen;
+
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
 };
@@ -286,7 +306,7 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
     /* If a timer just got armed, set tgm as the current token */
     if (must_wait) {
         tg->tokens[direction] = tgm;
-        tg->any_timer_armed[direction] = true;
+        qatomic_set(&tg->any_timer_armed[direction], true);
     }
 
     return must_wait;
@@ -344,12 +364,126 @@ static void coroutine_mixed_fn schedule_next_request(ThrottleGroupMember *tgm,
             ThrottleTimers *tt = &token->throttle_timers;
             int64_t now = qemu_clock_get_ns(tg->clock_type);
             timer_mod(tt->timers[direction], now);
-            tg->any_timer_armed[direction] = true;
+            qatomic_set(&tg->any_timer_armed[direction], true);
         }
         tg->tokens[direction] = token;
     }
 }
 
+/* Account an I/O request against the budget that the ThrottleGroupMember
+ * borrowed from its group, without taking tg->lock. This is only done
+ * while no request in the group is waiting, so it does not bypass the
+ * round robin. Stale values of the group fields can at worst let a
+ * request use budget that has been accounted already.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @direction: the ThrottleDirection
+ * @ret:       whether the request has been accounted
+ */
+static bool throttle_group_cache_consume(ThrottleGroupMember *tgm,
+                                         int64_t bytes,
+                                         ThrottleDirection direction)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    ThrottleTokenCache *cache = &tgm->token_cache[direction];
+    double units;
+    bool ret = false;
+
+    if (qatomic_read(&tg->pending_reqs[direction]) ||
+        qatomic_read(&tg->any_timer_armed[direction])) {
+        return false;
+    }
+
+    qemu_spin_lock(&cache->lock);
+    units = throttle_units(cache->op_size, bytes);
+    if (cache->gen == qatomic_read(&tg->cache_gen) &&
+        cache->bytes >= bytes && cache->units >= units) {
+        cache->bytes -= bytes;
+        cache->units -= units;
+        ret = true;
+    }
+    qemu_spin_unlock(&cache->lock);
+
+    return ret;
+}
+
+/* Same as throttle_group_cache_flush(), for callers that already hold
+ * cache->lock in addition to tg->lock.
+ */
+static void throttle_group_cache_return(ThrottleGroup *tg,
+                                        ThrottleTokenCache *cache,
+                                        ThrottleDirection direction)
+{
+    if (cache->gen == tg->cache_gen) {
+        throttle_unborrow(&tg->ts, direction,
+                          cache->borrowed_bytes, cache->borrowed_units,
+                          cache->bytes, cache->units);
+    }
+    cache->bytes = 0;
+    cache->units = 0;
+    cache->borrowed_bytes = 0;
+    cache->borrowed_units = 0;
+}
+
+/* Give back the budget that a ThrottleGroupMember did not use.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @direction: the ThrottleDirection
+ */
+static void throttle_group_cache_flush(ThrottleGroupMember *tgm,
+                                       ThrottleDirection direction)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    ThrottleTokenCache *cache = &tgm->token_cache[direction];
+
+    qemu_spin_lock(&cache->lock);
+    throttle_group_cache_return(tg, cache, direction);
+    qemu_spin_unlock(&cache->lock);
+}
+
+/* Borrow budget for the next requests of a ThrottleGroupMember, unless
+ * other requests have to wait. Each member takes an equal share of
+ * 1/THROTTLE_GROUP_CACHE_DIVISOR of the group budget, but at least enough
+ * for one more request of @bytes; otherwise with many members the share
+ * would be too small to ever be used. All members together never hold
+ * more than 1/THROTTLE_GROUP_CACHE_DIVISOR of the budget: once that is
+ * reached, the member gets nothing and its requests take the lock.
+ *
+ * Whatever is left from a previous refill by another request of the
+ * same member is given back first.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @bytes:     the number of bytes of the request that has been accounted
+ * @direction: the ThrottleDirection
+ */
+static void throttle_group_cache_refill(ThrottleGroupMember *tgm,
+                                        int64_t bytes,
+                                        ThrottleDirection direction)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    ThrottleTokenCache *cache = &tgm->token_cache[direction];
+
+    if (tg->pending_reqs[direction] || tg->any_timer_armed[direction] ||
+        qatomic_read(&tgm->io_limits_disabled)) {
+        return;
+    }
+
+    qemu_spin_lock(&cache->lock);
+    throttle_group_cache_return(tg, cache, direction);
+    throttle_borrow(&tg->ts, direction, THROTTLE_GROUP_CACHE_DIVISOR,
+                    tg->nb_members, bytes, &cache->bytes, &cache->units);
+    cache->borrowed_bytes = cache->bytes;
+    cache->borrowed_units = cache->units;
+    cache->op_size = tg->ts.cfg.op_size;
+    cache->gen = tg->cache_gen;
+    qemu_spin_unlock(&cache->lock);
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
  * if necessary, and schedule the next request using a round robin
  * algorithm.
@@ -369,8 +503,15 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     assert(bytes >= 0);
     assert(direction < THROTTLE_MAX);
 
+    if (throttle_group_cache_consume(tgm, bytes, direction)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
+    /* The budget is borrowed again below if nobody has to wait */
+    throttle_group_cache_flush(tgm, direction);
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(tgm, direction);
     must_wait = throttle_group_schedule_timer(token, direction);
@@ -378,6 +519,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[direction]) {
         tgm->pending_reqs[direction]++;
+        qatomic_inc(&tg->pending_reqs[direction]);
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
         qemu_co_queue_wait(&tgm->throttled_reqs[direction],
@@ -385,10 +527,12 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[direction]--;
+        qatomic_dec(&tg->pending_reqs[direction]);
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(tgm->throttle_state, direction, bytes);
+    throttle_group_cache_refill(tgm, bytes, direction);
 
     /* Schedule the next request */
     schedule_next_request(tgm, direction);
@@ -478,6 +622,8 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
     throttle_config(ts, tg->clock_type, cfg);
+    /* The bucket levels are reset, including the borrowed budget */
+    qatomic_inc(&tg->cache_gen);
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -512,7 +658,7 @@ static void timer_cb(ThrottleGroupMember *tgm, ThrottleDirection direction)
 
     /* The timer has just been fired, so we can update the flag */
     qemu_mutex_lock(&tg->lock);
-    tg->any_timer_armed[direction] = false;
+    qatomic_set(&tg->any_timer_armed[direction], false);
     qemu_mutex_unlock(&tg->lock);
 
     /* Run the request that was waiting for this timer */
@@ -559,9 +705,12 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
             tg->tokens[dir] = tgm;
         }
         qemu_co_queue_init(&tgm->throttled_reqs[dir]);
+        tgm->token_cache[dir] = (ThrottleTokenCache) {};
+        qemu_spin_init(&tgm->token_cache[dir].lock);
     }
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
+    tg->nb_members++;
 
     throttle_timers_init(&tgm->throttle_timers,
                          tgm->aio_context,
@@ -602,6 +751,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
             assert(tgm->pending_reqs[dir] == 0);
             assert(qemu_co_queue_empty(&tgm->throttled_reqs[dir]));
             assert(!timer_pending(tgm->throttle_timers.timers[dir]));
+            throttle_group_cache_flush(tgm, dir);
             if (tg->tokens[dir] == tgm) {
                 token = throttle_group_next_tgm(tgm);
                 /* Take care of the case where this is the last tgm in the group */
@@ -614,6 +764,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
 
         /* remove the current tgm from the list */
         QLIST_REMOVE(tgm, round_robin);
+        tg->nb_members--;
         throttle_timers_destroy(&tgm->throttle_timers);
     }
 
@@ -645,7 +796,7 @@ void throttle_group_detach_aio_context(ThrottleGroupMember *tgm)
     WITH_QEMU_LOCK_GUARD(&tg->lock) {
         for (dir = THROTTLE_READ; dir < THROTTLE_MAX; dir++) {
             if (timer_pending(tt->timers[dir])) {
-                tg->any_timer_armed[dir] = false;
+                qatomic_set(&tg->any_timer_armed[dir], false);
                 schedule_next_request(tgm, dir);
             }
         }
@@ -903,6 +1054,7 @@ static void throttle_group_set_limits(Object *obj, Visitor *v,
         goto unlock;
     }
     throttle_config(&tg->ts, tg->clock_type, &cfg);
+    qatomic_inc(&tg->cache_gen);
 
 unlock:
     qemu_mutex_unlock(&tg->lock);
@@ -20,10 +20,11 @@ static enum qemu_plugin_mem_rw rw = QEMU_PLUGIN_MEM_RW;
 static GHashTable *miss_ht;
 
 static GMutex hashtable_lock;
-static GRand *rng;
 
 static int limit;
 static bool sys;
+static int sample_shift;
+static uint64_t sample_mask;
 
 enum EvictionPolicy {
     LRU,
@@ -78,8 +79,46 @@ typedef struct {
     uint64_t tag_mask;
     uint64_t accesses;
     uint64_t misses;
+    GRand *rng;
 } Cache;
 
+typedef struct {
+    int blksize;
+    int assoc;
+    int cachesize;
+} CacheConfig;
+
+/*
+ * A Core groups the private caches of a simulated core. By default every vCPU
+ * gets its own Core, which is only ever touched from that vCPU's thread and
+ * thus needs no locking. When the user folds vCPUs onto fewer cores with
+ * "cores=N", several vCPUs may share a Core and accesses are serialised by
+ * its lock.
+ */
+typedef struct {
+    Cache *l1_dcache;
+    Cache *l1_icache;
+    Cache *l2_ucache;
+    GMutex lock;
+    bool shared;
+    int id;
+} Core;
+
+/*
+ * The L3 is shared between all cores. To avoid serialising every core on a
+ * single lock, it is split by set index into independent partitions, each
+ * one being a regular Cache holding a slice of the sets behind its own lock.
+ * The low bits of the block number select the partition, the remaining bits
+ * are handed to the partition as its address.
+ */
+typedef struct {
+    Cache **parts;
+    GMutex *locks;
+    int num_parts;
+    int part_shift;
+    int blksize_shift;
+} SharedCache;
+
 typedef struct {
     char *disas_str;
     const char *symbol;
@@ -87,6 +126,7 @@ typedef struct {
     uint64_t l1_dmisses;
     uint64_t l1_imisses;
     uint64_t l2_misses;
+    uint64_t l3_misses;
 } InsnData;
 
 void (*update_hit)(Cache *cache, int set, int blk);
@@ -96,14 +136,18 @@ void (*metadata_init)(Cache *cache);
 void (*metadata_destroy)(Cache *cache);
 
 static int cores;
-static Cache **l1_dcaches, **l1_icaches;
+static bool fold_cores;
+static Core *folded_cores;
 
-static bool use_l2;
-static Cache **l2_ucaches;
+static struct qemu_plugin_scoreboard *vcpu_cores;
+static GPtrArray *all_cores;
+static GMutex cores_lock;
 
-static GMutex *l1_dcache_locks;
-static GMutex *l1_icache_locks;
-static GMutex *l2_ucache_locks;
+static CacheConfig l1_dconfig, l1_iconfig, l2_config, l3_config;
+
+static bool use_l2;
+static bool use_l3;
+static SharedCache *l3_cache;
 
 static uint64_t l1_dmem_accesses;
 static uint64_t l1_imem_accesses;
@@ -266,6 +310,7 @@ static Cache *cache_init(int blksize, int assoc, int cachesize)
     cache->blksize_shift = pow_of_two(blksize);
     cache->accesses = 0;
     cache->misses = 0;
+    cache->rng = policy == RAND ? g_rand_new() : NULL;
 
     for (i = 0; i < cache->num_sets; i++) {
         cache->sets[i].blocks = g_new0(CacheBlock, assoc);
@@ -282,22 +327,47 @@ static Cache *cache_init(int blksize, int assoc, int cachesize)
     return cache;
 }
 
-static Cache **caches_init(int blksize, int assoc, int cachesize)
+static Cache *cache_init_from_config(const CacheConfig *config)
 {
-    Cache **caches;
-    int i;
+    return cache_init(config->blksize, config->assoc, config->cachesize);
+}
 
-    if (bad_cache_params(blksize, assoc, cachesize)) {
-        return NULL;
-    }
+static void core_init(Core *core, int id, bool shared)
+{
+    core->id = id;
+    core->shared = shared;
+    g_mutex_init(&core->lock);
+    core->l1_dcache = cache_init_from_config(&l1_dconfig);
+    core->l1_icache = cache_init_from_config(&l1_iconfig);
+    core->l2_ucache = use_l2 ? cache_init_from_config(&l2_config) : NULL;
+}
 
-    caches = g_new(Cache *, cores);
+/*
+ * Split the L3 in as many partitions as possible, up to 64, while keeping a
+ * power of two number of sets in each one.
+ */
+static SharedCache *shared_cache_init(const CacheConfig *config)
+{
+    SharedCache *shared;
+    int num_sets = config->cachesize / (config->blksize * config->assoc);
+    int i;
 
-    for (i = 0; i < cores; i++) {
-        caches[i] = cache_init(blksize, assoc, cachesize);
+    shared = g_new0(SharedCache, 1);
+    shared->num_parts = 1;
+    while (shared->num_parts < 64 && num_sets % (shared->num_parts * 2) == 0) {
+        shared->num_parts *= 2;
+    }
+    shared->part_shift = pow_of_two(shared->num_parts);
+    shared->blksize_shift = pow_of_two(config->blksize);
+    shared->parts = g_new(Cache *, shared->num_parts);
+    shared->locks = g_new0(GMutex, shared->num_parts);
+
+    for (i = 0; i < shared->num_parts; i++) {
+        shared->parts[i] = cache_init(config->blksize, config->assoc,
+                                      config->cachesize / shared->num_parts);
     }
 
-    return caches;
+    return shared;
 }
 
 static int get_invalid_block(Cache *cache, uint64_t set)
@@ -317,7 +387,7 @@ static int get_replaced_block(Cache *cache, int set)
 {
     switch (policy) {
     case RAND:
-        return g_rand_int_range(rng, 0, cache->assoc);
+        return g_rand_int_range(cache->rng, 0, cache->assoc);
     case LRU:
         return lru_get_lru_block(cache, set);
     case FIFO:
@@ -385,14 +455,92 @@ static bool access_cache(Cache *cache, uint64_t addr)
     return false;
 }
 
+/*
+ * access_shared_cache(): Simulate an access to the partitioned L3
+ *
+ * Only the partition the address maps to is locked, so cores hitting
+ * different sets proceed in parallel.
+ */
+static bool access_shared_cache(SharedCache *shared, uint64_t addr)
+{
+    uint64_t blk = addr >> shared->blksize_shift;
+    int part_idx = blk & (shared->num_parts - 1);
+    uint64_t part_addr = (blk >> shared->part_shift) << shared->blksize_shift;
+    Cache *part = shared->parts[part_idx];
+    bool hit;
+
+    g_mutex_lock(&shared->locks[part_idx]);
+    hit = access_cache(part, part_addr);
+    if (!hit) {
+        part->misses++;
+    }
+    part->accesses++;
+    g_mutex_unlock(&shared->locks[part_idx]);
+
+    return hit;
+}
+
+/*
+ * Set sampling: when enabled, only blocks whose number is a multiple of the
+ * sampling ratio are simulated. Every level then models a consistent subset
+ * of its sets, which keeps miss rates representative while skipping most of
+ * the work.
+ */
+static inline bool is_sampled(uint64_t addr)
+{
+    return !((addr >> sample_shift) & sample_mask);
+}
+
+static void simulate_access(unsigned int vcpu_index, uint64_t addr,
+                            InsnData *insn, bool is_insn)
+{
+    Core *core;
+    Cache *l1, *l2;
+    bool hit;
+
+    if (!is_sampled(addr)) {
+        return;
+    }
+
+    core = *(Core **) qemu_plugin_scoreboard_find(vcpu_cores, vcpu_index);
+    l1 = is_insn ? core->l1_icache : core->l1_dcache;
+    l2 = core->l2_ucache;
+
+    if (core->shared) {
+        g_mutex_lock(&core->lock);
+    }
+
+    hit = access_cache(l1, addr);
+    if (!hit) {
+        __atomic_fetch_add(is_insn ? &insn->l1_imisses : &insn->l1_dmisses, 1,
+                           __ATOMIC_RELAXED);
+        l1->misses++;
+    }
+    l1->accesses++;
+
+    if (!hit && l2) {
+        hit = access_cache(l2, addr);
+        if (!hit) {
+            __atomic_fetch_add(&insn->l2_misses, 1, __ATOMIC_RELAXED);
+            l2->misses++;
+        }
+        l2->accesses++;
+    }
+
+    if (core->shared) {
+        g_mutex_unlock(&core->lock);
+    }
+
+    if (!hit && use_l3 && !access_shared_cache(l3_cache, addr)) {
+        __atomic_fetch_add(&insn->l3_misses, 1, __ATOMIC_RELAXED);
+    }
+}
+
 static void vcpu_mem_access(unsigned int vcpu_index, qemu_plugin_meminfo_t info,
                             uint64_t vaddr, void *userdata)
 {
     uint64_t effective_addr;
     struct qemu_plugin_hwaddr *hwaddr;
-    int cache_idx;
-    InsnData *insn;
-    bool hit_in_l1;
 
     hwaddr = qemu_plugin_get_hwaddr(info, vaddr);
     if (hwaddr && qemu_plugin_hwaddr_is_io(hwaddr)) {
@@ -400,66 +548,36 @@ static void vcpu_mem_access(unsigned int vcpu_index, qemu_plugin_meminfo_t info,
     }
 
     effective_addr = hwaddr ? qemu_plugin_hwaddr_phys_addr(hwaddr) : vaddr;
-    cache_idx = vcpu_index % cores;
-
-    g_mutex_lock(&l1_dcache_locks[cache_idx]);
-    hit_in_l1 = access_cache(l1_dcaches[cache_idx], effective_addr);
-    if (!hit_in_l1) {
-        insn = userdata;
-        __atomic_fetch_add(&insn->l1_dmisses, 1, __ATOMIC_SEQ_CST);
-        l1_dcaches[cache_idx]->misses++;
-    }
-    l1_dcaches[cache_idx]->accesses++;
-    g_mutex_unlock(&l1_dcache_locks[cache_idx]);
-
-    if (hit_in_l1 || !use_l2) {
-        /* No need to access L2 */
-        return;
-    }
-
-    g_mutex_lock(&l2_ucache_locks[cache_idx]);
-    if (!access_cache(l2_ucaches[cache_idx], effective_addr)) {
-        insn = userdata;
-        __atomic_fetch_add(&insn->l2_misses, 1, __ATOMIC_SEQ_CST);
-        l2_ucaches[cache_idx]->misses++;
-    }
-    l2_ucaches[cache_idx]->accesses++;
-    g_mutex_unlock(&l2_ucache_locks[cache_idx]);
+    simulate_access(vcpu_index, effective_addr, userdata, false);
 }
 
 static void vcpu_insn_exec(unsigned int vcpu_index, void *userdata)
 {
-    uint64_t insn_addr;
-    InsnData *insn;
-    int cache_idx;
-    bool hit_in_l1;
+    InsnData *insn = userdata;
 
-    insn_addr = ((InsnData *) userdata)->addr;
+    simulate_access(vcpu_index, insn->addr, insn, true);
+}
 
-    cache_idx = vcpu_index % cores;
-    g_mutex_lock(&l1_icache_locks[cache_idx]);
-    hit_in_l1 = access_cache(l1_icaches[cache_idx], insn_addr);
-    if (!hit_in_l1) {
-        insn = userdata;
-        __atomic_fetch_add(&insn->l1_imisses, 1, __ATOMIC_SEQ_CST);
-        l1_icaches[cache_idx]->misses++;
-    }
-    l1_icaches[cache_idx]->accesses++;
-    g_mutex_unlock(&l1_icache_locks[cache_idx]);
+static void vcpu_init(qemu_plugin_id_t id, unsigned int vcpu_index)
+{
+    Core **slot = qemu_plugin_scoreboard_find(vcpu_cores, vcpu_index);
 
-    if (hit_in_l1 || !use_l2) {
-        /* No need to access L2 */
+    /* vCPU indexes are recycled in user mode, keep the caches of the slot */
+    if (*slot) {
         return;
     }
 
-    g_mutex_lock(&l2_ucache_locks[cache_idx]);
-    if (!access_cache(l2_ucaches[cache_idx], insn_addr)) {
-        insn = userdata;
-        __atomic_fetch_add(&insn->l2_misses, 1, __ATOMIC_SEQ_CST);
-        l2_ucaches[cache_idx]->misses++;
+    if (fold_cores) {
+        *slot = &folded_cores[vcpu_index % cores];
+        return;
     }
-    l2_ucaches[cache_idx]->accesses++;
-    g_mutex_unlock(&l2_ucache_locks[cache_idx]);
+
+    *slot = g_new0(Core, 1);
+    core_init(*slot, vcpu_index, false);
+
+    g_mutex_lock(&cores_lock);
+    g_ptr_array_add(all_cores, *slot);
+    g_mutex_unlock(&cores_lock);
 }
 
 static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
@@ -516,17 +634,42 @@ static void cache_free(Cache *cache)
         metadata_destroy(cache);
     }
 
+    if (cache->rng) {
+        g_rand_free(cache->rng);
+    }
+
     g_free(cache->sets);
     g_free(cache);
 }
 
-static void caches_free(Cache **caches)
+static void core_free(gpointer data)
+{
+    Core *core = data;
+
+    cache_free(core->l1_dcache);
+    cache_free(core->l1_icache);
+    if (core->l2_ucache) {
+        cache_free(core->l2_ucache);
+    }
+    g_mutex_clear(&core->lock);
+
+    /* folded cores live in a single array freed by the caller */
+    if (!fold_cores) {
+        g_free(core);
+    }
+}
+
+static void shared_cache_free(SharedCache *shared)
 {
     int i;
 
-    for (i = 0; i < cores; i++) {
-        cache_free(caches[i]);
+    for (i = 0; i < shared->num_parts; i++) {
+        cache_free(shared->parts[i]);
     }
+
+    g_free(shared->parts);
+    g_free(shared->locks);
+    g_free(shared);
 }
 
 static void append_stats_line(GString *line,
@@ -562,20 +705,30 @@ static void sum_stats(void)
 {
     int i;
 
-    g_assert(cores > 1);
-    for (i = 0; i < cores; i++) {
-        l1_imisses += l1_icaches[i]->misses;
-        l1_dmisses += l1_dcaches[i]->misses;
-        l1_imem_accesses += l1_icaches[i]->accesses;
-        l1_dmem_accesses += l1_dcaches[i]->accesses;
+    g_assert(all_cores->len > 1);
+    for (i = 0; i < all_cores->len; i++) {
+        Core *core = g_ptr_array_index(all_cores, i);
+
+        l1_imisses += core->l1_icache->misses;
+        l1_dmisses += core->l1_dcache->misses;
+        l1_imem_accesses += core->l1_icache->accesses;
+        l1_dmem_accesses += core->l1_dcache->accesses;
 
         if (use_l2) {
-            l2_misses += l2_ucaches[i]->misses;
-            l2_mem_accesses += l2_ucaches[i]->accesses;
+            l2_misses += core->l2_ucache->misses;
+            l2_mem_accesses += core->l2_ucache->accesses;
         }
     }
 }
 
+static int core_cmp(gconstpointer a, gconstpointer b)
+{
+    const Core *core_a = *(Core **) a;
+    const Core *core_b = *(Core **) b;
+
+    return core_a->id - core_b->id;
+}
+
 static int dcmp(gconstpointer a, gconstpointer b, gpointer d)
 {
     InsnData *insn_a = (InsnData *) a;
@@ -600,12 +753,27 @@ static int l2_cmp(gconstpointer a, gconstpointer b, gpointer d)
     return insn_a->l2_misses < insn_b->l2_misses ? 1 : -1;
 }
 
+static int l3_cmp(gconstpointer a, gconstpointer b, gpointer d)
+{
+    InsnData *insn_a = (InsnData *) a;
+    InsnData *insn_b = (InsnData *) b;
+
+    return insn_a->l3_misses < insn_b->l3_misses ? 1 : -1;
+}
+
 static void log_stats(void)
 {
     int i;
     Cache *icache, *dcache, *l2_cache = NULL;
 
-    g_autoptr(GString) rep = g_string_new("core #, data accesses, data misses,"
+    g_autoptr(GString) rep = g_string_new("");
+
+    if (sample_mask) {
+        g_string_append_printf(rep, "sampling 1 in %" PRIu64 " cache blocks\n",
+                               sample_mask + 1);
+    }
+
+    g_string_append(rep, "core #, data accesses, data misses,"
                                           " dmiss rate, insn accesses,"
                                           " insn misses, imiss rate");
 
@@ -615,18 +783,21 @@ static void log_stats(void)
 
     g_string_append(rep, "\n");
 
-    for (i = 0; i < cores; i++) {
-        g_string_append_printf(rep, "%-8d", i);
-        dcache = l1_dcaches[i];
-        icache = l1_icaches[i];
-        l2_cache = use_l2 ? l2_ucaches[i] : NULL;
+    g_ptr_array_sort(all_cores, core_cmp);
+    for (i = 0; i < all_cores->len; i++) {
+        Core *core = g_ptr_array_index(all_cores, i);
+
+        g_string_append_printf(rep, "%-8d", core->id);
+        dcache = core->l1_dcache;
+        icache = core->l1_icache;
+        l2_cache = core->l2_ucache;
         append_stats_line(rep, dcache->accesses, dcache->misses,
                 icache->accesses, icache->misses,
                 l2_cache ? l2_cache->accesses : 0,
                 l2_cache ? l2_cache->misses : 0);
     }
 
-    if (cores > 1) {
+    if (all_cores->len > 1) {
         sum_stats();
         g_string_append_printf(rep, "%-8s", "sum");
         append_stats_line(rep, l1_dmem_accesses, l1_dmisses,
@@ -634,6 +805,22 @@ static void log_stats(void)
                 l2_cache ? l2_mem_accesses : 0, l2_cache ? l2_misses : 0);
     }
 
+    if (use_l3) {
+        uint64_t l3_accesses = 0, l3_misses = 0;
+
+        for (i = 0; i < l3_cache->num_parts; i++) {
+            l3_accesses += l3_cache->parts[i]->accesses;
+            l3_misses += l3_cache->parts[i]->misses;
+        }
+
+        g_string_append_printf(rep, "\nl3 accesses, l3 misses, l3 miss rate\n"
+                               "%-12" PRIu64 " %-11" PRIu64 " %10.4lf%%\n",
+                               l3_accesses, l3_misses,
+                               l3_accesses ?
+                               ((double) l3_misses) / l3_accesses * 100.0 :
+                               0.0);
+    }
+
     g_string_append(rep, "\n");
     qemu_plugin_outs(rep->str);
 }
@@ -673,7 +860,7 @@ static void log_top_insns(void)
     }
 
     if (!use_l2) {
-        goto finish;
+        goto l3;
     }
 
     miss_insns = g_list_sort_with_data(miss_insns, l2_cmp, NULL);
@@ -689,6 +876,24 @@ static void log_top_insns(void)
                                insn->l2_misses, insn->disas_str);
     }
 
+l3:
+    if (!use_l3) {
+        goto finish;
+    }
+
+    miss_insns = g_list_sort_with_data(miss_insns, l3_cmp, NULL);
+    g_string_append_printf(rep, "%s", "\naddress, L3 misses, instruction\n");
+
+    for (curr = miss_insns, i = 0; curr && i < limit; i++, curr = curr->next) {
+        insn = (InsnData *) curr->data;
+        g_string_append_printf(rep, "0x%" PRIx64, insn->addr);
+        if (insn->symbol) {
+            g_string_append_printf(rep, " (%s)", insn->symbol);
+        }
+        g_string_append_printf(rep, ", %" PRId64 ", %s\n",
+                               insn->l3_misses, insn->disas_str);
+    }
+
 finish:
     qemu_plugin_outs(rep->str);
     g_list_free(miss_insns);
@@ -699,15 +904,12 @@ static void plugin_exit(qemu_plugin_id_t id, void *p)
     log_stats();
     log_top_insns();
 
-    caches_free(l1_dcaches);
-    caches_free(l1_icaches);
-
-    g_free(l1_dcache_locks);
-    g_free(l1_icache_locks);
+    g_ptr_array_free(all_cores, true);
+    g_free(folded_cores);
+    qemu_plugin_scoreboard_free(vcpu_cores);
 
-    if (use_l2) {
-        caches_free(l2_ucaches);
-        g_free(l2_ucache_locks);
+    if (use_l3) {
+        shared_cache_free(l3_cache);
     }
 
     g_hash_table_destroy(miss_ht);
@@ -728,7 +930,6 @@ static void policy_init(void)
         metadata_destroy = fifo_destroy;
         break;
     case RAND:
-        rng = g_rand_new();
         break;
     default:
         g_assert_not_reached();
@@ -743,8 +944,11 @@ int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
     int l1_iassoc, l1_iblksize, l1_icachesize;
     int l1_dassoc, l1_dblksize, l1_dcachesize;
     int l2_assoc, l2_blksize, l2_cachesize;
+    int l3_assoc, l3_blksize, l3_cachesize;
+    int sample;
 
     limit = 32;
+    sample = 1;
     sys = info->system_emulation;
 
     l1_dassoc = 8;
@@ -759,9 +963,11 @@ int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
     l2_blksize = 64;
     l2_cachesize = l2_assoc * l2_blksize * 2048;
 
-    policy = LRU;
+    l3_assoc = 16;
+    l3_blksize = 64;
+    l3_cachesize = l3_assoc * l3_blksize * 8192;
 
-    cores = sys ? info->system.smp_vcpus : 1;
+    policy = LRU;
 
     for (i = 0; i < argc; i++) {
         char *opt = argv[i];
@@ -782,7 +988,12 @@ int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
         } else if (g_strcmp0(tokens[0], "limit") == 0) {
             limit = STRTOLL(tokens[1]);
         } else if (g_strcmp0(tokens[0], "cores") == 0) {
+            fold_cores = true;
             cores = STRTOLL(tokens[1]);
+            if (cores <= 0) {
+                fprintf(stderr, "invalid number of cores: %s\n", opt);
+                return -1;
+            }
         } else if (g_strcmp0(tokens[0], "l2cachesize") == 0) {
             use_l2 = true;
             l2_cachesize = STRTOLL(tokens[1]);
@@ -797,6 +1008,27 @@ int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
                 fprintf(stderr, "boolean argument parsing failed: %s\n", opt);
                 return -1;
             }
+        } else if (g_strcmp0(tokens[0], "l3cachesize") == 0) {
+            use_l3 = true;
+            l3_cachesize = STRTOLL(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "l3blksize") == 0) {
+            use_l3 = true;
+            l3_blksize = STRTOLL(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "l3assoc") == 0) {
+            use_l3 = true;
+            l3_assoc = STRTOLL(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "l3") == 0) {
+            if (!qemu_plugin_bool_parse(tokens[0], tokens[1], &use_l3)) {
+                fprintf(stderr, "boolean argument parsing failed: %s\n", opt);
+                return -1;
+            }
+        } else if (g_strcmp0(tokens[0], "sample") == 0) {
+            sample = STRTOLL(tokens[1]);
+            if (sample <= 0 || (sample & (sample - 1)) != 0) {
+                fprintf(stderr, "sampling ratio must be a power of two: %s\n",
+                        opt);
+                return -1;
+            }
         } else if (g_strcmp0(tokens[0], "evict") == 0) {
             if (g_strcmp0(tokens[1], "rand") == 0) {
                 policy = RAND;
@@ -816,34 +1048,71 @@ int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
 
     policy_init();
 
-    l1_dcaches = caches_init(l1_dblksize, l1_dassoc, l1_dcachesize);
-    if (!l1_dcaches) {
+    if (bad_cache_params(l1_dblksize, l1_dassoc, l1_dcachesize)) {
         const char *err = cache_config_error(l1_dblksize, l1_dassoc, l1_dcachesize);
         fprintf(stderr, "dcache cannot be constructed from given parameters\n");
         fprintf(stderr, "%s\n", err);
         return -1;
     }
 
-    l1_icaches = caches_init(l1_iblksize, l1_iassoc, l1_icachesize);
-    if (!l1_icaches) {
+    if (bad_cache_params(l1_iblksize, l1_iassoc, l1_icachesize)) {
         const char *err = cache_config_error(l1_iblksize, l1_iassoc, l1_icachesize);
         fprintf(stderr, "icache cannot be constructed from given parameters\n");
         fprintf(stderr, "%s\n", err);
         return -1;
     }
 
-    l2_ucaches = use_l2 ? caches_init(l2_blksize, l2_assoc, l2_cachesize) : NULL;
-    if (!l2_ucaches && use_l2) {
+    if (use_l2 && bad_cache_params(l2_blksize, l2_assoc, l2_cachesize)) {
         const char *err = cache_config_error(l2_blksize, l2_assoc, l2_cachesize);
         fprintf(stderr, "L2 cache cannot be constructed from given parameters\n");
         fprintf(stderr, "%s\n", err);
         return -1;
     }
 
-    l1_dcache_locks = g_new0(GMutex, cores);
-    l1_icache_locks = g_new0(GMutex, cores);
-    l2_ucache_locks = use_l2 ? g_new0(GMutex, cores) : NULL;
+    if (use_l3 && bad_cache_params(l3_blksize, l3_assoc, l3_cachesize)) {
+        const char *err = cache_config_error(l3_blksize, l3_assoc, l3_cachesize);
+        fprintf(stderr, "L3 cache cannot be constructed from given parameters\n");
+        fprintf(stderr, "%s\n", err);
+        return -1;
+    }
+
+    l1_dconfig = (CacheConfig) { l1_dblksize, l1_dassoc, l1_dcachesize };
+    l1_iconfig = (CacheConfig) { l1_iblksize, l1_iassoc, l1_icachesize };
+    l2_config = (CacheConfig) { l2_blksize, l2_assoc, l2_cachesize };
+    l3_config = (CacheConfig) { l3_blksize, l3_assoc, l3_cachesize };
+
+    /*
+     * Sample at the granularity of the largest block so that a block is
+     * either simulated or skipped as a whole at every level.
+     */
+    sample_shift = pow_of_two(MAX(l1_dblksize, l1_iblksize));
+    if (use_l2) {
+        sample_shift = MAX(sample_shift, pow_of_two(l2_blksize));
+    }
+    if (use_l3) {
+        sample_shift = MAX(sample_shift, pow_of_two(l3_blksize));
+    }
+    sample_mask = sample - 1;
+
+    all_cores = g_ptr_array_new_with_free_func(core_free);
+    vcpu_cores = qemu_plugin_scoreboard_new(sizeof(Core *));
+
+    if (fold_cores) {
+        /* cores can only be private if no two vCPUs can end up on one */
+        bool shared = !sys || cores < info->system.max_vcpus;
+
+        folded_cores = g_new0(Core, cores);
+        for (i = 0; i < cores; i++) {
+            core_init(&folded_cores[i], i, shared);
+            g_ptr_array_add(all_cores, &folded_cores[i]);
+        }
+    }
+
+    if (use_l3) {
+        l3_cache = shared_cache_init(&l3_config);
+    }
 
+    qemu_plugin_register_vcpu_init_cb(id, vcpu_init);
     qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
     qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
 
@@ -53,6 +53,7 @@ static uint64_t port92_read(void *opaque, hwaddr addr,
 
 static const VMStateDescription vmstate_port92_isa = {
     .name = "port92",
+    .parallel = true,
     .version_id = 1,
     .minimum_version_id = 1,
     .fields = (const VMStateField[]) {
@@ -240,6 +240,9 @@ struct AioContext {
     /* AIO engine parameters */
     int64_t aio_max_batch;  /* maximum number of requests in a batch */
 
+    /* SQ thread idle time in ms of the io_uring ring, 0 disables SQPOLL */
+    int64_t io_uring_sqpoll_idle;
+
     /*
      * List of handlers participating in userspace polling.  Protected by
      * ctx->list_lock.  Iterated and modified mostly by the event loop thread
@@ -716,6 +719,18 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
  */
 void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch);
 
+/**
+ * aio_context_set_io_uring_params:
+ * @ctx: the aio context
+ * @sqpoll_idle: how long the kernel thread polling the io_uring submission
+ *               queue stays idle before sleeping, in milliseconds.  0 means
+ *               that the ring does not use a submission queue thread.
+ *
+ * Only takes effect when the io_uring ring of @ctx is created, i.e. the
+ * first time a block device using aio=io_uring submits a request in @ctx.
+ */
+void aio_context_set_io_uring_params(AioContext *ctx, int64_t sqpoll_idle);
+
 /**
  * aio_context_set_thread_pool_params:
  * @ctx: the aio context
@@ -74,9 +74,20 @@ static inline bool laio_has_fua(void)
 #endif
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
-LuringState *luring_init(Error **errp);
+LuringState *luring_init(int64_t sqpoll_idle, Error **errp);
 void luring_cleanup(LuringState *s);
 
+/*
+ * Register memory and file descriptors with all io_uring rings, so that
+ * requests using them avoid the cost of pinning pages and looking up the
+ * file.  Registration is best effort, requests that are not covered fall
+ * back to plain buffers and fds.
+ */
+void luring_register_buf(void *host, size_t size);
+void luring_unregister_buf(void *host, size_t size);
+void luring_register_file(int fd);
+void luring_unregister_file(int fd);
+
 /* luring_co_submit: submit I/O requests in the thread's current AioContext. */
 int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
                                   QEMUIOVector *qiov, int type,
@@ -29,6 +29,21 @@
 #include "qemu/throttle.h"
 #include "qom/object.h"
 
+/* Budget that a ThrottleGroupMember has borrowed from its group, so that
+ * it can perform I/O without taking the group lock.
+ */
+typedef struct ThrottleTokenCache {
+    QemuSpin lock;  /* protects the following fields */
+    double   bytes;
+    double   units;
+    /* What throttle_borrow() returned, before requests used part of it */
+    double   borrowed_bytes;
+    double   borrowed_units;
+    uint64_t op_size;
+    /* The group's cache_gen when the budget was borrowed */
+    unsigned gen;
+} ThrottleTokenCache;
+
 /* The ThrottleGroupMember structure indicates membership in a ThrottleGroup
  * and holds related data.
  */
@@ -49,6 +64,11 @@ typedef struct ThrottleGroupMember {
      */
     unsigned int restart_pending;
 
+    /* Budget borrowed from the group. Accessed by requests of this
+     * ThrottleGroupMember from any thread, with token_cache[].lock held.
+     */
+    ThrottleTokenCache token_cache[THROTTLE_MAX];
+
     /* The following fields are protected by the ThrottleGroup lock.
      * See the ThrottleGroup documentation for details.
      * throttle_state tells us if I/O limits are configured. */
@@ -202,6 +202,18 @@ struct VMStateDescription {
      * a QEMU_VM_SECTION_START section.
      */
     bool early_setup;
+    /*
+     * This VMSD can be saved and loaded in a thread, without the BQL and
+     * concurrently with other devices: its hooks and fields don't touch
+     * the state of any other device, and its loading doesn't depend on
+     * other devices being loaded first.
+     *
+     * With the parallel-device-state migration capability, such VMSDs are
+     * sent over multifd channels instead of the main migration stream.
+     * Devices with a lower priority are still guaranteed to be loaded
+     * after them.
+     */
+    bool parallel;
     int version_id;
     int minimum_version_id;
     MigrationPriority priority;
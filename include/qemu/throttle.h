@@ -97,6 +97,7 @@ typedef struct ThrottleConfig {
 typedef struct ThrottleState {
     ThrottleConfig cfg;       /* configuration */
     int64_t previous_leak;    /* timestamp of the last leak done */
+    double borrowed[BUCKETS_COUNT]; /* see throttle_borrow() */
 } ThrottleState;
 
 typedef enum {
@@ -119,6 +120,8 @@ void throttle_leak_bucket(LeakyBucket *bkt, int64_t delta);
 
 int64_t throttle_compute_wait(LeakyBucket *bkt);
 
+double throttle_compute_budget(LeakyBucket *bkt);
+
 /* init/destroy cycle */
 void throttle_init(ThrottleState *ts);
 
@@ -158,6 +161,16 @@ bool throttle_schedule_timer(ThrottleState *ts,
 
 void throttle_account(ThrottleState *ts, ThrottleDirection direction,
                       uint64_t size);
+
+double throttle_units(uint64_t op_size, uint64_t size);
+
+void throttle_borrow(ThrottleState *ts, ThrottleDirection direction,
+                     unsigned divisor, unsigned shares, uint64_t min_size,
+                     double *size, double *units);
+void throttle_unborrow(ThrottleState *ts, ThrottleDirection direction,
+                       double size, double units,
+                       double left_size, double left_units);
+
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
 void throttle_config_to_limits(ThrottleConfig *cfg, ThrottleLimits *var);
@@ -47,8 +47,9 @@ static inline long clear_bmap_size(uint64_t pages, uint8_t shift)
 }
 
 /**
- * clear_bmap_set: set clear bitmap for the page range.  Must be with
- * bitmap_mutex held.
+ * clear_bmap_set: set clear bitmap for the page range.  The bits are set
+ * atomically, so that the dirty bitmap of a single RAMBlock can be synced
+ * in chunks by several threads; clearing still needs bitmap_mutex held.
  *
  * @rb: the ramblock to operate on
  * @start: the start page number
@@ -61,7 +62,8 @@ static inline void clear_bmap_set(RAMBlock *rb, uint64_t start,
 {
     uint8_t shift = rb->clear_bmap_shift;
 
-    bitmap_set(rb->clear_bmap, start >> shift, clear_bmap_size(npages, shift));
+    bitmap_set_atomic(rb->clear_bmap, start >> shift,
+                      clear_bmap_size(npages, shift));
 }
 
 /**
@@ -482,7 +484,12 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 }
 
 
-/* Called with RCU critical section */
+/*
+ * Called with RCU critical section.  Several threads may sync the same
+ * RAMBlock concurrently as long as their ranges are disjoint and aligned
+ * to (1 << rb->clear_bmap_shift) target pages, so that no word of rb->bmap
+ * is shared between them.
+ */
 static inline
 uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                                                ram_addr_t start,
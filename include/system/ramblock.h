@@ -62,6 +62,11 @@ struct RAMBlock {
      */
     off_t bitmap_offset;
     uint64_t pages_offset;
+    /*
+     * the used part of the block is mapped copy-on-write from the
+     * migration file, see qemu_ram_map_file_private().
+     */
+    bool pages_file_mapped;
 
     /* Bitmap of already received pages.  Only used on destination side. */
     unsigned long *receivedmap;
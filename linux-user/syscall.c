@@ -738,6 +738,12 @@ safe_syscall6(ssize_t, recvfrom, int, fd, void *, buf, size_t, len,
               int, flags, struct sockaddr *, addr, socklen_t *, addrlen)
 safe_syscall3(ssize_t, sendmsg, int, fd, const struct msghdr *, msg, int, flags)
 safe_syscall3(ssize_t, recvmsg, int, fd, struct msghdr *, msg, int, flags)
+#if defined(__NR_sendmmsg) && defined(__NR_recvmmsg)
+safe_syscall4(int, sendmmsg, int, fd, struct mmsghdr *, msgvec,
+              unsigned int, vlen, int, flags)
+safe_syscall5(int, recvmmsg, int, fd, struct mmsghdr *, msgvec,
+              unsigned int, vlen, int, flags, struct timespec *, timeout)
+#endif
 safe_syscall2(int, flock, int, fd, int, operation)
 #if defined(TARGET_NR_rt_sigtimedwait) || defined(TARGET_NR_rt_sigtimedwait_time64)
 safe_syscall4(int, rt_sigtimedwait, const sigset_t *, these, siginfo_t *, uinfo,
@@ -3106,6 +3112,7 @@ static struct iovec *lock_iovec(int type, abi_ulong target_addr,
 static void unlock_iovec(struct iovec *vec, abi_ulong target_addr,
                          abi_ulong count, int copy)
 {
+#ifdef CONFIG_DEBUG_REMAP
     struct target_iovec *target_vec;
     int i;
 
@@ -3122,6 +3129,12 @@ static void unlock_iovec(struct iovec *vec, abi_ulong target_addr,
         }
         unlock_user(target_vec, target_addr, 0);
     }
+#else
+    /*
+     * lock_iovec() handed out pointers straight into guest memory: there
+     * is nothing to write back, so don't walk the guest's iovec array again.
+     */
+#endif
 
     g_free(vec);
 }
@@ -3406,6 +3419,120 @@ static abi_long do_sendrecvmsg(int fd, abi_ulong target_msg,
 #define MSG_WAITFORONE 0x10000
 #endif
 
+#if defined(__NR_sendmmsg) && defined(__NR_recvmmsg)
+/*
+ * Messages without control data on sockets without an fd translator only
+ * need their headers, addresses and iovecs converted, so the whole vector
+ * can go to the host in one sendmmsg/recvmmsg call.
+ */
+static bool sendrecvmmsg_can_batch(int fd, struct target_mmsghdr *mmsgp,
+                                   unsigned int vlen)
+{
+    int i;
+
+    if (fd_trans_target_to_host_data(fd) ||
+        fd_trans_host_to_target_data(fd) ||
+        fd_trans_target_to_host_addr(fd)) {
+        return false;
+    }
+
+    for (i = 0; i < vlen; i++) {
+        struct target_msghdr *msgp = &mmsgp[i].msg_hdr;
+        abi_ulong count = tswapal(msgp->msg_iovlen);
+
+        if (msgp->msg_controllen || count == 0 || count > IOV_MAX) {
+            return false;
+        }
+        if (msgp->msg_name &&
+            tswap32(msgp->msg_namelen) >= sizeof(struct sockaddr_storage)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* do_sendrecvmmsg_batch() Must return target values and target errnos. */
+static abi_long do_sendrecvmmsg_batch(int fd, struct target_mmsghdr *mmsgp,
+                                      unsigned int vlen, unsigned int flags,
+                                      int send)
+{
+    g_autofree struct mmsghdr *msgs = g_new0(struct mmsghdr, vlen);
+    g_autofree struct sockaddr_storage *names =
+        g_new0(struct sockaddr_storage, vlen);
+    abi_long ret = 0;
+    int i, n;
+
+    /*
+     * Convert as many messages as possible; like the per-message loop,
+     * a message that cannot be converted ends the batch before it.
+     */
+    for (n = 0; n < vlen; n++) {
+        struct target_msghdr *msgp = &mmsgp[n].msg_hdr;
+        struct msghdr *msg = &msgs[n].msg_hdr;
+        abi_ulong count = tswapal(msgp->msg_iovlen);
+
+        if (msgp->msg_name) {
+            msg->msg_name = &names[n];
+            msg->msg_namelen = tswap32(msgp->msg_namelen);
+            if (send) {
+                ret = target_to_host_sockaddr(fd, msg->msg_name,
+                                              tswapal(msgp->msg_name),
+                                              msg->msg_namelen);
+                if (ret == -TARGET_EFAULT) {
+                    /* As in do_sendrecvmsg_locked(), let the host decide */
+                    msg->msg_name = (void *)-1;
+                } else if (ret) {
+                    break;
+                }
+            }
+        }
+
+        msg->msg_iov = lock_iovec(send ? VERIFY_READ : VERIFY_WRITE,
+                                  tswapal(msgp->msg_iov), count, send);
+        if (!msg->msg_iov) {
+            ret = -host_to_target_errno(errno);
+            break;
+        }
+        msg->msg_iovlen = count;
+    }
+
+    if (n) {
+        if (send) {
+            ret = get_errno(safe_sendmmsg(fd, msgs, n, flags));
+        } else {
+            ret = get_errno(safe_recvmmsg(fd, msgs, n, flags, NULL));
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        struct target_msghdr *msgp = &mmsgp[i].msg_hdr;
+        struct msghdr *msg = &msgs[i].msg_hdr;
+
+        if (!is_error(ret) && i < ret) {
+            mmsgp[i].msg_len = tswap32(msgs[i].msg_len);
+            if (!send) {
+                /* Don't write more of the address than the guest has */
+                socklen_t namelen = MIN(msg->msg_namelen,
+                                        tswap32(msgp->msg_namelen));
+
+                msgp->msg_namelen = tswap32(msg->msg_namelen);
+                msgp->msg_flags = tswap32(msg->msg_flags);
+                if (msg->msg_name &&
+                    host_to_target_sockaddr(tswapal(msgp->msg_name),
+                                            msg->msg_name, namelen)) {
+                    /* Report what was received up to the bad address */
+                    ret = i ? i : -TARGET_EFAULT;
+                }
+            }
+        }
+        unlock_iovec(msg->msg_iov, tswapal(msgp->msg_iov),
+                     tswapal(msgp->msg_iovlen), !send);
+    }
+
+    return ret;
+}
+#endif
+
 static abi_long do_sendrecvmmsg(int fd, abi_ulong target_msgvec,
                                 unsigned int vlen, unsigned int flags,
                                 int send)
@@ -3423,6 +3550,15 @@ static abi_long do_sendrecvmmsg(int fd, abi_ulong target_msgvec,
         return -TARGET_EFAULT;
     }
 
+#if defined(__NR_sendmmsg) && defined(__NR_recvmmsg)
+    if (vlen && sendrecvmmsg_can_batch(fd, mmsgp, vlen)) {
+        ret = do_sendrecvmmsg_batch(fd, mmsgp, vlen, flags, send);
+        unlock_user(mmsgp, target_msgvec,
+                    is_error(ret) ? 0 : sizeof(*mmsgp) * ret);
+        return ret;
+    }
+#endif
+
     for (i = 0; i < vlen; i++) {
         ret = do_sendrecvmsg_locked(fd, &mmsgp[i].msg_hdr, flags, send);
         if (is_error(ret)) {
@@ -13407,10 +13543,19 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
             return -TARGET_EFAULT;
         }
 
-        ep = g_try_new(struct epoll_event, maxevents);
-        if (!ep) {
-            unlock_user(target_ep, arg2, 0);
-            return -TARGET_ENOMEM;
+        /*
+         * If the host lays out struct epoll_event exactly as the guest
+         * does, let the kernel fill in the guest buffer directly.
+         */
+        if (HOST_BIG_ENDIAN == TARGET_BIG_ENDIAN &&
+            sizeof(struct epoll_event) == sizeof(struct target_epoll_event)) {
+            ep = (struct epoll_event *)target_ep;
+        } else {
+            ep = g_try_new(struct epoll_event, maxevents);
+            if (!ep) {
+                unlock_user(target_ep, arg2, 0);
+                return -TARGET_ENOMEM;
+            }
         }
 
         switch (num) {
@@ -13446,16 +13591,20 @@ static abi_long do_syscall1(CPUArchState *cpu_env, int num, abi_long arg1,
         }
         if (!is_error(ret)) {
             int i;
-            for (i = 0; i < ret; i++) {
-                target_ep[i].events = tswap32(ep[i].events);
-                target_ep[i].data.u64 = tswap64(ep[i].data.u64);
+            if (ep != (void *)target_ep) {
+                for (i = 0; i < ret; i++) {
+                    target_ep[i].events = tswap32(ep[i].events);
+                    target_ep[i].data.u64 = tswap64(ep[i].data.u64);
+                }
             }
             unlock_user(target_ep, arg2,
                         ret * sizeof(struct target_epoll_event));
         } else {
             unlock_user(target_ep, arg2, 0);
         }
-        g_free(ep);
+        if (ep != (void *)target_ep) {
+            g_free(ep);
+        }
         return ret;
     }
 #endif
@@ -219,8 +219,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "\n");
 
         monitor_printf(mon, "    Page Types: \tnormal=%" PRIu64
-                       ", zero=%" PRIu64 "\n",
+                       ", zero=%" PRIu64,
                        info->ram->normal, info->ram->duplicate);
+        if (info->ram->dedup_pages) {
+            monitor_printf(mon, ", dedup=%" PRIu64, info->ram->dedup_pages);
+        }
+        monitor_printf(mon, "\n");
         monitor_printf(mon, "  Page Rates (pps): \ttransfer=%" PRIu64,
                        info->ram->pages_per_second);
         if (info->ram->dirty_pages_rate) {
@@ -231,6 +235,11 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
 
         monitor_printf(mon, "  Others: \t\tdirty_syncs=%" PRIu64,
                        info->ram->dirty_sync_count);
+        if (info->ram->dirty_sync_count) {
+            monitor_printf(mon, ", last_sync_us=%" PRIu64 "+%" PRIu64,
+                           info->ram->dirty_sync_log_time,
+                           info->ram->dirty_sync_bitmap_time);
+        }
         if (info->ram->postcopy_requests) {
             monitor_printf(mon, ", postcopy_req=%" PRIu64,
                            info->ram->postcopy_requests);
@@ -274,6 +283,11 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->cpu_throttle_percentage);
     }
 
+    if (info->has_expected_convergence_time) {
+        monitor_printf(mon, "Expected convergence (ms): %" PRIu64 "\n",
+                       info->expected_convergence_time);
+    }
+
     if (info->has_dirty_limit_throttle_time_per_round) {
         monitor_printf(mon, "Dirty-limit Throttle (us): %" PRIu64 "\n",
                        info->dirty_limit_throttle_time_per_round);
@@ -341,6 +355,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %s\n",
             MigrationParameter_str(MIGRATION_PARAMETER_CPU_THROTTLE_TAILSLOW),
             params->cpu_throttle_tailslow ? "on" : "off");
+        assert(params->has_throttle_predictive);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_THROTTLE_PREDICTIVE),
+            params->throttle_predictive ? "on" : "off");
         assert(params->has_max_cpu_throttle);
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MAX_CPU_THROTTLE),
@@ -589,6 +607,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_cpu_throttle_tailslow = true;
         visit_type_bool(v, param, &p->cpu_throttle_tailslow, &err);
         break;
+    case MIGRATION_PARAMETER_THROTTLE_PREDICTIVE:
+        p->has_throttle_predictive = true;
+        visit_type_bool(v, param, &p->throttle_predictive, &err);
+        break;
     case MIGRATION_PARAMETER_MAX_CPU_THROTTLE:
         p->has_max_cpu_throttle = true;
         visit_type_uint8(v, param, &p->max_cpu_throttle, &err);
@@ -50,6 +50,22 @@ typedef struct {
      * Number of times we have synchronized guest bitmaps.
      */
     Stat64 dirty_sync_count;
+    /*
+     * Time in microseconds spent by the last dirty bitmap sync in
+     * collecting the dirty log from the accelerator and the memory
+     * listeners.
+     */
+    Stat64 dirty_sync_log_time;
+    /*
+     * Time in microseconds spent by the last dirty bitmap sync in
+     * merging the collected dirty log into the migration bitmap.
+     */
+    Stat64 dirty_sync_bitmap_time;
+    /*
+     * Number of pages sent as a reference to identical contents sent
+     * earlier on the same multifd channel.
+     */
+    Stat64 dedup_pages;
     /*
      * Number of times zero copy failed to send any page using zero
      * copy.
@@ -329,6 +329,8 @@ void migration_object_init(void)
 
     qemu_mutex_init(&current_incoming->page_request_mutex);
     qemu_cond_init(&current_incoming->page_request_cond);
+    qemu_mutex_init(&current_incoming->parallel_sections_mutex);
+    qemu_cond_init(&current_incoming->parallel_sections_cond);
     current_incoming->page_requested = g_tree_new(page_request_addr_cmp);
 
     current_incoming->exit_on_error = INMIGRATE_DEFAULT_EXIT_ON_ERROR;
@@ -539,11 +541,11 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
  *   Len: Length in bytes required - must be a multiple of pagesize
  */
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start)
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len)
 {
     uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname up to 256 */
     size_t msglen = 12; /* start + len */
-    size_t len = qemu_ram_pagesize(rb);
     enum mig_rp_message_type msg_type;
     const char *rbname;
     int rbname_len;
@@ -575,17 +577,24 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
     return migrate_send_rp_message(mis, msg_type, msglen, bufc);
 }
 
+/*
+ * Request the host page at @start, which @haddr faulted on.  @len may be
+ * larger than the host page size to also prefetch the pages that follow;
+ * only the faulting page is tracked as requested.
+ */
 int migrate_send_rp_req_pages(MigrationIncomingState *mis,
-                              RAMBlock *rb, ram_addr_t start, uint64_t haddr,
-                              uint32_t tid)
+                              RAMBlock *rb, ram_addr_t start, size_t len,
+                              uint64_t haddr, uint32_t tid)
 {
     void *aligned = (void *)(uintptr_t)ROUND_DOWN(haddr, qemu_ram_pagesize(rb));
     bool received = false;
+    bool requested = false;
 
     WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
         received = ramblock_recv_bitmap_test_byte_offset(rb, start);
         if (!received) {
-            if (!g_tree_lookup(mis->page_requested, aligned)) {
+            requested = g_tree_lookup(mis->page_requested, aligned);
+            if (!requested) {
                 /*
                  * The page has not been received, and it's not yet in the
                  * page request list.  Queue it.  Set the value of element
@@ -603,12 +612,15 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
     /*
      * If the page is there, skip sending the message.  We don't even need the
      * lock because as long as the page arrived, it'll be there forever.
+     *
+     * Likewise if another vCPU already faulted on the page: the request is
+     * in flight, or will be resent by postcopy recovery if it got lost.
      */
-    if (received) {
+    if (received || requested) {
         return 0;
     }
 
-    return migrate_send_rp_message_req_pages(mis, rb, start);
+    return migrate_send_rp_message_req_pages(mis, rb, start, len);
 }
 
 static bool migration_colo_enabled;
@@ -1283,6 +1295,11 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         stat64_get(&mig_stats.dirty_sync_count);
     info->ram->dirty_sync_missed_zero_copy =
         stat64_get(&mig_stats.dirty_sync_missed_zero_copy);
+    info->ram->dirty_sync_log_time =
+        stat64_get(&mig_stats.dirty_sync_log_time);
+    info->ram->dirty_sync_bitmap_time =
+        stat64_get(&mig_stats.dirty_sync_bitmap_time);
+    info->ram->dedup_pages = stat64_get(&mig_stats.dedup_pages);
     info->ram->postcopy_requests =
         stat64_get(&mig_stats.postcopy_requests);
     info->ram->page_size = page_size;
@@ -1312,6 +1329,13 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->ram->remaining = ram_bytes_remaining();
         info->ram->dirty_pages_rate =
            stat64_get(&mig_stats.dirty_pages_rate);
+
+        if (migrate_throttle_predictive() &&
+            ram_expected_convergence_time() >= 0) {
+            info->has_expected_convergence_time = true;
+            info->expected_convergence_time =
+                ram_expected_convergence_time();
+        }
     }
 
     if (migrate_dirty_limit() && dirtylimit_in_service()) {
@@ -247,6 +247,15 @@ struct MigrationIncomingState {
      */
     unsigned int switchover_ack_pending_num;
 
+    /*
+     * Number of device sections loaded by the multifd receive threads with
+     * parallel-device-state, protected by parallel_sections_mutex.
+     * parallel_sections_cond is signalled whenever it changes.
+     */
+    QemuMutex parallel_sections_mutex;
+    QemuCond parallel_sections_cond;
+    uint32_t parallel_sections_loaded;
+
     /* Do exit on incoming migration failure */
     bool exit_on_error;
 };
@@ -546,9 +555,11 @@ void migrate_send_rp_shut(MigrationIncomingState *mis,
 void migrate_send_rp_pong(MigrationIncomingState *mis,
                           uint32_t value);
 int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
-                              ram_addr_t start, uint64_t haddr, uint32_t tid);
+                              ram_addr_t start, size_t len, uint64_t haddr,
+                              uint32_t tid);
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start);
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
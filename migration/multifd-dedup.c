@@ -0,0 +1,331 @@
+/*
+ * Multifd page deduplication
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "system/ramblock.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "multifd.h"
+#include "options.h"
+#include "ram.h"
+
+/*
+ * Each channel keeps a direct-mapped cache of the contents of the pages
+ * it sent recently, on both ends of the channel.  A page whose contents
+ * are found in the cache is sent as the index of the cache slot instead
+ * of the whole page.
+ *
+ * The sender decides which slot each normal page is stored to and sends
+ * that along with the page, so the receiver never has to hash anything.
+ * Normal pages that get cached are sent from the cache copy rather than
+ * from guest memory, so both caches are guaranteed to hold the same
+ * bytes even if the guest writes to the page concurrently.
+ *
+ * Within a packet, the receiver first stores the normal pages and then
+ * resolves the dedup pages.  To keep that correct a slot is replaced at
+ * most once per packet and never after it was referenced in the packet.
+ */
+#define MULTIFD_DEDUP_SLOTS     4096
+#define MULTIFD_DEDUP_NO_SLOT   UINT32_MAX
+
+typedef struct {
+    /* MULTIFD_DEDUP_SLOTS cached pages */
+    uint8_t *data;
+    /* hash of the page contents in each slot */
+    uint64_t *hash;
+    /* packet sequence number in which each slot was last used */
+    uint64_t *used;
+    /* slots that hold a page */
+    unsigned long *filled;
+    /* big endian slot of each normal page, or MULTIFD_DEDUP_NO_SLOT */
+    uint32_t *normal_slot;
+    /* big endian slot of each dedup page */
+    uint32_t *dedup_slot;
+    /* scratch space for the dedup page offsets */
+    ram_addr_t *dedup_offset;
+    /* packet sequence number */
+    uint64_t seq;
+} MultiFDDedupSend;
+
+typedef struct {
+    /* MULTIFD_DEDUP_SLOTS cached pages */
+    uint8_t *data;
+    /* big endian slot of each normal page, or MULTIFD_DEDUP_NO_SLOT */
+    uint32_t *normal_slot;
+    /* big endian slot of each dedup page */
+    uint32_t *dedup_slot;
+} MultiFDDedupRecv;
+
+#define DEDUP_PRIME64_1 0x9E3779B185EBCA87ULL
+#define DEDUP_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t dedup_round(uint64_t acc, uint64_t input)
+{
+    acc += input * DEDUP_PRIME64_2;
+    acc = rol64(acc, 31);
+    return acc * DEDUP_PRIME64_1;
+}
+
+/*
+ * xxh64-style hash of a page, with four independent lanes so that the
+ * multiplications can be pipelined.  Collisions are harmless, the cached
+ * contents are always compared before a page is sent as a reference.
+ */
+static uint64_t multifd_dedup_hash(const uint8_t *page, size_t len)
+{
+    const uint64_t *p = (const uint64_t *)page;
+    uint64_t v1 = DEDUP_PRIME64_1 + DEDUP_PRIME64_2;
+    uint64_t v2 = DEDUP_PRIME64_2;
+    uint64_t v3 = 0;
+    uint64_t v4 = -DEDUP_PRIME64_1;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(uint64_t); i += 4) {
+        v1 = dedup_round(v1, p[i]);
+        v2 = dedup_round(v2, p[i + 1]);
+        v3 = dedup_round(v3, p[i + 2]);
+        v4 = dedup_round(v4, p[i + 3]);
+    }
+
+    return rol64(v1, 1) + rol64(v2, 7) + rol64(v3, 12) + rol64(v4, 18);
+}
+
+static inline uint8_t *multifd_dedup_slot_ptr(uint8_t *data, uint32_t slot)
+{
+    return data + (size_t)slot * multifd_ram_page_size();
+}
+
+void multifd_dedup_send_setup(MultiFDSendParams *p)
+{
+    MultiFDDedupSend *d = g_new0(MultiFDDedupSend, 1);
+    uint32_t page_count = multifd_ram_page_count();
+
+    d->data = g_malloc((size_t)MULTIFD_DEDUP_SLOTS * multifd_ram_page_size());
+    d->hash = g_new0(uint64_t, MULTIFD_DEDUP_SLOTS);
+    d->used = g_new0(uint64_t, MULTIFD_DEDUP_SLOTS);
+    d->filled = bitmap_new(MULTIFD_DEDUP_SLOTS);
+    d->normal_slot = g_new0(uint32_t, page_count);
+    d->dedup_slot = g_new0(uint32_t, page_count);
+    d->dedup_offset = g_new0(ram_addr_t, page_count);
+    p->dedup_data = d;
+}
+
+void multifd_dedup_send_cleanup(MultiFDSendParams *p)
+{
+    MultiFDDedupSend *d = p->dedup_data;
+
+    if (!d) {
+        return;
+    }
+
+    g_free(d->data);
+    g_free(d->hash);
+    g_free(d->used);
+    g_free(d->filled);
+    g_free(d->normal_slot);
+    g_free(d->dedup_slot);
+    g_free(d->dedup_offset);
+    g_free(d);
+    p->dedup_data = NULL;
+}
+
+/**
+ * multifd_send_dedup_detect: Look up all normal pages in the dedup cache.
+ *
+ * Must be called after multifd_send_zero_page_detect().  Pages found in
+ * the cache are moved right after the normal pages in p->pages->offset
+ * and accounted in p->pages->dedup_num; the others are inserted in the
+ * cache when possible.
+ *
+ * @param p A pointer to the send params.
+ */
+void multifd_send_dedup_detect(MultiFDSendParams *p)
+{
+    MultiFDDedupSend *d = p->dedup_data;
+    MultiFDPages_t *pages = &p->data->u.ram;
+    uint32_t page_size = multifd_ram_page_size();
+    uint64_t seq = ++d->seq;
+    uint32_t normal = 0, dedup = 0;
+
+    for (int i = 0; i < pages->normal_num; i++) {
+        ram_addr_t offset = pages->offset[i];
+        uint8_t *page = pages->block->host + offset;
+        uint64_t hash = multifd_dedup_hash(page, page_size);
+        uint32_t slot = hash & (MULTIFD_DEDUP_SLOTS - 1);
+        uint8_t *cached = multifd_dedup_slot_ptr(d->data, slot);
+
+        if (test_bit(slot, d->filled) && d->hash[slot] == hash &&
+            !memcmp(cached, page, page_size)) {
+            d->used[slot] = seq;
+            d->dedup_offset[dedup] = offset;
+            d->dedup_slot[dedup++] = cpu_to_be32(slot);
+            continue;
+        }
+
+        if (d->used[slot] == seq) {
+            /* Already used by this packet, the receiver needs it as is */
+            slot = MULTIFD_DEDUP_NO_SLOT;
+        } else {
+            memcpy(cached, page, page_size);
+            d->hash[slot] = hash;
+            d->used[slot] = seq;
+            set_bit(slot, d->filled);
+        }
+
+        pages->offset[normal] = offset;
+        d->normal_slot[normal++] = cpu_to_be32(slot);
+    }
+
+    memcpy(&pages->offset[normal], d->dedup_offset,
+           dedup * sizeof(ram_addr_t));
+    pages->normal_num = normal;
+    pages->dedup_num = dedup;
+
+    stat64_add(&mig_stats.dedup_pages, dedup);
+}
+
+/*
+ * The payload of a packet is the slot table of the normal and dedup
+ * pages, followed by the normal pages themselves.
+ */
+void multifd_send_dedup_prepare_iovs(MultiFDSendParams *p)
+{
+    MultiFDDedupSend *d = p->dedup_data;
+    MultiFDPages_t *pages = &p->data->u.ram;
+    uint32_t page_size = multifd_ram_page_size();
+    size_t table_size;
+
+    table_size = (pages->normal_num + pages->dedup_num) * sizeof(uint32_t);
+    if (!table_size) {
+        p->next_packet_size = 0;
+        return;
+    }
+
+    if (pages->normal_num) {
+        p->iov[p->iovs_num].iov_base = d->normal_slot;
+        p->iov[p->iovs_num].iov_len = pages->normal_num * sizeof(uint32_t);
+        p->iovs_num++;
+    }
+    if (pages->dedup_num) {
+        p->iov[p->iovs_num].iov_base = d->dedup_slot;
+        p->iov[p->iovs_num].iov_len = pages->dedup_num * sizeof(uint32_t);
+        p->iovs_num++;
+    }
+
+    for (int i = 0; i < pages->normal_num; i++) {
+        uint32_t slot = be32_to_cpu(d->normal_slot[i]);
+
+        if (slot == MULTIFD_DEDUP_NO_SLOT) {
+            p->iov[p->iovs_num].iov_base = pages->block->host +
+                                           pages->offset[i];
+        } else {
+            p->iov[p->iovs_num].iov_base = multifd_dedup_slot_ptr(d->data,
+                                                                  slot);
+        }
+        p->iov[p->iovs_num].iov_len = page_size;
+        p->iovs_num++;
+    }
+
+    p->next_packet_size = table_size + pages->normal_num * page_size;
+}
+
+void multifd_dedup_recv_setup(MultiFDRecvParams *p)
+{
+    MultiFDDedupRecv *d = g_new0(MultiFDDedupRecv, 1);
+    uint32_t page_count = multifd_ram_page_count();
+
+    d->data = g_malloc0((size_t)MULTIFD_DEDUP_SLOTS * multifd_ram_page_size());
+    d->normal_slot = g_new0(uint32_t, page_count);
+    d->dedup_slot = g_new0(uint32_t, page_count);
+    p->dedup_data = d;
+}
+
+void multifd_dedup_recv_cleanup(MultiFDRecvParams *p)
+{
+    MultiFDDedupRecv *d = p->dedup_data;
+
+    if (!d) {
+        return;
+    }
+
+    g_free(d->data);
+    g_free(d->normal_slot);
+    g_free(d->dedup_slot);
+    g_free(d);
+    p->dedup_data = NULL;
+}
+
+/**
+ * multifd_recv_dedup_process: Receive the payload of a dedup packet.
+ *
+ * Reads the slot table and the normal pages, then stores the normal
+ * pages in the dedup cache and fills the dedup pages from it.
+ *
+ * @param p A pointer to the recv params.
+ * @param errp Pointer to an error.
+ */
+int multifd_recv_dedup_process(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDDedupRecv *d = p->dedup_data;
+    uint32_t page_size = multifd_ram_page_size();
+    int iovs_num = 0;
+    int ret;
+
+    if (!p->normal_num && !p->dedup_num) {
+        return 0;
+    }
+
+    if (p->normal_num) {
+        p->iov[iovs_num].iov_base = d->normal_slot;
+        p->iov[iovs_num].iov_len = p->normal_num * sizeof(uint32_t);
+        iovs_num++;
+    }
+    if (p->dedup_num) {
+        p->iov[iovs_num].iov_base = d->dedup_slot;
+        p->iov[iovs_num].iov_len = p->dedup_num * sizeof(uint32_t);
+        iovs_num++;
+    }
+    iovs_num += multifd_ram_recv_prepare_iovs(p, &p->iov[iovs_num]);
+
+    ret = qio_channel_readv_all(p->c, p->iov, iovs_num, errp);
+    if (ret) {
+        return ret;
+    }
+
+    for (int i = 0; i < p->normal_num; i++) {
+        uint32_t slot = be32_to_cpu(d->normal_slot[i]);
+
+        if (slot == MULTIFD_DEDUP_NO_SLOT) {
+            continue;
+        }
+        if (slot >= MULTIFD_DEDUP_SLOTS) {
+            error_setg(errp, "multifd %u: invalid dedup slot %u",
+                       p->id, slot);
+            return -1;
+        }
+        memcpy(multifd_dedup_slot_ptr(d->data, slot),
+               p->host + p->normal[i], page_size);
+    }
+
+    for (int i = 0; i < p->dedup_num; i++) {
+        uint32_t slot = be32_to_cpu(d->dedup_slot[i]);
+
+        if (slot >= MULTIFD_DEDUP_SLOTS) {
+            error_setg(errp, "multifd %u: invalid dedup slot %u",
+                       p->id, slot);
+            return -1;
+        }
+        memcpy(p->host + p->dedup[i], multifd_dedup_slot_ptr(d->data, slot),
+               page_size);
+        ramblock_recv_bitmap_set_offset(p->block, p->dedup[i]);
+    }
+
+    return 0;
+}
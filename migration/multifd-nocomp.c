@@ -69,7 +69,15 @@ static int multifd_nocomp_send_setup(MultiFDSendParams *p, Error **errp)
         p->write_flags |= QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
     }
 
-    if (!migrate_mapped_ram()) {
+    if (migrate_dedup()) {
+        /* The header, plus the two halves of the dedup slot table */
+        p->iov = g_new0(struct iovec, page_count + 3);
+        multifd_dedup_send_setup(p);
+    } else if (migrate_xbzrle()) {
+        /* The header, plus the XBZRLE length table */
+        p->iov = g_new0(struct iovec, page_count + 2);
+        multifd_xbzrle_send_setup(p);
+    } else if (!migrate_mapped_ram()) {
         /* We need one extra place for the packet header */
         p->iov = g_new0(struct iovec, page_count + 1);
     } else {
@@ -81,6 +89,8 @@ static int multifd_nocomp_send_setup(MultiFDSendParams *p, Error **errp)
 
 static void multifd_nocomp_send_cleanup(MultiFDSendParams *p, Error **errp)
 {
+    multifd_dedup_send_cleanup(p);
+    multifd_xbzrle_send_cleanup(p);
     g_free(p->iov);
     p->iov = NULL;
 }
@@ -92,20 +102,74 @@ static void multifd_ram_prepare_header(MultiFDSendParams *p)
     p->iovs_num++;
 }
 
-static void multifd_send_prepare_iovs(MultiFDSendParams *p)
+/*
+ * Add a page to an iovec array, extending the last element when the
+ * page directly follows it in memory.  Returns the new number of used
+ * elements.
+ */
+static inline uint32_t multifd_iov_add_page(struct iovec *iov, uint32_t num,
+                                            void *addr, uint32_t page_size)
+{
+    if (num && (uint8_t *)iov[num - 1].iov_base + iov[num - 1].iov_len ==
+               (uint8_t *)addr) {
+        iov[num - 1].iov_len += page_size;
+        return num;
+    }
+
+    iov[num].iov_base = addr;
+    iov[num].iov_len = page_size;
+    return num + 1;
+}
+
+void multifd_send_prepare_iovs(MultiFDSendParams *p)
 {
     MultiFDPages_t *pages = &p->data->u.ram;
     uint32_t page_size = multifd_ram_page_size();
+    /* Never merge into the packet header */
+    uint32_t first = p->iovs_num;
+    uint32_t num = 0;
 
     for (int i = 0; i < pages->normal_num; i++) {
-        p->iov[p->iovs_num].iov_base = pages->block->host + pages->offset[i];
-        p->iov[p->iovs_num].iov_len = page_size;
-        p->iovs_num++;
+        num = multifd_iov_add_page(&p->iov[first], num,
+                                   pages->block->host + pages->offset[i],
+                                   page_size);
     }
 
+    p->iovs_num += num;
     p->next_packet_size = pages->normal_num * page_size;
 }
 
+/**
+ * multifd_ram_recv_prepare_iovs: Prepare reading normal pages in place.
+ *
+ * Fills @iov so that the normal pages of the packet are read straight
+ * into guest memory, with pages that are adjacent in the RAMBlock
+ * merged in a single element, and marks them as received.
+ *
+ * Returns the number of elements of @iov that were used.
+ *
+ * @param p A pointer to the recv params.
+ * @param iov The iovec array to fill, with room for p->normal_num entries.
+ */
+uint32_t multifd_ram_recv_prepare_iovs(MultiFDRecvParams *p,
+                                       struct iovec *iov)
+{
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t num = 0;
+
+    for (int i = 0; i < p->normal_num; i++) {
+        num = multifd_iov_add_page(iov, num, p->host + p->normal[i],
+                                   page_size);
+    }
+
+    for (int i = 0; i < num; i++) {
+        ramblock_recv_bitmap_set_range(p->block, iov[i].iov_base,
+                                       iov[i].iov_len / page_size);
+    }
+
+    return num;
+}
+
 static int multifd_nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
 {
     bool use_zero_copy_send = migrate_zero_copy_send();
@@ -128,7 +192,15 @@ static int multifd_nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
         multifd_ram_prepare_header(p);
     }
 
-    multifd_send_prepare_iovs(p);
+    if (migrate_dedup()) {
+        multifd_send_dedup_detect(p);
+        multifd_send_dedup_prepare_iovs(p);
+    } else if (migrate_xbzrle()) {
+        multifd_send_xbzrle_prepare_iovs(p);
+        p->flags |= MULTIFD_FLAG_XBZRLE;
+    } else {
+        multifd_send_prepare_iovs(p);
+    }
     p->flags |= MULTIFD_FLAG_NOCOMP;
 
     multifd_send_fill_packet(p);
@@ -149,12 +221,23 @@ static int multifd_nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
 
 static int multifd_nocomp_recv_setup(MultiFDRecvParams *p, Error **errp)
 {
-    p->iov = g_new0(struct iovec, multifd_ram_page_count());
+    if (migrate_dedup()) {
+        /* Two more for the dedup slot table */
+        p->iov = g_new0(struct iovec, multifd_ram_page_count() + 2);
+        multifd_dedup_recv_setup(p);
+    } else {
+        p->iov = g_new0(struct iovec, multifd_ram_page_count());
+        if (migrate_xbzrle()) {
+            multifd_xbzrle_recv_setup(p);
+        }
+    }
     return 0;
 }
 
 static void multifd_nocomp_recv_cleanup(MultiFDRecvParams *p)
 {
+    multifd_dedup_recv_cleanup(p);
+    multifd_xbzrle_recv_cleanup(p);
     g_free(p->iov);
     p->iov = NULL;
 }
@@ -175,18 +258,35 @@ static int multifd_nocomp_recv(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    /*
+     * The payload of an XBZRLE packet has a different layout, so decoding
+     * it the wrong way would corrupt guest memory.
+     */
+    if (!!(p->flags & MULTIFD_FLAG_XBZRLE) != migrate_xbzrle()) {
+        error_setg(errp, "multifd %u: received %s packet, but xbzrle is %s",
+                   p->id,
+                   p->flags & MULTIFD_FLAG_XBZRLE ? "an XBZRLE" : "a plain",
+                   migrate_xbzrle() ? "enabled" : "not enabled");
+        return -1;
+    }
+
     multifd_recv_zero_page_process(p);
 
+    if (migrate_dedup()) {
+        return multifd_recv_dedup_process(p, errp);
+    }
+
+    if (migrate_xbzrle()) {
+        return multifd_recv_xbzrle_process(p, errp);
+    }
+
     if (!p->normal_num) {
         return 0;
     }
 
-    for (int i = 0; i < p->normal_num; i++) {
-        p->iov[i].iov_base = p->host + p->normal[i];
-        p->iov[i].iov_len = multifd_ram_page_size();
-        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
-    }
-    return qio_channel_readv_all(p->c, p->iov, p->normal_num, errp);
+    return qio_channel_readv_all(p->c, p->iov,
+                                 multifd_ram_recv_prepare_iovs(p, p->iov),
+                                 errp);
 }
 
 static void multifd_pages_reset(MultiFDPages_t *pages)
@@ -197,6 +297,7 @@ static void multifd_pages_reset(MultiFDPages_t *pages)
      */
     pages->num = 0;
     pages->normal_num = 0;
+    pages->dedup_num = 0;
     pages->block = NULL;
 }
 
@@ -204,10 +305,11 @@ void multifd_ram_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
     MultiFDPages_t *pages = &p->data->u.ram;
-    uint32_t zero_num = pages->num - pages->normal_num;
+    uint32_t zero_num = pages->num - pages->normal_num - pages->dedup_num;
 
     packet->pages_alloc = cpu_to_be32(multifd_ram_page_count());
     packet->normal_pages = cpu_to_be32(pages->normal_num);
+    packet->dedup_pages = cpu_to_be32(pages->dedup_num);
     packet->zero_pages = cpu_to_be32(zero_num);
 
     if (pages->block) {
@@ -222,7 +324,7 @@ void multifd_ram_fill_packet(MultiFDSendParams *p)
         packet->offset[i] = cpu_to_be64(temp);
     }
 
-    trace_multifd_send_ram_fill(p->id, pages->normal_num,
+    trace_multifd_send_ram_fill(p->id, pages->normal_num, pages->dedup_num,
                                 zero_num);
 }
 
@@ -248,15 +350,29 @@ int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    p->dedup_num = be32_to_cpu(packet->dedup_pages);
+    if (p->dedup_num && !migrate_dedup()) {
+        error_setg(errp, "multifd: received packet with %u dedup pages, "
+                   "but dedup is not enabled", p->dedup_num);
+        return -1;
+    }
+    if (p->dedup_num > pages_per_packet - p->normal_num) {
+        error_setg(errp,
+                   "multifd: received packet with %u dedup pages, expected maximum %u",
+                   p->dedup_num, pages_per_packet - p->normal_num);
+        return -1;
+    }
+
     p->zero_num = be32_to_cpu(packet->zero_pages);
-    if (p->zero_num > pages_per_packet - p->normal_num) {
+    if (p->zero_num > pages_per_packet - p->normal_num - p->dedup_num) {
         error_setg(errp,
                    "multifd: received packet with %u zero pages, expected maximum %u",
-                   p->zero_num, pages_per_packet - p->normal_num);
+                   p->zero_num,
+                   pages_per_packet - p->normal_num - p->dedup_num);
         return -1;
     }
 
-    if (p->normal_num == 0 && p->zero_num == 0) {
+    if (p->normal_num == 0 && p->zero_num == 0 && p->dedup_num == 0) {
         return 0;
     }
 
@@ -282,9 +398,22 @@ int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->normal[i] = offset;
     }
 
-    for (i = 0; i < p->zero_num; i++) {
+    for (i = 0; i < p->dedup_num; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[p->normal_num + i]);
 
+        if (offset > (p->block->used_length - page_size)) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, p->block->used_length);
+            return -1;
+        }
+        p->dedup[i] = offset;
+    }
+
+    for (i = 0; i < p->zero_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[p->normal_num +
+                                                     p->dedup_num + i]);
+
         if (offset > (p->block->used_length - page_size)) {
             error_setg(errp, "multifd: offset too long %" PRIu64
                        " (max " RAM_ADDR_FMT ")",
@@ -0,0 +1,227 @@
+/*
+ * Multifd XBZRLE encoding
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "system/ramblock.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "multifd.h"
+#include "ram.h"
+#include "xbzrle.h"
+
+/*
+ * With XBZRLE, the payload of a packet is a table with the big endian
+ * length of each normal page, followed by the data of the pages that
+ * have some:
+ *
+ *  - 0: the page did not change, there is no data
+ *  - the page size: the page itself
+ *  - anything else: the page XBZRLE encoded against the previous
+ *    contents of the page on the destination
+ *
+ * The XBZRLE cache is shared by all channels.  A page is only ever in
+ * flight on one channel until the next multifd sync, so the cache and
+ * the destination agree on the contents of each page.
+ */
+
+typedef struct {
+    /* big endian length of each normal page */
+    uint32_t *len;
+    /* data of the normal pages, at most a page each */
+    uint8_t *data;
+    /* scratch page for xbzrle_encode_page() */
+    uint8_t *scratch;
+} MultiFDXbzrleSend;
+
+typedef struct {
+    /* big endian length of each normal page */
+    uint32_t *len;
+    /* encoded pages of the packet */
+    uint8_t *data;
+} MultiFDXbzrleRecv;
+
+void multifd_xbzrle_send_setup(MultiFDSendParams *p)
+{
+    MultiFDXbzrleSend *x = g_new0(MultiFDXbzrleSend, 1);
+    uint32_t page_count = multifd_ram_page_count();
+    uint32_t page_size = multifd_ram_page_size();
+
+    x->len = g_new0(uint32_t, page_count);
+    x->data = g_malloc((size_t)page_count * page_size);
+    x->scratch = g_malloc(page_size);
+    p->xbzrle_data = x;
+}
+
+void multifd_xbzrle_send_cleanup(MultiFDSendParams *p)
+{
+    MultiFDXbzrleSend *x = p->xbzrle_data;
+
+    if (!x) {
+        return;
+    }
+
+    g_free(x->len);
+    g_free(x->data);
+    g_free(x->scratch);
+    g_free(x);
+    p->xbzrle_data = NULL;
+}
+
+/**
+ * multifd_send_xbzrle_prepare_iovs: Encode the pages of a packet.
+ *
+ * Must be called after multifd_send_zero_page_detect().  Also updates
+ * the XBZRLE cache for the zero pages of the packet, so that it doesn't
+ * keep stale contents for them.
+ *
+ * @param p A pointer to the send params.
+ */
+void multifd_send_xbzrle_prepare_iovs(MultiFDSendParams *p)
+{
+    MultiFDXbzrleSend *x = p->xbzrle_data;
+    MultiFDPages_t *pages = &p->data->u.ram;
+    uint32_t page_size = multifd_ram_page_size();
+    XBZRLECacheStats stats = {};
+    uint8_t *data = x->data;
+    size_t size;
+
+    for (int i = pages->normal_num; i < pages->num; i++) {
+        xbzrle_zero_page(pages->block, pages->offset[i]);
+    }
+
+    if (!pages->normal_num) {
+        p->next_packet_size = 0;
+        return;
+    }
+
+    size = pages->normal_num * sizeof(uint32_t);
+    p->iov[p->iovs_num].iov_base = x->len;
+    p->iov[p->iovs_num].iov_len = size;
+    p->iovs_num++;
+
+    for (int i = 0; i < pages->normal_num; i++) {
+        int len = xbzrle_encode_page(pages->block, pages->offset[i], data,
+                                     x->scratch, &stats);
+
+        if (len < 0) {
+            p->iov[p->iovs_num].iov_base = pages->block->host +
+                                           pages->offset[i];
+            len = page_size;
+        } else {
+            p->iov[p->iovs_num].iov_base = data;
+            data += len;
+        }
+        x->len[i] = cpu_to_be32(len);
+        if (len) {
+            p->iov[p->iovs_num].iov_len = len;
+            p->iovs_num++;
+            size += len;
+        }
+    }
+
+    p->next_packet_size = size;
+    xbzrle_counters_add(&stats);
+}
+
+void multifd_xbzrle_recv_setup(MultiFDRecvParams *p)
+{
+    MultiFDXbzrleRecv *x = g_new0(MultiFDXbzrleRecv, 1);
+    uint32_t page_count = multifd_ram_page_count();
+
+    x->len = g_new0(uint32_t, page_count);
+    x->data = g_malloc((size_t)page_count * multifd_ram_page_size());
+    p->xbzrle_data = x;
+}
+
+void multifd_xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    MultiFDXbzrleRecv *x = p->xbzrle_data;
+
+    if (!x) {
+        return;
+    }
+
+    g_free(x->len);
+    g_free(x->data);
+    g_free(x);
+    p->xbzrle_data = NULL;
+}
+
+/**
+ * multifd_recv_xbzrle_process: Receive the payload of an XBZRLE packet.
+ *
+ * Reads the length table, then the pages: unencoded pages straight into
+ * guest memory, encoded ones into a buffer from which they are decoded.
+ *
+ * @param p A pointer to the recv params.
+ * @param errp Pointer to an error.
+ */
+int multifd_recv_xbzrle_process(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDXbzrleRecv *x = p->xbzrle_data;
+    uint32_t page_size = multifd_ram_page_size();
+    uint8_t *data = x->data;
+    int iovs_num = 0;
+    int ret;
+
+    if (!p->normal_num) {
+        return 0;
+    }
+
+    ret = qio_channel_read_all(p->c, (char *)x->len,
+                               p->normal_num * sizeof(uint32_t), errp);
+    if (ret) {
+        return ret;
+    }
+
+    for (int i = 0; i < p->normal_num; i++) {
+        uint32_t len = be32_to_cpu(x->len[i]);
+
+        if (len > page_size) {
+            error_setg(errp, "multifd %u: invalid XBZRLE page length %u",
+                       p->id, len);
+            return -1;
+        }
+        if (len == page_size) {
+            p->iov[iovs_num].iov_base = p->host + p->normal[i];
+        } else {
+            p->iov[iovs_num].iov_base = data;
+            data += len;
+        }
+        if (len) {
+            p->iov[iovs_num].iov_len = len;
+            iovs_num++;
+        }
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+    }
+
+    if (iovs_num) {
+        ret = qio_channel_readv_all(p->c, p->iov, iovs_num, errp);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    data = x->data;
+    for (int i = 0; i < p->normal_num; i++) {
+        uint32_t len = be32_to_cpu(x->len[i]);
+
+        if (!len || len == page_size) {
+            continue;
+        }
+        if (xbzrle_decode_buffer(data, len, p->host + p->normal[i],
+                                 page_size) == -1) {
+            error_setg(errp, "multifd %u: failed to decode XBZRLE page "
+                       "at offset 0x" RAM_ADDR_FMT, p->id, p->normal[i]);
+            return -1;
+        }
+        data += len;
+    }
+
+    return 0;
+}
@@ -13,6 +13,7 @@
 #include "qemu/osdep.h"
 #include <zstd.h>
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "system/ramblock.h"
 #include "exec/target_page.h"
 #include "qapi/error.h"
@@ -21,6 +22,47 @@
 #include "options.h"
 #include "multifd.h"
 
+/*
+ * Encodings the adaptive method chooses from, for each packet.  All
+ * of them decode with the plain nocomp or zstd receive paths.
+ */
+typedef enum {
+    ADAPTIVE_CODEC_NONE,
+    ADAPTIVE_CODEC_ZSTD_FAST,
+    ADAPTIVE_CODEC_ZSTD,
+    ADAPTIVE_CODEC__MAX,
+} AdaptiveCodec;
+
+static const char *const adaptive_codec_name[ADAPTIVE_CODEC__MAX] = {
+    [ADAPTIVE_CODEC_NONE] = "none",
+    [ADAPTIVE_CODEC_ZSTD_FAST] = "zstd-fast",
+    [ADAPTIVE_CODEC_ZSTD] = "zstd",
+};
+
+/* Use a codec other than the best one every that many packets */
+#define ADAPTIVE_PROBE_INTERVAL 32
+
+typedef struct {
+    /* compressed size / input size */
+    double ratio;
+    /* input bytes encoded per nanosecond */
+    double speed;
+    /* number of packets encoded with this codec */
+    uint64_t packets;
+} AdaptiveCodecStats;
+
+typedef struct {
+    AdaptiveCodecStats codec[ADAPTIVE_CODEC__MAX];
+    /* bytes written per nanosecond on this channel */
+    double link_speed;
+    /* packets sent since the last probe */
+    unsigned int since_probe;
+    /* next codec to probe */
+    AdaptiveCodec probe;
+    /* codec used for the previous packet */
+    AdaptiveCodec last;
+} AdaptiveState;
+
 struct zstd_data {
     /* stream for compression */
     ZSTD_CStream *zcs;
@@ -33,6 +75,8 @@ struct zstd_data {
     uint8_t *zbuff;
     /* size of compressed buffer */
     uint32_t zbuff_len;
+    /* only used by the adaptive method */
+    AdaptiveState adaptive;
 };
 
 /* Multifd zstd compression */
@@ -88,17 +132,20 @@ static void multifd_zstd_send_cleanup(MultiFDSendParams *p, Error **errp)
     p->iov = NULL;
 }
 
-static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
+/*
+ * Compress the normal pages of the packet into z->zbuff and queue the
+ * result after the packet header.  @last is the directive used for the
+ * last page: ZSTD_e_flush keeps one stream across packets, ZSTD_e_end
+ * makes each packet a frame of its own.
+ */
+static int multifd_zstd_compress_pages(MultiFDSendParams *p,
+                                       ZSTD_EndDirective last, Error **errp)
 {
     MultiFDPages_t *pages = &p->data->u.ram;
     struct zstd_data *z = p->compress_data;
     int ret;
     uint32_t i;
 
-    if (!multifd_send_prepare_common(p)) {
-        goto out;
-    }
-
     z->out.dst = z->zbuff;
     z->out.size = z->zbuff_len;
     z->out.pos = 0;
@@ -107,7 +154,7 @@ static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
         ZSTD_EndDirective flush = ZSTD_e_continue;
 
         if (i == pages->normal_num - 1) {
-            flush = ZSTD_e_flush;
+            flush = last;
         }
         z->in.src = pages->block->host + pages->offset[i];
         z->in.size = multifd_ram_page_size();
@@ -140,8 +187,16 @@ static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
     p->iov[p->iovs_num].iov_len = z->out.pos;
     p->iovs_num++;
     p->next_packet_size = z->out.pos;
+    return 0;
+}
+
+static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    if (multifd_send_prepare_common(p) &&
+        multifd_zstd_compress_pages(p, ZSTD_e_flush, errp)) {
+        return -1;
+    }
 
-out:
     p->flags |= MULTIFD_FLAG_ZSTD;
     multifd_send_fill_packet(p);
     return 0;
@@ -274,9 +329,206 @@ static const MultiFDMethods multifd_zstd_ops = {
     .recv = multifd_zstd_recv
 };
 
+/*
+ * Multifd adaptive compression
+ *
+ * Each channel picks, for every packet, the encoding that minimizes the
+ * time to get the packet out: compressing costs CPU time on the channel
+ * thread, not compressing costs link time.  Compression speed and ratio
+ * are measured per codec on the packets themselves, so they follow both
+ * the guest memory contents and how much CPU the channel thread actually
+ * gets; the link speed is measured from the time it takes to write the
+ * packets.  Every ADAPTIVE_PROBE_INTERVAL packets another codec is used
+ * to keep its numbers up to date.
+ *
+ * Compressed packets are independent zstd frames so that the level can
+ * change between packets.  Zero pages are still handled by zero page
+ * detection.
+ */
+
+static int multifd_adaptive_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    if (multifd_zstd_send_setup(p, errp)) {
+        return -1;
+    }
+
+    /* Uncompressed packets need the header plus one IOV per page */
+    g_free(p->iov);
+    p->iov = g_new0(struct iovec, multifd_ram_page_count() + 1);
+    return 0;
+}
+
+static int multifd_adaptive_level(AdaptiveCodec codec)
+{
+    if (codec == ADAPTIVE_CODEC_ZSTD_FAST) {
+        return 1;
+    }
+    return MAX(migrate_multifd_zstd_level(), 3);
+}
+
+static double multifd_adaptive_cost(AdaptiveState *a, AdaptiveCodec codec)
+{
+    AdaptiveCodecStats *c = &a->codec[codec];
+
+    if (codec == ADAPTIVE_CODEC_NONE) {
+        return 1 / a->link_speed;
+    }
+    return 1 / c->speed + c->ratio / a->link_speed;
+}
+
+static AdaptiveCodec multifd_adaptive_choose(AdaptiveState *a)
+{
+    AdaptiveCodec best = ADAPTIVE_CODEC_NONE;
+    int i;
+
+    /* Try everything once before comparing */
+    for (i = ADAPTIVE_CODEC_ZSTD_FAST; i < ADAPTIVE_CODEC__MAX; i++) {
+        if (!a->codec[i].packets) {
+            return i;
+        }
+    }
+
+    if (!a->link_speed) {
+        return ADAPTIVE_CODEC_NONE;
+    }
+
+    for (i = ADAPTIVE_CODEC_ZSTD_FAST; i < ADAPTIVE_CODEC__MAX; i++) {
+        if (multifd_adaptive_cost(a, i) < multifd_adaptive_cost(a, best)) {
+            best = i;
+        }
+    }
+
+    if (++a->since_probe >= ADAPTIVE_PROBE_INTERVAL) {
+        a->since_probe = 0;
+        a->probe = (a->probe + 1) % ADAPTIVE_CODEC__MAX;
+        if (a->probe == best) {
+            a->probe = (a->probe + 1) % ADAPTIVE_CODEC__MAX;
+        }
+        return a->probe;
+    }
+
+    return best;
+}
+
+static void multifd_adaptive_update(double *avg, double sample)
+{
+    *avg = *avg ? (*avg * 3 + sample) / 4 : sample;
+}
+
+static int multifd_adaptive_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    struct zstd_data *z = p->compress_data;
+    AdaptiveState *a = &z->adaptive;
+    MultiFDPages_t *pages = &p->data->u.ram;
+    AdaptiveCodec codec;
+    size_t in_size;
+    int64_t start;
+    int res;
+
+    if (p->last_write_ns > 0) {
+        multifd_adaptive_update(&a->link_speed, (double)p->last_write_bytes /
+                                                p->last_write_ns);
+        p->last_write_ns = 0;
+    }
+
+    if (!multifd_send_prepare_common(p)) {
+        p->flags |= MULTIFD_FLAG_NOCOMP;
+        goto out;
+    }
+
+    codec = multifd_adaptive_choose(a);
+    if (codec != a->last) {
+        trace_multifd_adaptive_codec(p->id, adaptive_codec_name[codec]);
+        a->last = codec;
+    }
+    a->codec[codec].packets++;
+
+    if (codec == ADAPTIVE_CODEC_NONE) {
+        multifd_send_prepare_iovs(p);
+        p->flags |= MULTIFD_FLAG_NOCOMP;
+        goto out;
+    }
+
+    res = ZSTD_CCtx_setParameter(z->zcs, ZSTD_c_compressionLevel,
+                                 multifd_adaptive_level(codec));
+    if (ZSTD_isError(res)) {
+        error_setg(errp, "multifd %u: setParameter failed with error %s",
+                   p->id, ZSTD_getErrorName(res));
+        return -1;
+    }
+
+    in_size = pages->normal_num * multifd_ram_page_size();
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (multifd_zstd_compress_pages(p, ZSTD_e_end, errp)) {
+        return -1;
+    }
+    multifd_adaptive_update(&a->codec[codec].speed, (double)in_size /
+        MAX(qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start, 1));
+    multifd_adaptive_update(&a->codec[codec].ratio,
+                            (double)p->next_packet_size / in_size);
+    p->flags |= MULTIFD_FLAG_ZSTD;
+
+out:
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+static int multifd_adaptive_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    if (multifd_zstd_recv_setup(p, errp)) {
+        return -1;
+    }
+
+    p->iov = g_new0(struct iovec, multifd_ram_page_count());
+    return 0;
+}
+
+static void multifd_adaptive_recv_cleanup(MultiFDRecvParams *p)
+{
+    multifd_zstd_recv_cleanup(p);
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+static int multifd_adaptive_recv(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+
+    if (flags == MULTIFD_FLAG_ZSTD) {
+        return multifd_zstd_recv(p, errp);
+    }
+
+    if (flags != MULTIFD_FLAG_NOCOMP) {
+        error_setg(errp, "multifd %u: flags received %x flags expected "
+                   "%x or %x", p->id, flags, MULTIFD_FLAG_NOCOMP,
+                   MULTIFD_FLAG_ZSTD);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        return 0;
+    }
+
+    return qio_channel_readv_all(p->c, p->iov,
+                                 multifd_ram_recv_prepare_iovs(p, p->iov),
+                                 errp);
+}
+
+static const MultiFDMethods multifd_adaptive_ops = {
+    .send_setup = multifd_adaptive_send_setup,
+    .send_cleanup = multifd_zstd_send_cleanup,
+    .send_prepare = multifd_adaptive_send_prepare,
+    .recv_setup = multifd_adaptive_recv_setup,
+    .recv_cleanup = multifd_adaptive_recv_cleanup,
+    .recv = multifd_adaptive_recv
+};
+
 static void multifd_zstd_register(void)
 {
     multifd_register_ops(MULTIFD_COMPRESSION_ZSTD, &multifd_zstd_ops);
+    multifd_register_ops(MULTIFD_COMPRESSION_ADAPTIVE, &multifd_adaptive_ops);
 }
 
 migration_init(multifd_zstd_register);
@@ -14,6 +14,7 @@
 #include "qemu/cutils.h"
 #include "qemu/iov.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/target_page.h"
 #include "system/system.h"
 #include "system/ramblock.h"
@@ -691,6 +692,7 @@ static void *multifd_send_thread(void *opaque)
             bool is_device_state = multifd_payload_device_state(p->data);
             size_t total_size;
             int write_flags_masked = 0;
+            int64_t write_start;
 
             p->flags = 0;
             p->iovs_num = 0;
@@ -714,6 +716,7 @@ static void *multifd_send_thread(void *opaque)
              * being sent.
              */
             total_size = iov_size(p->iov, p->iovs_num);
+            write_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
             if (migrate_mapped_ram()) {
                 assert(!is_device_state);
@@ -731,6 +734,12 @@ static void *multifd_send_thread(void *opaque)
                 break;
             }
 
+            if (!is_device_state) {
+                p->last_write_bytes = total_size;
+                p->last_write_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                   write_start;
+            }
+
             stat64_add(&mig_stats.multifd_bytes, total_size);
 
             p->next_packet_size = 0;
@@ -1136,6 +1145,8 @@ static void multifd_recv_cleanup_channel(MultiFDRecvParams *p)
     p->normal = NULL;
     g_free(p->zero);
     p->zero = NULL;
+    g_free(p->dedup);
+    p->dedup = NULL;
     multifd_recv_state->ops->recv_cleanup(p);
 }
 
@@ -1353,7 +1364,7 @@ static void *multifd_recv_thread(void *opaque)
                  * because older QEMUs (<9.0) still send data along with
                  * the SYNC packet.
                  */
-                has_data = p->normal_num || p->zero_num;
+                has_data = p->normal_num || p->zero_num || p->dedup_num;
             }
 
             qemu_mutex_unlock(&p->mutex);
@@ -1487,6 +1498,7 @@ int multifd_recv_setup(Error **errp)
         p->name = g_strdup_printf(MIGRATION_THREAD_DST_MULTIFD, i);
         p->normal = g_new0(ram_addr_t, page_count);
         p->zero = g_new0(ram_addr_t, page_count);
+        p->dedup = g_new0(ram_addr_t, page_count);
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -66,6 +66,11 @@ MultiFDRecvData *multifd_get_recv_data(void);
 #define MULTIFD_FLAG_QPL (4 << 1)
 #define MULTIFD_FLAG_UADK (8 << 1)
 #define MULTIFD_FLAG_QATZIP (16 << 1)
+/*
+ * The adaptive method does not have a flag of its own: each packet is
+ * tagged MULTIFD_FLAG_NOCOMP or MULTIFD_FLAG_ZSTD, depending on how it
+ * was encoded.
+ */
 
 /*
  * If set it means that this packet contains device state
@@ -73,6 +78,12 @@ MultiFDRecvData *multifd_get_recv_data(void);
  */
 #define MULTIFD_FLAG_DEVICE_STATE (32 << 1)
 
+/*
+ * If set, the pages of this RAM packet are XBZRLE encoded (see
+ * multifd-xbzrle.c).  Both sides must have enabled xbzrle.
+ */
+#define MULTIFD_FLAG_XBZRLE (64 << 1)
+
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
 
@@ -94,12 +105,14 @@ typedef struct {
     uint64_t packet_num;
     /* zero pages */
     uint32_t zero_pages;
-    uint32_t unused32[1];    /* Reserved for future use */
+    /* pages sent as a reference into the dedup cache */
+    uint32_t dedup_pages;
     uint64_t unused64[3];    /* Reserved for future use */
     char ramblock[256];
     /*
      * This array contains the pointers to:
      *  - normal pages (initial normal_pages entries)
+     *  - dedup pages (following dedup_pages entries)
      *  - zero pages (following zero_pages entries)
      */
     uint64_t offset[];
@@ -120,6 +133,8 @@ typedef struct {
     uint32_t num;
     /* number of normal pages */
     uint32_t normal_num;
+    /* number of dedup pages, following the normal ones in @offset */
+    uint32_t dedup_num;
     /*
      * Pointer to the ramblock.  NOTE: it's caller's responsibility to make
      * sure the pointer is always valid!
@@ -228,12 +243,19 @@ typedef struct {
     uint32_t next_packet_size;
     /* packets sent through this channel */
     uint64_t packets_sent;
+    /* size and duration of the last RAM packet write */
+    uint64_t last_write_bytes;
+    int64_t last_write_ns;
     /* buffers to send */
     struct iovec *iov;
     /* number of iovs used */
     uint32_t iovs_num;
     /* used for compression methods */
     void *compress_data;
+    /* used for page deduplication */
+    void *dedup_data;
+    /* used for XBZRLE encoding */
+    void *xbzrle_data;
 }  MultiFDSendParams;
 
 typedef struct {
@@ -291,8 +313,16 @@ typedef struct {
     ram_addr_t *zero;
     /* num of zero pages */
     uint32_t zero_num;
+    /* Pages that are copied from the dedup cache */
+    ram_addr_t *dedup;
+    /* num of dedup pages */
+    uint32_t dedup_num;
     /* used for de-compression methods */
     void *compress_data;
+    /* used for page deduplication */
+    void *dedup_data;
+    /* used for XBZRLE decoding */
+    void *xbzrle_data;
     /* Flags for the QIOChannel */
     int read_flags;
 } MultiFDRecvParams;
@@ -382,6 +412,21 @@ bool multifd_send_prepare_common(MultiFDSendParams *p);
 void multifd_send_zero_page_detect(MultiFDSendParams *p);
 void multifd_recv_zero_page_process(MultiFDRecvParams *p);
 
+void multifd_dedup_send_setup(MultiFDSendParams *p);
+void multifd_dedup_send_cleanup(MultiFDSendParams *p);
+void multifd_send_dedup_detect(MultiFDSendParams *p);
+void multifd_send_dedup_prepare_iovs(MultiFDSendParams *p);
+void multifd_dedup_recv_setup(MultiFDRecvParams *p);
+void multifd_dedup_recv_cleanup(MultiFDRecvParams *p);
+int multifd_recv_dedup_process(MultiFDRecvParams *p, Error **errp);
+
+void multifd_xbzrle_send_setup(MultiFDSendParams *p);
+void multifd_xbzrle_send_cleanup(MultiFDSendParams *p);
+void multifd_send_xbzrle_prepare_iovs(MultiFDSendParams *p);
+void multifd_xbzrle_recv_setup(MultiFDRecvParams *p);
+void multifd_xbzrle_recv_cleanup(MultiFDRecvParams *p);
+int multifd_recv_xbzrle_process(MultiFDRecvParams *p, Error **errp);
+
 void multifd_channel_connect(MultiFDSendParams *p, QIOChannel *ioc);
 bool multifd_send(MultiFDSendData **send_data);
 MultiFDSendData *multifd_send_data_alloc(void);
@@ -407,6 +452,9 @@ void multifd_ram_payload_alloc(MultiFDPages_t *pages);
 void multifd_ram_payload_free(MultiFDPages_t *pages);
 void multifd_ram_fill_packet(MultiFDSendParams *p);
 int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp);
+void multifd_send_prepare_iovs(MultiFDSendParams *p);
+uint32_t multifd_ram_recv_prepare_iovs(MultiFDRecvParams *p,
+                                       struct iovec *iov);
 
 void multifd_send_data_clear_device_state(MultiFDDeviceState_t *device_state);
 
@@ -17,12 +17,17 @@
 #include "qapi/qmp/qerror.h"
 #include "qapi/error.h"
 #include "qemu/host-utils.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
 #include "page_cache.h"
 #include "trace.h"
 
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* maximum number of independently locked shards */
+#define CACHE_SHARDS_MAX 64
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
@@ -32,10 +37,18 @@ struct CacheItem {
 };
 
 struct PageCache {
+    struct rcu_head rcu;
     CacheItem *page_cache;
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
+    /*
+     * Slot i belongs to shard (i % num_shards).  Neighbouring pages land
+     * in different shards, so threads sending different parts of memory
+     * rarely contend.
+     */
+    QemuMutex *shard_lock;
+    size_t num_shards;
 };
 
 PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
@@ -84,6 +97,12 @@ PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
         cache->page_cache[i].it_addr = -1;
     }
 
+    cache->num_shards = MIN(cache->max_num_items, CACHE_SHARDS_MAX);
+    cache->shard_lock = g_new(QemuMutex, cache->num_shards);
+    for (i = 0; i < cache->num_shards; i++) {
+        qemu_mutex_init(&cache->shard_lock[i]);
+    }
+
     return cache;
 }
 
@@ -98,11 +117,21 @@ void cache_fini(PageCache *cache)
         g_free(cache->page_cache[i].it_data);
     }
 
+    for (i = 0; i < cache->num_shards; i++) {
+        qemu_mutex_destroy(&cache->shard_lock[i]);
+    }
+    g_free(cache->shard_lock);
+
     g_free(cache->page_cache);
     cache->page_cache = NULL;
     g_free(cache);
 }
 
+void cache_fini_rcu(PageCache *cache)
+{
+    call_rcu(cache, cache_fini, rcu);
+}
+
 static size_t cache_get_cache_pos(const PageCache *cache,
                                   uint64_t address)
 {
@@ -110,6 +139,22 @@ static size_t cache_get_cache_pos(const PageCache *cache,
     return (address / cache->page_size) & (cache->max_num_items - 1);
 }
 
+static QemuMutex *cache_get_shard_lock(PageCache *cache, uint64_t addr)
+{
+    return &cache->shard_lock[cache_get_cache_pos(cache, addr) %
+                              cache->num_shards];
+}
+
+void cache_lock(PageCache *cache, uint64_t addr)
+{
+    qemu_mutex_lock(cache_get_shard_lock(cache, addr));
+}
+
+void cache_unlock(PageCache *cache, uint64_t addr)
+{
+    qemu_mutex_unlock(cache_get_shard_lock(cache, addr));
+}
+
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
     size_t pos;
@@ -163,10 +208,14 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
             trace_migration_pagecache_insert();
             return -1;
         }
-        cache->num_items++;
+        qatomic_inc(&cache->num_items);
     }
 
-    memcpy(it->it_data, pdata, cache->page_size);
+    if (pdata) {
+        memcpy(it->it_data, pdata, cache->page_size);
+    } else {
+        memset(it->it_data, 0, cache->page_size);
+    }
 
     it->it_age = current_age;
     it->it_addr = addr;
@@ -35,6 +35,33 @@ PageCache *cache_init(uint64_t cache_size, size_t page_size, Error **errp);
  */
 void cache_fini(PageCache *cache);
 
+/**
+ * cache_fini_rcu: free all cache resources once the current RCU grace
+ * period has elapsed
+ * @cache pointer to the PageCache struct
+ */
+void cache_fini_rcu(PageCache *cache);
+
+/**
+ * cache_lock: lock the part of the cache holding an addr
+ *
+ * The functions below access the cache without any locking.  Callers
+ * that may run concurrently must hold this lock around them, and for as
+ * long as they use the data returned by get_cached_data().
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ */
+void cache_lock(PageCache *cache, uint64_t addr);
+
+/**
+ * cache_unlock: unlock the part of the cache holding an addr
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ */
+void cache_unlock(PageCache *cache, uint64_t addr);
+
 /**
  * cache_is_cached: Checks to see if the page is cached
  *
@@ -65,7 +92,7 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
- * @pdata: pointer to the page
+ * @pdata: pointer to the page, or NULL for a page full of zeros
  * @current_age: current bitmap generation
  */
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
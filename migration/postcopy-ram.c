@@ -949,9 +949,13 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
 /*
  * NOTE: @tid is only used when postcopy-blocktime feature is enabled, and
  * also optional: when zero is provided, the fault accounting will be ignored.
+ *
+ * @len is the length of the request, a multiple of the host page size that
+ * covers the faulting page and the pages prefetched along with it.
  */
 static int postcopy_request_page(MigrationIncomingState *mis, RAMBlock *rb,
-                                 ram_addr_t start, uint64_t haddr, uint32_t tid)
+                                 ram_addr_t start, size_t len, uint64_t haddr,
+                                 uint32_t tid)
 {
     void *aligned = (void *)(uintptr_t)ROUND_DOWN(haddr, qemu_ram_pagesize(rb));
 
@@ -970,7 +974,7 @@ static int postcopy_request_page(MigrationIncomingState *mis, RAMBlock *rb,
         return received ? 0 : postcopy_place_page_zero(mis, aligned, rb);
     }
 
-    return migrate_send_rp_req_pages(mis, rb, start, haddr, tid);
+    return migrate_send_rp_req_pages(mis, rb, start, len, haddr, tid);
 }
 
 /*
@@ -992,7 +996,8 @@ int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
         return postcopy_wake_shared(pcfd, client_addr, rb);
     }
     /* TODO: support blocktime tracking */
-    postcopy_request_page(mis, rb, aligned_rbo, client_addr, 0);
+    postcopy_request_page(mis, rb, aligned_rbo, qemu_ram_pagesize(rb),
+                          client_addr, 0);
     return 0;
 }
 
@@ -1259,6 +1264,68 @@ static void mark_postcopy_blocktime_end(uintptr_t addr)
                                  iter.affected_non_cpus);
 }
 
+/* Maximum number of faults read from the userfaultfd at once */
+#define POSTCOPY_FAULT_BATCH            64
+/* Maximum number of host pages prefetched after a faulting page */
+#define POSTCOPY_PREFETCH_PAGES_MAX     32
+
+/*
+ * Access locality of the faults, used to prefetch pages when the guest
+ * touches memory sequentially.
+ */
+typedef struct {
+    /* RAMBlock of the last fault */
+    RAMBlock *rb;
+    /* offset of the last faulting page */
+    ram_addr_t start;
+    /* end of the last request, including the prefetched pages */
+    ram_addr_t end;
+    /* number of pages to prefetch on the next sequential fault */
+    unsigned int window;
+} PostcopyFaultLocality;
+
+/*
+ * Return the length of the request for a fault on the host page at
+ * @start.  A fault right after the previous one, or within the pages
+ * prefetched for it, doubles the prefetch window; any other fault resets
+ * it, so random accesses only request the faulting page.  Prefetching
+ * stops at the first page that does not need to be requested.
+ */
+static size_t postcopy_fault_request_len(PostcopyFaultLocality *loc,
+                                         RAMBlock *rb, ram_addr_t start)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
+    ram_addr_t end = start + pagesize;
+    unsigned int i;
+
+    if (loc->rb == rb && start > loc->start && start <= loc->end) {
+        loc->window = MIN(MAX(loc->window * 2, 1),
+                          POSTCOPY_PREFETCH_PAGES_MAX);
+    } else {
+        loc->window = 0;
+    }
+
+    for (i = 0; i < loc->window; i++) {
+        if (end >= qemu_ram_get_used_length(rb) ||
+            ramblock_recv_bitmap_test_byte_offset(rb, end) ||
+            ramblock_page_is_discarded(rb, end)) {
+            break;
+        }
+        end += pagesize;
+    }
+
+    if (end - start > pagesize) {
+        trace_postcopy_ram_fault_thread_prefetch(qemu_ram_get_idstr(rb),
+                                                 start + pagesize,
+                                                 end - start - pagesize);
+    }
+
+    loc->rb = rb;
+    loc->start = start;
+    loc->end = end;
+    return end - start;
+}
+
 static void postcopy_pause_fault_thread(MigrationIncomingState *mis)
 {
     trace_postcopy_pause_fault_thread();
@@ -1272,6 +1339,8 @@ static void postcopy_pause_fault_thread(MigrationIncomingState *mis)
 static void *postcopy_ram_fault_thread(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
+    PostcopyFaultLocality locality = {};
+    struct uffd_msg *faults;
     struct uffd_msg msg;
     int ret;
     size_t index;
@@ -1286,6 +1355,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
     size_t pfd_len = 2 + mis->postcopy_remote_fds->len;
 
     pfd = g_new0(struct pollfd, pfd_len);
+    faults = g_new(struct uffd_msg, POSTCOPY_FAULT_BATCH);
 
     pfd[0].fd = mis->userfault_fd;
     pfd[0].events = POLLIN;
@@ -1304,6 +1374,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
     while (true) {
         ram_addr_t rb_offset;
         int poll_result;
+        int nr_faults, i;
 
         /*
          * We're mainly waiting for the kernel to give us a faulting HVA,
@@ -1343,9 +1414,15 @@ static void *postcopy_ram_fault_thread(void *opaque)
 
         if (pfd[0].revents) {
             poll_result--;
-            ret = read(mis->userfault_fd, &msg, sizeof(msg));
-            if (ret != sizeof(msg)) {
-                if (errno == EAGAIN) {
+            /*
+             * Read all pending faults at once, so that vCPUs faulting at
+             * the same time don't wait for each other's round trip through
+             * poll().
+             */
+            ret = read(mis->userfault_fd, faults,
+                       POSTCOPY_FAULT_BATCH * sizeof(struct uffd_msg));
+            if (ret <= 0 || ret % sizeof(struct uffd_msg)) {
+                if (ret < 0 && errno == EAGAIN) {
                     /*
                      * if a wake up happens on the other thread just after
                      * the poll, there is nothing to read.
@@ -1359,43 +1436,53 @@ static void *postcopy_ram_fault_thread(void *opaque)
                     break;
                 } else {
                     error_report("%s: Read %d bytes from userfaultfd "
-                                 "expected %zd",
-                                 __func__, ret, sizeof(msg));
+                                 "expected a multiple of %zd",
+                                 __func__, ret, sizeof(struct uffd_msg));
                     break; /* Lost alignment, don't know what we'd read next */
                 }
             }
-            if (msg.event != UFFD_EVENT_PAGEFAULT) {
-                error_report("%s: Read unexpected event %ud from userfaultfd",
-                             __func__, msg.event);
-                continue; /* It's not a page fault, shouldn't happen */
-            }
+            nr_faults = ret / sizeof(struct uffd_msg);
+            trace_postcopy_ram_fault_thread_batch(nr_faults);
 
-            rb = qemu_ram_block_from_host(
-                     (void *)(uintptr_t)msg.arg.pagefault.address,
-                     true, &rb_offset);
-            if (!rb) {
-                error_report("postcopy_ram_fault_thread: Fault outside guest: %"
-                             PRIx64, (uint64_t)msg.arg.pagefault.address);
-                break;
-            }
+            for (i = 0; i < nr_faults; i++) {
+                struct uffd_msg *fault = &faults[i];
+                size_t len;
+
+                if (fault->event != UFFD_EVENT_PAGEFAULT) {
+                    error_report("%s: Read unexpected event %ud from "
+                                 "userfaultfd", __func__, fault->event);
+                    continue; /* It's not a page fault, shouldn't happen */
+                }
 
-            rb_offset = ROUND_DOWN(rb_offset, qemu_ram_pagesize(rb));
-            trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
-                                                qemu_ram_get_idstr(rb),
-                                                rb_offset,
-                                                msg.arg.pagefault.feat.ptid);
+                rb = qemu_ram_block_from_host(
+                         (void *)(uintptr_t)fault->arg.pagefault.address,
+                         true, &rb_offset);
+                if (!rb) {
+                    error_report("postcopy_ram_fault_thread: Fault outside "
+                                 "guest: %" PRIx64,
+                                 (uint64_t)fault->arg.pagefault.address);
+                    goto out;
+                }
+
+                rb_offset = ROUND_DOWN(rb_offset, qemu_ram_pagesize(rb));
+                trace_postcopy_ram_fault_thread_request(
+                    fault->arg.pagefault.address, qemu_ram_get_idstr(rb),
+                    rb_offset, fault->arg.pagefault.feat.ptid);
+                len = postcopy_fault_request_len(&locality, rb, rb_offset);
 retry:
-            /*
-             * Send the request to the source - we want to request one
-             * of our host page sizes (which is >= TPS)
-             */
-            ret = postcopy_request_page(mis, rb, rb_offset,
-                                        msg.arg.pagefault.address,
-                                        msg.arg.pagefault.feat.ptid);
-            if (ret) {
-                /* May be network failure, try to wait for recovery */
-                postcopy_pause_fault_thread(mis);
-                goto retry;
+                /*
+                 * Send the request to the source - we want to request one
+                 * of our host page sizes (which is >= TPS), plus whatever
+                 * is prefetched with it
+                 */
+                ret = postcopy_request_page(mis, rb, rb_offset, len,
+                                            fault->arg.pagefault.address,
+                                            fault->arg.pagefault.feat.ptid);
+                if (ret) {
+                    /* May be network failure, try to wait for recovery */
+                    postcopy_pause_fault_thread(mis);
+                    goto retry;
+                }
             }
         }
 
@@ -1455,8 +1542,10 @@ retry:
             }
         }
     }
+out:
     rcu_unregister_thread();
     trace_postcopy_ram_fault_thread_exit();
+    g_free(faults);
     g_free(pfd);
     return NULL;
 }
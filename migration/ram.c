@@ -28,10 +28,12 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/madvise.h"
 #include "qemu/main-loop.h"
+#include "block/thread-pool.h"
 #include "xbzrle.h"
 #include "ram.h"
 #include "migration.h"
@@ -55,12 +57,14 @@
 #include "system/cpu-throttle.h"
 #include "savevm.h"
 #include "qemu/iov.h"
+#include "io/channel-file.h"
 #include "multifd.h"
 #include "system/runstate.h"
 #include "rdma.h"
 #include "options.h"
 #include "system/dirtylimit.h"
 #include "system/kvm.h"
+#include "hw/core/cpu.h"
 
 #include "hw/boards.h" /* for machine_dump_guest_core() */
 
@@ -148,11 +152,15 @@ static struct {
     uint8_t *encoded_buf;
     /* buffer for storing page content */
     uint8_t *current_buf;
-    /* Cache for XBZRLE, Protected by lock. */
+    /*
+     * Cache for XBZRLE, replaced under lock.  Multifd send threads access
+     * it without the lock, under RCU; individual pages are protected by
+     * cache_lock().
+     */
     PageCache *cache;
     QemuMutex lock;
-    /* it will store a page full of zeros */
-    uint8_t *zero_target_page;
+    /* RAMState::xbzrle_started, for the multifd send threads */
+    bool started;
     /* buffer used for XBZRLE decoding */
     uint8_t *decoded_buf;
 } XBZRLE;
@@ -186,7 +194,7 @@ static void XBZRLE_cache_unlock(void)
  */
 int xbzrle_cache_resize(uint64_t new_size, Error **errp)
 {
-    PageCache *new_cache;
+    PageCache *new_cache, *old_cache;
     int64_t ret = 0;
 
     /* Check for truncation */
@@ -210,8 +218,10 @@ int xbzrle_cache_resize(uint64_t new_size, Error **errp)
             goto out;
         }
 
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+        old_cache = XBZRLE.cache;
+        /* Unpublish the old cache before its grace period starts */
+        qatomic_rcu_set(&XBZRLE.cache, new_cache);
+        cache_fini_rcu(old_cache);
     }
 out:
     XBZRLE_cache_unlock();
@@ -381,6 +391,18 @@ struct RAMState {
     uint32_t last_version;
     /* How many times we have dirty too many pages */
     int dirty_rate_high_cnt;
+    /*
+     * Smoothed dirty and transfer rates in bytes per second, used by
+     * the predictive throttle
+     */
+    double dirty_rate_avg;
+    double xfer_rate_avg;
+    /*
+     * Predicted time in milliseconds until the remaining dirty memory
+     * fits in the downtime limit, -1 if unknown.  Read without locking
+     * by the monitor.
+     */
+    int64_t expected_convergence_time;
     /* these variables are used for bitmap sync */
     /* last time we did a full bitmap_sync */
     int64_t time_last_bitmap_sync;
@@ -432,6 +454,11 @@ struct RAMState {
      * Protected by @bitmap_mutex.
      */
     PageLocationHint page_hint;
+    /*
+     * Worker threads used to sync the dirty bitmap of large RAMBlocks in
+     * parallel.  Created on the first sync that needs them.
+     */
+    ThreadPool *sync_threads;
 };
 typedef struct RAMState RAMState;
 
@@ -474,6 +501,12 @@ uint64_t ram_bytes_remaining(void)
                        0;
 }
 
+int64_t ram_expected_convergence_time(void)
+{
+    return ram_state ? qatomic_read(&ram_state->expected_convergence_time) :
+                       -1;
+}
+
 void ram_transferred_add(uint64_t bytes)
 {
     if (runstate_is_running()) {
@@ -598,12 +631,14 @@ void mig_throttle_counter_reset(void)
  * As a bonus, if the page wasn't in the cache it gets added so that
  * when a small write is made into the 0'd page it gets XBZRLE sent.
  */
-static void xbzrle_cache_zero_page(ram_addr_t current_addr)
+static void xbzrle_cache_zero_page(PageCache *cache, ram_addr_t current_addr)
 {
+    cache_lock(cache, current_addr);
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
+    cache_insert(cache, current_addr, NULL,
                  stat64_get(&mig_stats.dirty_sync_count));
+    cache_unlock(cache, current_addr);
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -631,18 +666,22 @@ static int save_xbzrle_page(RAMState *rs, PageSearchStatus *pss,
     QEMUFile *file = pss->pss_channel;
     uint64_t generation = stat64_get(&mig_stats.dirty_sync_count);
 
+    /*
+     * Without multifd, only the migration thread uses the cache and it
+     * holds XBZRLE.lock, so the cache data can be used after unlocking.
+     */
+    cache_lock(XBZRLE.cache, current_addr);
     if (!cache_is_cached(XBZRLE.cache, current_addr, generation)) {
         xbzrle_counters.cache_miss++;
         if (!rs->last_stage) {
             if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             generation) == -1) {
-                return -1;
-            } else {
+                             generation) == 0) {
                 /* update *current_data when the page has been
                    inserted into cache */
                 *current_data = get_cached_data(XBZRLE.cache, current_addr);
             }
         }
+        cache_unlock(XBZRLE.cache, current_addr);
         return -1;
     }
 
@@ -681,6 +720,7 @@ static int save_xbzrle_page(RAMState *rs, PageSearchStatus *pss,
          */
         *current_data = prev_cached_page;
     }
+    cache_unlock(XBZRLE.cache, current_addr);
 
     if (encoded_len == 0) {
         trace_save_xbzrle_page_skipping();
@@ -709,6 +749,109 @@ static int save_xbzrle_page(RAMState *rs, PageSearchStatus *pss,
     return 1;
 }
 
+/**
+ * xbzrle_encode_page: XBZRLE encode a page sent by a multifd channel
+ *
+ * Returns the length of the data stored in @dst: the encoded page if it
+ * is shorter than a page, otherwise the page itself.  Returns 0 if the
+ * page did not change since it was cached, and -1 if it isn't handled by
+ * XBZRLE and has to be sent from guest memory.
+ *
+ * The data stored in @dst is a copy, so it matches the cache even if the
+ * guest keeps writing to the page.
+ *
+ * @block: block that contains the page
+ * @offset: offset inside the block for the page
+ * @dst: buffer of TARGET_PAGE_SIZE bytes for the data to send
+ * @buf: scratch buffer of TARGET_PAGE_SIZE bytes
+ * @stats: counters to update
+ */
+int xbzrle_encode_page(RAMBlock *block, ram_addr_t offset, uint8_t *dst,
+                       uint8_t *buf, XBZRLECacheStats *stats)
+{
+    ram_addr_t current_addr = block->offset + offset;
+    uint64_t generation = stat64_get(&mig_stats.dirty_sync_count);
+    uint8_t *prev_cached_page;
+    PageCache *cache;
+    int len;
+
+    RCU_READ_LOCK_GUARD();
+
+    cache = qatomic_rcu_read(&XBZRLE.cache);
+    if (!cache || !qatomic_read(&XBZRLE.started)) {
+        return -1;
+    }
+
+    cache_lock(cache, current_addr);
+
+    if (!cache_is_cached(cache, current_addr, generation)) {
+        stats->cache_miss++;
+        len = -1;
+        if (cache_insert(cache, current_addr, block->host + offset,
+                         generation) == 0) {
+            memcpy(dst, get_cached_data(cache, current_addr),
+                   TARGET_PAGE_SIZE);
+            len = TARGET_PAGE_SIZE;
+        }
+        goto out;
+    }
+
+    stats->pages++;
+    prev_cached_page = get_cached_data(cache, current_addr);
+    memcpy(buf, block->host + offset, TARGET_PAGE_SIZE);
+
+    /* Only use the encoding when it is shorter than the page */
+    len = xbzrle_encode_buffer(prev_cached_page, buf, TARGET_PAGE_SIZE,
+                               dst, TARGET_PAGE_SIZE - 1);
+    if (len) {
+        memcpy(prev_cached_page, buf, TARGET_PAGE_SIZE);
+    }
+    if (len == -1) {
+        stats->overflow++;
+        memcpy(dst, buf, TARGET_PAGE_SIZE);
+        len = TARGET_PAGE_SIZE;
+    }
+    stats->bytes += len;
+
+out:
+    cache_unlock(cache, current_addr);
+    return len;
+}
+
+/**
+ * xbzrle_zero_page: Update the XBZRLE cache for a page a multifd channel
+ * sends as a zero page
+ *
+ * @block: block that contains the page
+ * @offset: offset inside the block for the page
+ */
+void xbzrle_zero_page(RAMBlock *block, ram_addr_t offset)
+{
+    PageCache *cache;
+
+    RCU_READ_LOCK_GUARD();
+
+    cache = qatomic_rcu_read(&XBZRLE.cache);
+    if (cache && qatomic_read(&XBZRLE.started)) {
+        xbzrle_cache_zero_page(cache, block->offset + offset);
+    }
+}
+
+/**
+ * xbzrle_counters_add: Account XBZRLE pages sent by a multifd channel
+ *
+ * @stats: counters to add to the global ones
+ */
+void xbzrle_counters_add(const XBZRLECacheStats *stats)
+{
+    XBZRLE_cache_lock();
+    xbzrle_counters.pages += stats->pages;
+    xbzrle_counters.bytes += stats->bytes;
+    xbzrle_counters.cache_miss += stats->cache_miss;
+    xbzrle_counters.overflow += stats->overflow;
+    XBZRLE_cache_unlock();
+}
+
 /**
  * pss_find_next_dirty: find the next dirty page of current ramblock
  *
@@ -944,6 +1087,97 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * Dirty bitmap sync is split into chunks of at least this size, rounded
+ * up to the clear bitmap granularity of the RAMBlock.  Only when there
+ * is more than one chunk in total is the sync spread across threads.
+ */
+#define RAM_SYNC_CHUNK_SIZE     (1ULL << 30)
+#define RAM_SYNC_THREADS_MAX    8
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+    uint64_t new_dirty_pages;
+} RAMSyncChunk;
+
+static int ramblock_sync_chunk(void *opaque)
+{
+    RAMSyncChunk *chunk = opaque;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        chunk->new_dirty_pages =
+            cpu_physical_memory_sync_dirty_bitmap(chunk->block, chunk->start,
+                                                  chunk->length);
+    }
+    return 0;
+}
+
+static ram_addr_t ramblock_sync_chunk_size(RAMBlock *rb)
+{
+    return ROUND_UP(RAM_SYNC_CHUNK_SIZE,
+                    (ram_addr_t)TARGET_PAGE_SIZE << rb->clear_bmap_shift);
+}
+
+/*
+ * Sync the dirty bitmap of all RAMBlocks.  Large blocks are cut in
+ * chunks that are handed to a thread pool, so that the
+ * DIRTY_MEMORY_MIGRATION -> RAMBlock.bmap merge of a guest with lots of
+ * RAM does not run on a single core.
+ *
+ * Called with RCU critical section and bitmap_mutex held.
+ */
+static void ram_sync_dirty_bitmap(RAMState *rs)
+{
+    g_autofree RAMSyncChunk *chunks = NULL;
+    size_t nr_chunks = 0, i = 0;
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t size = ramblock_sync_chunk_size(block);
+
+        nr_chunks += DIV_ROUND_UP(block->used_length, size);
+    }
+
+    if (nr_chunks < 2) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ramblock_sync_dirty_bitmap(rs, block);
+        }
+        return;
+    }
+
+    if (!rs->sync_threads) {
+        rs->sync_threads = thread_pool_new();
+    }
+    thread_pool_set_max_threads(rs->sync_threads,
+                                MIN(nr_chunks, RAM_SYNC_THREADS_MAX));
+
+    chunks = g_new0(RAMSyncChunk, nr_chunks);
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t size = ramblock_sync_chunk_size(block);
+        ram_addr_t start;
+
+        for (start = 0; start < block->used_length; start += size) {
+            RAMSyncChunk *chunk = &chunks[i++];
+
+            chunk->block = block;
+            chunk->start = start;
+            chunk->length = MIN(size, block->used_length - start);
+            thread_pool_submit(rs->sync_threads, ramblock_sync_chunk,
+                               chunk, NULL);
+        }
+    }
+    assert(i == nr_chunks);
+
+    thread_pool_wait(rs->sync_threads);
+
+    for (i = 0; i < nr_chunks; i++) {
+        rs->migration_dirty_pages += chunks[i].new_dirty_pages;
+        rs->num_dirty_pages_period += chunks[i].new_dirty_pages;
+    }
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1035,7 +1269,132 @@ static void migration_dirty_limit_guest(void)
     trace_migration_dirty_limit_guest(quota_dirtyrate);
 }
 
-static void migration_trigger_throttle(RAMState *rs)
+static int dirty_rate_cmp(const void *a, const void *b)
+{
+    int64_t ra = *(const int64_t *)a;
+    int64_t rb = *(const int64_t *)b;
+
+    return ra < rb ? -1 : ra > rb;
+}
+
+/*
+ * Find the per-vCPU dirty rate quota (MB/s) that keeps the sum of the
+ * vCPU dirty rates within @total, giving the share of vCPUs that dirty
+ * less than their fair share to the others.
+ */
+static uint64_t migration_dirty_limit_quota(uint64_t total)
+{
+    g_autofree int64_t *rates = NULL;
+    CPUState *cpu;
+    int n = 0, i;
+
+    CPU_FOREACH(cpu) {
+        n++;
+    }
+    if (!n) {
+        return MAX(total, 1);
+    }
+    if (!dirtylimit_in_service()) {
+        /* No per-vCPU statistics yet, split evenly */
+        return MAX(total / n, 1);
+    }
+
+    rates = g_new(int64_t, n);
+    i = 0;
+    CPU_FOREACH(cpu) {
+        rates[i++] = vcpu_dirty_rate_get(cpu->cpu_index);
+    }
+    qsort(rates, n, sizeof(*rates), dirty_rate_cmp);
+
+    for (i = 0; i < n; i++) {
+        uint64_t share = total / (n - i);
+
+        if (rates[i] > share) {
+            return MAX(share, 1);
+        }
+        total -= rates[i];
+    }
+
+    /* Everybody fits, the limit is only there to stop a sudden burst */
+    return MAX(rates[n - 1], 1);
+}
+
+/*
+ * Predictive throttle: instead of stepping the throttle up every time the
+ * guest dirtied too much during two periods, use smoothed dirty and
+ * transfer rates to compute the throttle that brings the dirty rate down
+ * to the trigger threshold right away, and relax it when the guest has
+ * calmed down.  The same rates give the expected convergence time.
+ */
+static void migration_throttle_predict(RAMState *rs, uint64_t period_ms,
+                                       uint64_t bytes_xfer_period,
+                                       uint64_t bytes_dirty_period)
+{
+    uint64_t threshold = migrate_throttle_trigger_threshold();
+    double dirty_rate = bytes_dirty_period * 1000.0 / period_ms;
+    double xfer_rate = bytes_xfer_period * 1000.0 / period_ms;
+    double target_rate, remaining, downtime_bytes;
+    int64_t convergence = -1;
+
+    if (!rs->xfer_rate_avg) {
+        rs->dirty_rate_avg = dirty_rate;
+        rs->xfer_rate_avg = xfer_rate;
+    } else {
+        rs->dirty_rate_avg = (rs->dirty_rate_avg + dirty_rate) / 2;
+        rs->xfer_rate_avg = (rs->xfer_rate_avg + xfer_rate) / 2;
+    }
+    dirty_rate = rs->dirty_rate_avg;
+    xfer_rate = rs->xfer_rate_avg;
+
+    /*
+     * Remaining dirty memory shrinks at (xfer_rate - dirty_rate); we are
+     * done when it can be sent within the downtime limit.
+     */
+    remaining = ram_bytes_remaining();
+    downtime_bytes = xfer_rate * migrate_downtime_limit() / 1000;
+    if (remaining <= downtime_bytes) {
+        convergence = 0;
+    } else if (xfer_rate > dirty_rate) {
+        convergence = (remaining - downtime_bytes) * 1000 /
+                      (xfer_rate - dirty_rate);
+    }
+    qatomic_set(&rs->expected_convergence_time, convergence);
+
+    target_rate = xfer_rate * threshold / 100;
+    trace_migration_throttle_predict(dirty_rate, xfer_rate, convergence);
+
+    if (migrate_auto_converge()) {
+        uint64_t throttle_now = cpu_throttle_active() ?
+                                cpu_throttle_get_percentage() : 0;
+        uint64_t cpu_now = 100 - throttle_now;
+        uint64_t pct;
+
+        if (dirty_rate > target_rate) {
+            pct = 100 - cpu_now * target_rate / dirty_rate;
+            pct = MAX(pct, migrate_cpu_throttle_initial());
+            pct = MIN(pct, migrate_max_cpu_throttle());
+            if (pct > throttle_now) {
+                trace_migration_throttle();
+                cpu_throttle_set(pct);
+            }
+        } else if (throttle_now && dirty_rate < target_rate / 2) {
+            pct = throttle_now - MIN(throttle_now,
+                                     migrate_cpu_throttle_increment());
+            if (pct < migrate_cpu_throttle_initial()) {
+                cpu_throttle_stop();
+            } else {
+                cpu_throttle_set(pct);
+            }
+        }
+    } else if (migrate_dirty_limit() && dirty_rate > target_rate) {
+        uint64_t quota = migration_dirty_limit_quota(target_rate / MiB);
+
+        qmp_set_vcpu_dirty_limit(false, -1, quota, NULL);
+        trace_migration_dirty_limit_guest(quota);
+    }
+}
+
+static void migration_trigger_throttle(RAMState *rs, uint64_t period_ms)
 {
     uint64_t threshold = migrate_throttle_trigger_threshold();
     uint64_t bytes_xfer_period =
@@ -1043,6 +1402,12 @@ static void migration_trigger_throttle(RAMState *rs)
     uint64_t bytes_dirty_period = rs->num_dirty_pages_period * TARGET_PAGE_SIZE;
     uint64_t bytes_dirty_threshold = bytes_xfer_period * threshold / 100;
 
+    if (migrate_throttle_predictive()) {
+        migration_throttle_predict(rs, period_ms, bytes_xfer_period,
+                                   bytes_dirty_period);
+        return;
+    }
+
     /*
      * The following detection logic can be refined later. For now:
      * Check to see if the ratio between dirtied bytes and the approx.
@@ -1065,8 +1430,7 @@ static void migration_trigger_throttle(RAMState *rs)
 
 static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 {
-    RAMBlock *block;
-    int64_t end_time;
+    int64_t start_us, end_time;
 
     stat64_add(&mig_stats.dirty_sync_count, 1);
 
@@ -1075,16 +1439,20 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
     }
 
     trace_migration_bitmap_sync_start();
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     memory_global_dirty_log_sync(last_stage);
+    stat64_set(&mig_stats.dirty_sync_log_time,
+               qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us);
 
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
         WITH_RCU_READ_LOCK_GUARD() {
-            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-                ramblock_sync_dirty_bitmap(rs, block);
-            }
+            ram_sync_dirty_bitmap(rs);
             stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
         }
     }
+    stat64_set(&mig_stats.dirty_sync_bitmap_time,
+               qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_us);
 
     memory_global_after_dirty_log_sync();
     trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
@@ -1093,7 +1461,7 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > rs->time_last_bitmap_sync + 1000) {
-        migration_trigger_throttle(rs);
+        migration_trigger_throttle(rs, end_time - rs->time_last_bitmap_sync);
 
         migration_update_rates(rs, end_time);
 
@@ -1184,7 +1552,7 @@ static int save_zero_page(RAMState *rs, PageSearchStatus *pss,
      */
     if (rs->xbzrle_started) {
         XBZRLE_cache_lock();
-        xbzrle_cache_zero_page(pss->block->offset + offset);
+        xbzrle_cache_zero_page(XBZRLE.cache, pss->block->offset + offset);
         XBZRLE_cache_unlock();
     }
 
@@ -1334,6 +1702,7 @@ static int find_dirty_block(RAMState *rs, PageSearchStatus *pss)
             /* After the first round, enable XBZRLE. */
             if (migrate_xbzrle()) {
                 rs->xbzrle_started = true;
+                qatomic_set(&XBZRLE.started, true);
             }
         }
         /* Didn't find anything this time, but try again on the new block */
@@ -1948,9 +2317,8 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len,
              * will automatically be moved and point to the next host page
              * we're going to send, so no need to update here.
              *
-             * Normally QEMU never sends >1 host page in requests, so
-             * logically we don't even need that as the loop should only
-             * run once, but just to be consistent.
+             * Requests cover more than one host page when the destination
+             * prefetches the pages following a fault.
              */
             len -= page_size;
         };
@@ -2354,6 +2722,7 @@ static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
         migration_page_queue_free(*rsp);
+        g_clear_pointer(&(*rsp)->sync_threads, thread_pool_free);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
         g_free(*rsp);
@@ -2365,14 +2734,16 @@ static void xbzrle_cleanup(void)
 {
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
-        cache_fini(XBZRLE.cache);
+        PageCache *old_cache = XBZRLE.cache;
+
+        /* Multifd send threads may still be running */
+        qatomic_rcu_set(&XBZRLE.cache, NULL);
+        cache_fini_rcu(old_cache);
         g_free(XBZRLE.encoded_buf);
         g_free(XBZRLE.current_buf);
-        g_free(XBZRLE.zero_target_page);
-        XBZRLE.cache = NULL;
+        qatomic_set(&XBZRLE.started, false);
         XBZRLE.encoded_buf = NULL;
         XBZRLE.current_buf = NULL;
-        XBZRLE.zero_target_page = NULL;
     }
     XBZRLE_cache_unlock();
 }
@@ -2681,16 +3052,10 @@ static bool xbzrle_init(Error **errp)
 
     XBZRLE_cache_lock();
 
-    XBZRLE.zero_target_page = g_try_malloc0(TARGET_PAGE_SIZE);
-    if (!XBZRLE.zero_target_page) {
-        error_setg(errp, "%s: Error allocating zero page", __func__);
-        goto err_out;
-    }
-
     XBZRLE.cache = cache_init(migrate_xbzrle_cache_size(),
                               TARGET_PAGE_SIZE, errp);
     if (!XBZRLE.cache) {
-        goto free_zero_page;
+        goto err_out;
     }
 
     XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
@@ -2715,9 +3080,6 @@ free_encoded_buf:
 free_cache:
     cache_fini(XBZRLE.cache);
     XBZRLE.cache = NULL;
-free_zero_page:
-    g_free(XBZRLE.zero_target_page);
-    XBZRLE.zero_target_page = NULL;
 err_out:
     XBZRLE_cache_unlock();
     return false;
@@ -2743,6 +3105,7 @@ static bool ram_state_init(RAMState **rsp, Error **errp)
      * This must match with the initial values of dirty bitmap.
      */
     (*rsp)->migration_dirty_pages = (*rsp)->ram_bytes_total >> TARGET_PAGE_BITS;
+    (*rsp)->expected_convergence_time = -1;
     ram_state_reset(*rsp);
 
     return true;
@@ -4014,13 +4377,100 @@ err:
     return false;
 }
 
+#ifndef _WIN32
+/*
+ * Whether the file holds any data in [start, start + len), as opposed to
+ * a hole.  Moves the file offset, the caller must seek afterwards.
+ */
+static bool mapped_ram_file_has_data(int fd, off_t start, off_t len)
+{
+#ifdef SEEK_DATA
+    off_t data = lseek(fd, start, SEEK_DATA);
+
+    if (data < 0) {
+        /* ENXIO means that there is only a hole up to the end of file */
+        return errno != ENXIO;
+    }
+    return data < start + len;
+#else
+    return true;
+#endif
+}
+#endif
+
+/*
+ * With lazy-restore, map the pages of @block copy-on-write from the
+ * migration file instead of reading them, so that they are only read
+ * when the guest first accesses them.
+ *
+ * Returns true if the block was mapped.  Returns false if it must be
+ * read as usual, or on failure, in which case @errp is set.
+ */
+static bool mapped_ram_map_ramblock(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t length, long num_pages,
+                                    unsigned long *bitmap, Error **errp)
+{
+#ifndef _WIN32
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    unsigned long set_bit_idx, clear_bit_idx;
+    struct stat st;
+    int fd, ret;
+
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE) ||
+        length != block->used_length) {
+        return false;
+    }
+    fd = QIO_CHANNEL_FILE(ioc)->fd;
+
+    /* Accessing pages past the end of the file would raise SIGBUS */
+    if (fstat(fd, &st) < 0 || st.st_size < block->pages_offset + length) {
+        return false;
+    }
+
+    ret = qemu_ram_map_file_private(block, fd, block->pages_offset);
+    if (ret == -ENOTSUP) {
+        return false;
+    } else if (ret) {
+        error_setg_errno(errp, -ret, "failed to map ramblock %s from the "
+                         "migration file", block->idstr);
+        return false;
+    }
+
+    /*
+     * Zero pages are not written to the file, but the file is not
+     * truncated when saving, so it may still hold stale data for them.
+     */
+    for (clear_bit_idx = find_first_zero_bit(bitmap, num_pages);
+         clear_bit_idx < num_pages;
+         clear_bit_idx = find_next_zero_bit(bitmap, num_pages,
+                                            set_bit_idx + 1)) {
+        set_bit_idx = find_next_bit(bitmap, num_pages, clear_bit_idx + 1);
+
+        if (mapped_ram_file_has_data(fd, block->pages_offset +
+                                     (clear_bit_idx << TARGET_PAGE_BITS),
+                                     (set_bit_idx - clear_bit_idx) <<
+                                     TARGET_PAGE_BITS)) {
+            memset(block->host + (clear_bit_idx << TARGET_PAGE_BITS), 0,
+                   (set_bit_idx - clear_bit_idx) << TARGET_PAGE_BITS);
+        }
+    }
+
+    trace_ram_load_mapped_ram_lazy(block->idstr, length);
+    return true;
+#else
+    return false;
+#endif
+}
+
 static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
                                       ram_addr_t length, Error **errp)
 {
+    ERRP_GUARD();
     g_autofree unsigned long *bitmap = NULL;
     MappedRamHeader header;
     size_t bitmap_size;
     long num_pages;
+    bool mapped = false;
 
     if (!mapped_ram_read_header(f, &header, errp)) {
         return;
@@ -4051,7 +4501,16 @@ static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
         return;
     }
 
-    if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
+    if (migrate_lazy_restore()) {
+        mapped = mapped_ram_map_ramblock(f, block, length, num_pages, bitmap,
+                                         errp);
+        if (*errp) {
+            return;
+        }
+    }
+
+    if (!mapped &&
+        !read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
         return;
     }
 
@@ -75,6 +75,7 @@ extern XBZRLECacheStats xbzrle_counters;
 void ram_mig_init(void);
 int xbzrle_cache_resize(uint64_t new_size, Error **errp);
 uint64_t ram_bytes_remaining(void);
+int64_t ram_expected_convergence_time(void);
 uint64_t ram_bytes_total(void);
 void mig_throttle_counter_reset(void);
 
@@ -94,6 +95,11 @@ void ram_handle_zero(void *host, uint64_t size);
 void ram_transferred_add(uint64_t bytes);
 void ram_release_page(const char *rbname, uint64_t offset);
 
+int xbzrle_encode_page(RAMBlock *block, ram_addr_t offset, uint8_t *dst,
+                       uint8_t *buf, XBZRLECacheStats *stats);
+void xbzrle_zero_page(RAMBlock *block, ram_addr_t offset);
+void xbzrle_counters_add(const XBZRLECacheStats *stats);
+
 int ramblock_recv_bitmap_test(RAMBlock *rb, void *host_addr);
 bool ramblock_recv_bitmap_test_byte_offset(RAMBlock *rb, uint64_t byte_offset);
 void ramblock_recv_bitmap_set(RAMBlock *rb, void *host_addr);
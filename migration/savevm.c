@@ -94,6 +94,7 @@ enum qemu_vm_cmd {
     MIG_CMD_POSTCOPY_RESUME,   /* resume postcopy on dest */
     MIG_CMD_RECV_BITMAP,       /* Request for recved bitmap on dst */
     MIG_CMD_SWITCHOVER_START,  /* Switchover start notification */
+    MIG_CMD_DEVICE_STATE_BARRIER, /* Wait for parallel device state */
     MIG_CMD_MAX
 };
 
@@ -114,6 +115,8 @@ static struct mig_cmd_args {
     [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
     [MIG_CMD_RECV_BITMAP]      = { .len = -1, .name = "RECV_BITMAP" },
     [MIG_CMD_SWITCHOVER_START] = { .len =  0, .name = "SWITCHOVER_START" },
+    [MIG_CMD_DEVICE_STATE_BARRIER] = {
+        .len = sizeof(uint32_t), .name = "DEVICE_STATE_BARRIER" },
     [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
 };
 
@@ -1240,6 +1243,20 @@ static void qemu_savevm_send_switchover_start(QEMUFile *f)
     qemu_savevm_command_send(f, MIG_CMD_SWITCHOVER_START, 0, NULL);
 }
 
+/*
+ * Tell the destination to wait until it loaded @count device sections from
+ * the multifd channels before it goes on with the main stream.
+ */
+static void qemu_savevm_send_device_state_barrier(QEMUFile *f, uint32_t count)
+{
+    uint32_t buf;
+
+    trace_savevm_send_device_state_barrier(count);
+    buf = cpu_to_be32(count);
+    qemu_savevm_command_send(f, MIG_CMD_DEVICE_STATE_BARRIER, sizeof(buf),
+                             (uint8_t *)&buf);
+}
+
 void qemu_savevm_maybe_send_switchover_start(QEMUFile *f)
 {
     if (migrate_send_switchover_start()) {
@@ -1644,6 +1661,48 @@ ret_fail_abort_threads:
     return -1;
 }
 
+static bool qemu_savevm_se_parallel(SaveStateEntry *se)
+{
+    return se->vmsd && se->vmsd->parallel && !se->ops &&
+           !se->vmsd->early_setup;
+}
+
+/*
+ * Save the state of a parallel device into a buffer and queue it to the
+ * multifd channels.  The buffer starts with the version of the section,
+ * which the destination would otherwise find in the section header.
+ */
+static bool qemu_savevm_parallel_save_thread(SaveCompletePrecopyThreadData *d,
+                                             Error **errp)
+{
+    SaveStateEntry *se = d->handler_opaque;
+    g_autoptr(QIOChannelBuffer) bioc = qio_channel_buffer_new(4096);
+    QEMUFile *f = qemu_file_new_output(QIO_CHANNEL(bioc));
+    int ret;
+
+    trace_vmstate_save(se->idstr, se->vmsd->name);
+    qemu_put_be32(f, se->version_id);
+    ret = vmstate_save_state_with_err(f, se->vmsd, se->opaque, NULL, errp);
+    if (!ret) {
+        ret = qemu_fflush(f);
+        if (ret) {
+            error_setg_errno(errp, -ret, "%s: failed to save device state",
+                             d->idstr);
+        }
+    }
+
+    /* The buffer is freed when closing the file, queue it before that */
+    if (!ret && !multifd_device_state_save_thread_should_exit() &&
+        !multifd_queue_device_state(d->idstr, d->instance_id,
+                                    (char *)bioc->data, bioc->usage)) {
+        error_setg(errp, "%s: failed to queue device state", d->idstr);
+        ret = -EINVAL;
+    }
+
+    qemu_fclose(f);
+    return !ret;
+}
+
 int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy)
 {
@@ -1654,6 +1713,11 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     SaveStateEntry *se;
     Error *local_err = NULL;
     int ret;
+    bool parallel = !in_postcopy && migrate_parallel_device_state() &&
+                    multifd_device_state_supported();
+    /* Parallel sections sent, and those the destination waits for */
+    uint32_t parallel_sent = 0, parallel_waited = 0;
+    MigrationPriority parallel_priority = MIG_PRI_MAX;
 
     /* Making sure cpu states are synchronized before saving non-iterable */
     cpu_synchronize_all_states();
@@ -1664,6 +1728,31 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
             continue;
         }
 
+        if (parallel && qemu_savevm_se_parallel(se)) {
+            if (!vmstate_section_needed(se->vmsd, se->opaque)) {
+                trace_savevm_section_skip(se->idstr, se->section_id);
+                continue;
+            }
+            if (parallel_sent == parallel_waited) {
+                parallel_priority = save_state_priority(se);
+            }
+            multifd_spawn_device_state_save_thread(
+                qemu_savevm_parallel_save_thread, se->idstr, se->instance_id,
+                se);
+            parallel_sent++;
+            continue;
+        }
+
+        /*
+         * The handlers are sorted by decreasing priority: make sure the
+         * parallel sections of a higher priority are loaded first.
+         */
+        if (parallel_sent != parallel_waited &&
+            save_state_priority(se) < parallel_priority) {
+            qemu_savevm_send_device_state_barrier(f, parallel_sent);
+            parallel_waited = parallel_sent;
+        }
+
         start_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
         ret = vmstate_save(f, se, vmdesc, &local_err);
@@ -1671,6 +1760,10 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
             migrate_set_error(ms, local_err);
             error_report_err(local_err);
             qemu_file_set_error(f, ret);
+            if (parallel_sent) {
+                multifd_abort_device_state_save_threads();
+                multifd_join_device_state_save_threads();
+            }
             return ret;
         }
 
@@ -1679,6 +1772,16 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                     end_ts_each - start_ts_each);
     }
 
+    if (parallel_sent) {
+        if (!multifd_join_device_state_save_threads()) {
+            qemu_file_set_error(f, -EINVAL);
+            return -EINVAL;
+        }
+        if (parallel_sent != parallel_waited) {
+            qemu_savevm_send_device_state_barrier(f, parallel_sent);
+        }
+    }
+
     if (!in_postcopy) {
         /* Postcopy stream will still be going */
         qemu_put_byte(f, QEMU_VM_EOF);
@@ -2307,7 +2410,8 @@ static gboolean postcopy_sync_page_req(gpointer key, gpointer value,
         return FALSE;
     }
 
-    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset);
+    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset,
+                                            qemu_ram_pagesize(rb));
     if (ret) {
         /* Please refer to above comment. */
         error_report("%s: send rp message failed for addr %p",
@@ -2513,6 +2617,33 @@ static int loadvm_process_enable_colo(MigrationIncomingState *mis)
     return ret;
 }
 
+static int loadvm_handle_device_state_barrier(MigrationIncomingState *mis,
+                                              QEMUFile *f)
+{
+    MigrationState *s = migrate_get_current();
+    uint32_t count = qemu_get_be32(f);
+    int ret = 0;
+
+    trace_loadvm_handle_device_state_barrier(count);
+
+    /* The multifd receive threads don't need the BQL to load the sections */
+    bql_unlock();
+    qemu_mutex_lock(&mis->parallel_sections_mutex);
+    while (mis->parallel_sections_loaded < count) {
+        /* A failing receive thread doesn't signal, poll for errors */
+        if (migrate_has_error(s)) {
+            ret = -EINVAL;
+            break;
+        }
+        qemu_cond_timedwait(&mis->parallel_sections_cond,
+                            &mis->parallel_sections_mutex, 100);
+    }
+    qemu_mutex_unlock(&mis->parallel_sections_mutex);
+    bql_lock();
+
+    return ret;
+}
+
 static int loadvm_postcopy_handle_switchover_start(void)
 {
     SaveStateEntry *se;
@@ -2634,6 +2765,9 @@ static int loadvm_process_command(QEMUFile *f)
 
     case MIG_CMD_SWITCHOVER_START:
         return loadvm_postcopy_handle_switchover_start();
+
+    case MIG_CMD_DEVICE_STATE_BARRIER:
+        return loadvm_handle_device_state_barrier(mis, f);
     }
 
     return 0;
@@ -3116,6 +3250,7 @@ int qemu_loadvm_state(QEMUFile *f)
     }
 
     qemu_loadvm_thread_pool_create(mis);
+    mis->parallel_sections_loaded = 0;
 
     ret = qemu_loadvm_state_header(f);
     if (ret) {
@@ -3235,6 +3370,53 @@ int qemu_loadvm_approve_switchover(void)
     return migrate_send_rp_switchover_ack(mis);
 }
 
+/*
+ * Load a section saved by qemu_savevm_parallel_save_thread(), from a
+ * multifd receive thread.
+ */
+static bool qemu_loadvm_load_parallel_state(SaveStateEntry *se,
+                                            char *buf, size_t len,
+                                            Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(len);
+    QEMUFile *f;
+    uint32_t version_id;
+    int ret;
+
+    memcpy(bioc->data, buf, len);
+    bioc->usage = len;
+    f = qemu_file_new_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    version_id = qemu_get_be32(f);
+    if (version_id > se->version_id) {
+        error_setg(errp, "%s: unsupported version %u, max %u",
+                   se->idstr, version_id, se->version_id);
+        qemu_fclose(f);
+        return false;
+    }
+
+    trace_vmstate_load(se->idstr, se->vmsd->name);
+    ret = vmstate_load_state(f, se->vmsd, se->opaque, version_id);
+    if (!ret) {
+        ret = qemu_file_get_error(f);
+    }
+    qemu_fclose(f);
+    if (ret) {
+        error_setg_errno(errp, -ret, "%s: failed to load device state",
+                         se->idstr);
+        return false;
+    }
+
+    qemu_mutex_lock(&mis->parallel_sections_mutex);
+    mis->parallel_sections_loaded++;
+    qemu_cond_broadcast(&mis->parallel_sections_cond);
+    qemu_mutex_unlock(&mis->parallel_sections_mutex);
+
+    return true;
+}
+
 bool qemu_loadvm_load_state_buffer(const char *idstr, uint32_t instance_id,
                                    char *buf, size_t len, Error **errp)
 {
@@ -3248,6 +3430,10 @@ bool qemu_loadvm_load_state_buffer(const char *idstr, uint32_t instance_id,
         return false;
     }
 
+    if (qemu_savevm_se_parallel(se)) {
+        return qemu_loadvm_load_parallel_state(se, buf, len, errp);
+    }
+
     if (!se->ops || !se->ops->load_state_buffer) {
         error_setg(errp,
                    "idstr %s / instance %u has no load state buffer operation",
@@ -137,18 +137,85 @@ xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+/*
+ * Same as the generic decoder, but runs of up to 64 modified bytes, which
+ * are the common case for small writes, are copied with a single masked
+ * load/store instead of a call to memcpy().
+ */
+static int __attribute__((target("avx512bw")))
+xbzrle_decode_buffer_avx512(uint8_t *src, int slen, uint8_t *dst, int dlen)
+{
+    int i = 0, d = 0;
+    int ret;
+    uint32_t count = 0;
+
+    while (i < slen) {
+
+        /* zrun */
+        if ((slen - i) < 2) {
+            return -1;
+        }
+
+        ret = uleb128_decode_small(src + i, &count);
+        if (ret < 0 || (i && !count)) {
+            return -1;
+        }
+        i += ret;
+        d += count;
+
+        /* overflow */
+        if (d > dlen) {
+            return -1;
+        }
+
+        /* nzrun */
+        if ((slen - i) < 2) {
+            return -1;
+        }
+
+        ret = uleb128_decode_small(src + i, &count);
+        if (ret < 0 || !count) {
+            return -1;
+        }
+        i += ret;
+
+        /* overflow */
+        if (d + count > dlen || i + count > slen) {
+            return -1;
+        }
+
+        if (count <= 64) {
+            __mmask64 mask = count == 64 ? ~0ULL : (1ULL << count) - 1;
+            __m512i data = _mm512_maskz_loadu_epi8(mask, src + i);
+
+            _mm512_mask_storeu_epi8(dst + d, mask, data);
+        } else {
+            memcpy(dst + d, src + i, count);
+        }
+        d += count;
+        i += count;
+    }
+
+    return d;
+}
+
 static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
                                     int slen, uint8_t *dst, int dlen);
+static int xbzrle_decode_buffer_int(uint8_t *src, int slen, uint8_t *dst,
+                                    int dlen);
 
 static int (*accel_func)(uint8_t *, uint8_t *, int, uint8_t *, int);
+static int (*decode_accel_func)(uint8_t *, int, uint8_t *, int);
 
 static void __attribute__((constructor)) init_accel(void)
 {
     unsigned info = cpuinfo_init();
     if (info & CPUINFO_AVX512BW) {
         accel_func = xbzrle_encode_buffer_avx512;
+        decode_accel_func = xbzrle_decode_buffer_avx512;
     } else {
         accel_func = xbzrle_encode_buffer_int;
+        decode_accel_func = xbzrle_decode_buffer_int;
     }
 }
 
@@ -158,7 +225,13 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return accel_func(old_buf, new_buf, slen, dst, dlen);
 }
 
+int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
+{
+    return decode_accel_func(src, slen, dst, dlen);
+}
+
 #define xbzrle_encode_buffer xbzrle_encode_buffer_int
+#define xbzrle_decode_buffer xbzrle_decode_buffer_int
 #endif
 
 /*
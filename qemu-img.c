@@ -54,6 +54,7 @@
 #include "trace/control.h"
 #include "qemu/throttle.h"
 #include "block/throttle-groups.h"
+#include "block/thread-pool.h"
 
 #define QEMU_IMG_VERSION "qemu-img version " QEMU_FULL_VERSION \
                           "\n" QEMU_COPYRIGHT "\n"
@@ -86,6 +87,7 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_THREADS = 278,
 };
 
 typedef enum OutputFormat {
@@ -1327,6 +1329,239 @@ static int check_empty_sectors(BlockBackend *blk, int64_t offset,
     return 0;
 }
 
+#define MAX_COMPARE_COROUTINES 64
+
+typedef struct ImgCompareState {
+    BlockBackend *blk1;
+    BlockBackend *blk2;
+    const char *filename1;
+    const char *filename2;
+    int64_t total_size1;
+    int64_t total_size2;
+    int64_t total_size;
+    int64_t progress_base;
+    bool strict;
+    /* next offset to hand out to a coroutine */
+    int64_t offset;
+    int running_coroutines;
+    /* the difference or error with the lowest offset found so far */
+    char *fail_msg;
+    int64_t fail_offset;
+    int fail_ret;
+    bool fail_is_error;
+    CoMutex lock;
+} ImgCompareState;
+
+/*
+ * Coroutines compare different parts of the images concurrently, so they
+ * can find differences out of order.  Only the one at the lowest offset is
+ * reported, like a sequential comparison would.
+ */
+static void G_GNUC_PRINTF(5, 6)
+compare_set_result(ImgCompareState *s, int64_t offset, int ret,
+                   bool is_error, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (s->fail_msg && s->fail_offset <= offset) {
+        return;
+    }
+
+    g_free(s->fail_msg);
+    va_start(ap, fmt);
+    s->fail_msg = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    s->fail_offset = offset;
+    s->fail_ret = ret;
+    s->fail_is_error = is_error;
+}
+
+/*
+ * Returns true if both images map the extent to the same offset of the
+ * same file, e.g. when comparing an overlay to its backing file, so that
+ * the data does not need to be read.
+ */
+static bool compare_same_data(int status1, int64_t map1,
+                              BlockDriverState *file1,
+                              int status2, int64_t map2,
+                              BlockDriverState *file2)
+{
+    if (!(status1 & BDRV_BLOCK_OFFSET_VALID) ||
+        !(status2 & BDRV_BLOCK_OFFSET_VALID) ||
+        !file1 || !file2 || map1 != map2) {
+        return false;
+    }
+
+    return file1 == file2 ||
+           (file1->drv == file2->drv && file1->drv->protocol_name &&
+            file1->filename[0] && !strcmp(file1->filename, file2->filename));
+}
+
+enum ImgCompareAction {
+    COMPARE_SKIP,
+    COMPARE_DATA,
+    COMPARE_EMPTY1,
+    COMPARE_EMPTY2,
+};
+
+/*
+ * Looks up the allocation status of both images at s->offset and decides
+ * how to compare the extent that starts there.  Returns the length of the
+ * extent, or 0 if the comparison must stop.
+ *
+ * Called with s->lock held.
+ */
+static int64_t coroutine_mixed_fn GRAPH_RDLOCK
+compare_next_extent(ImgCompareState *s, enum ImgCompareAction *action)
+{
+    BlockDriverState *file1, *file2;
+    int64_t pnum1, pnum2, map1, map2;
+    int64_t offset = s->offset;
+    int64_t chunk;
+    int status1, status2;
+    int allocated1, allocated2;
+
+    status1 = bdrv_block_status_above(blk_bs(s->blk1), NULL, offset,
+                                      s->total_size1 - offset, &pnum1, &map1,
+                                      &file1);
+    if (status1 < 0) {
+        compare_set_result(s, offset, 3, true,
+                           "Sector allocation test failed for %s",
+                           s->filename1);
+        return 0;
+    }
+    allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
+
+    status2 = bdrv_block_status_above(blk_bs(s->blk2), NULL, offset,
+                                      s->total_size2 - offset, &pnum2, &map2,
+                                      &file2);
+    if (status2 < 0) {
+        compare_set_result(s, offset, 3, true,
+                           "Sector allocation test failed for %s",
+                           s->filename2);
+        return 0;
+    }
+    allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
+
+    assert(pnum1 && pnum2);
+    chunk = MIN(pnum1, pnum2);
+
+    if (s->strict) {
+        if (status1 != status2) {
+            compare_set_result(s, offset, 1, false, "Strict mode: Offset %"
+                               PRId64 " block status mismatch!\n", offset);
+            return 0;
+        }
+    }
+    if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
+        *action = COMPARE_SKIP;
+    } else if (allocated1 == allocated2) {
+        if (allocated1 &&
+            !compare_same_data(status1, map1, file1, status2, map2, file2)) {
+            *action = COMPARE_DATA;
+            chunk = MIN(chunk, IO_BUF_SIZE);
+        } else {
+            *action = COMPARE_SKIP;
+        }
+    } else {
+        *action = allocated1 ? COMPARE_EMPTY1 : COMPARE_EMPTY2;
+        chunk = MIN(chunk, IO_BUF_SIZE);
+    }
+
+    return chunk;
+}
+
+static void coroutine_fn compare_co_do_compare(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    uint8_t *buf1 = blk_blockalign(s->blk1, IO_BUF_SIZE);
+    uint8_t *buf2 = blk_blockalign(s->blk2, IO_BUF_SIZE);
+
+    s->running_coroutines++;
+
+    while (1) {
+        enum ImgCompareAction action;
+        BlockBackend *blk;
+        const char *filename;
+        int64_t offset, chunk, pnum, idx;
+        int ret;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->fail_msg || s->offset >= s->total_size) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        WITH_GRAPH_RDLOCK_GUARD() {
+            chunk = compare_next_extent(s, &action);
+        }
+        if (!chunk) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        /* let the other coroutines continue beyond this extent */
+        offset = s->offset;
+        s->offset += chunk;
+        qemu_co_mutex_unlock(&s->lock);
+
+        switch (action) {
+        case COMPARE_SKIP:
+            break;
+
+        case COMPARE_DATA:
+            ret = blk_co_pread(s->blk1, offset, chunk, buf1, 0);
+            if (ret < 0) {
+                compare_set_result(s, offset, 4, true,
+                                   "Error while reading offset %" PRId64
+                                   " of %s: %s",
+                                   offset, s->filename1, strerror(-ret));
+                break;
+            }
+            ret = blk_co_pread(s->blk2, offset, chunk, buf2, 0);
+            if (ret < 0) {
+                compare_set_result(s, offset, 4, true,
+                                   "Error while reading offset %" PRId64
+                                   " of %s: %s",
+                                   offset, s->filename2, strerror(-ret));
+                break;
+            }
+            ret = compare_buffers(buf1, buf2, chunk, 0, &pnum);
+            if (ret || pnum != chunk) {
+                offset += ret ? 0 : pnum;
+                compare_set_result(s, offset, 1, false,
+                                   "Content mismatch at offset %" PRId64 "!\n",
+                                   offset);
+            }
+            break;
+
+        case COMPARE_EMPTY1:
+        case COMPARE_EMPTY2:
+            blk = action == COMPARE_EMPTY1 ? s->blk1 : s->blk2;
+            filename = action == COMPARE_EMPTY1 ? s->filename1 : s->filename2;
+            ret = blk_co_pread(blk, offset, chunk, buf1, 0);
+            if (ret < 0) {
+                compare_set_result(s, offset, 4, true,
+                                   "Error while reading offset %" PRId64
+                                   " of %s: %s",
+                                   offset, filename, strerror(-ret));
+                break;
+            }
+            idx = find_nonzero(buf1, chunk);
+            if (idx >= 0) {
+                compare_set_result(s, offset + idx, 1, false,
+                                   "Content mismatch at offset %" PRId64 "!\n",
+                                   offset + idx);
+            }
+            break;
+        }
+
+        qemu_progress_print(((float) chunk / s->progress_base) * 100, 100);
+    }
+
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    s->running_coroutines--;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -1338,11 +1573,8 @@ static int img_compare(const img_cmd_t *ccmd, int argc, char **argv)
 {
     const char *fmt1 = NULL, *fmt2 = NULL, *cache, *filename1, *filename2;
     BlockBackend *blk1, *blk2;
-    BlockDriverState *bs1, *bs2;
     int64_t total_size1, total_size2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int64_t pnum1, pnum2;
-    int allocated1, allocated2;
+    uint8_t *buf1 = NULL;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
@@ -1350,10 +1582,12 @@ static int img_compare(const img_cmd_t *ccmd, int argc, char **argv)
     int64_t total_size;
     int64_t offset = 0;
     int64_t chunk;
-    int c;
+    int c, i;
     uint64_t progress_base;
     bool image_opts = false;
     bool force_share = false;
+    int64_t num_coroutines = 8;
+    ImgCompareState s;
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
@@ -1365,12 +1599,13 @@ static int img_compare(const img_cmd_t *ccmd, int argc, char **argv)
             {"strict", no_argument, 0, 's'},
             {"cache", required_argument, 0, 'T'},
             {"force-share", no_argument, 0, 'U'},
+            {"parallel", required_argument, 0, 'm'},
             {"progress", no_argument, 0, 'p'},
             {"quiet", no_argument, 0, 'q'},
             {"object", required_argument, 0, OPTION_OBJECT},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "hf:F:sT:Upq",
+        c = getopt_long(argc, argv, "hf:F:sT:Um:pq",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1379,7 +1614,7 @@ static int img_compare(const img_cmd_t *ccmd, int argc, char **argv)
         case 'h':
             cmd_help(ccmd,
 "[[-f FMT] [-F FMT] | --image-opts] [-s] [-T CACHE]\n"
-"        [-U] [-p] [-q] [--object OBJDEF] FILE1 FILE2\n"
+"        [-U] [-m NUM_PARALLEL] [-p] [-q] [--object OBJDEF] FILE1 FILE2\n"
 ,
 "  -f, --a-format FMT\n"
 "     specify FILE1 image format explicitly (default: probing is used)\n"
@@ -1394,6 +1629,8 @@ static int img_compare(const img_cmd_t *ccmd, int argc, char **argv)
 "     images caching mode (default: " BDRV_DEFAULT_CACHE ")\n"
 "  -U, --force-share\n"
 "     open images in shared mode for concurrent access\n"
+"  -m, --parallel NUM_PARALLEL\n"
+"     specify number of requests in flight (default: 8)\n"
 "  -p, --progress\n"
 "     display progress information\n"
 "  -q, --quiet\n"
@@ -1423,6 +1660,13 @@ static int img_compare(const img_cmd_t *ccmd, int argc, char **argv)
         case 'U':
             force_share = true;
             break;
+        case 'm':
+            num_coroutines = cvtnum_full("number of coroutines", optarg,
+                                         false, 1, MAX_COMPARE_COROUTINES);
+            if (num_coroutines < 0) {
+                return 2;
+            }
+            break;
         case 'p':
             progress = true;
             break;
@@ -1473,11 +1717,8 @@ static int img_compare(const img_cmd_t *ccmd, int argc, char **argv)
         ret = 2;
         goto out2;
     }
-    bs1 = blk_bs(blk1);
-    bs2 = blk_bs(blk2);
 
     buf1 = blk_blockalign(blk1, IO_BUF_SIZE);
-    buf2 = blk_blockalign(blk2, IO_BUF_SIZE);
     total_size1 = blk_getlength(blk1);
     if (total_size1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1503,87 +1744,36 @@ static int img_compare(const img_cmd_t *ccmd, int argc, char **argv)
         goto out;
     }
 
-    while (offset < total_size) {
-        int status1, status2;
-
-        status1 = bdrv_block_status_above(bs1, NULL, offset,
-                                          total_size1 - offset, &pnum1, NULL,
-                                          NULL);
-        if (status1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
-            goto out;
-        }
-        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
-
-        status2 = bdrv_block_status_above(bs2, NULL, offset,
-                                          total_size2 - offset, &pnum2, NULL,
-                                          NULL);
-        if (status2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
-        }
-        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
-
-        assert(pnum1 && pnum2);
-        chunk = MIN(pnum1, pnum2);
-
-        if (strict) {
-            if (status1 != status2) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " block status mismatch!\n", offset);
-                goto out;
-            }
-        }
-        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
-            /* nothing to do */
-        } else if (allocated1 == allocated2) {
-            if (allocated1) {
-                int64_t pnum;
+    s = (ImgCompareState) {
+        .blk1 = blk1,
+        .blk2 = blk2,
+        .filename1 = filename1,
+        .filename2 = filename2,
+        .total_size1 = total_size1,
+        .total_size2 = total_size2,
+        .total_size = total_size,
+        .progress_base = progress_base,
+        .strict = strict,
+    };
+    qemu_co_mutex_init(&s.lock);
+    for (i = 0; i < num_coroutines; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(compare_co_do_compare, &s));
+    }
+    while (s.running_coroutines) {
+        main_loop_wait(false);
+    }
 
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = blk_pread(blk1, offset, chunk, buf1, 0);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename1, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = blk_pread(blk2, offset, chunk, buf2, 0);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_buffers(buf1, buf2, chunk, 0, &pnum);
-                if (ret || pnum != chunk) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            offset + (ret ? 0 : pnum));
-                    ret = 1;
-                    goto out;
-                }
-            }
+    if (s.fail_msg) {
+        if (s.fail_is_error) {
+            error_report("%s", s.fail_msg);
         } else {
-            chunk = MIN(chunk, IO_BUF_SIZE);
-            if (allocated1) {
-                ret = check_empty_sectors(blk1, offset, chunk,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(blk2, offset, chunk,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
-                goto out;
-            }
+            qprintf(quiet, "%s", s.fail_msg);
         }
-        offset += chunk;
-        qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+        ret = s.fail_ret;
+        g_free(s.fail_msg);
+        goto out;
     }
+    offset = total_size;
 
     if (total_size1 != total_size2) {
         BlockBackend *blk_over;
@@ -1627,7 +1817,6 @@ static int img_compare(const img_cmd_t *ccmd, int argc, char **argv)
 
 out:
     qemu_vfree(buf1);
-    qemu_vfree(buf2);
     blk_unref(blk2);
 out2:
     blk_unref(blk1);
@@ -1659,7 +1848,8 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
+#define MAX_COROUTINES 64
+#define MAX_CONVERT_THREADS 256
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
 typedef struct ImgConvertState {
@@ -1696,6 +1886,20 @@ typedef struct ImgConvertState {
     int ret;
 } ImgConvertState;
 
+/* A run of sectors that are either all written or all left sparse */
+typedef struct ConvertRun {
+    int n;
+    bool allocated;
+} ConvertRun;
+
+typedef struct ConvertDetectZeroes {
+    ImgConvertState *s;
+    int64_t sector_num;
+    int nb_sectors;
+    const uint8_t *buf;
+    ConvertRun *runs;
+} ConvertDetectZeroes;
+
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
                                 int *src_cur, int64_t *src_cur_offset)
 {
@@ -1869,14 +2073,74 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
 }
 
 
+/*
+ * Split the data read into @buf into runs of sectors that must be written
+ * and runs that can be left sparse.  Runs in a worker thread, so it may
+ * only look at the fields of ImgConvertState that are fixed during the
+ * copy.
+ */
+static int convert_detect_zeroes(void *opaque)
+{
+    ConvertDetectZeroes *d = opaque;
+    ImgConvertState *s = d->s;
+    const uint8_t *buf = d->buf;
+    int64_t sector_num = d->sector_num;
+    int nb_sectors = d->nb_sectors;
+    ConvertRun *run = d->runs;
+
+    /* Compressed clusters need to be written as a whole, so in that case we
+     * can only save the write if the buffer is completely zeroed. */
+    if (s->compressed) {
+        *run = (ConvertRun) {
+            .n = nb_sectors,
+            .allocated = !buffer_is_zero(buf, nb_sectors * BDRV_SECTOR_SIZE),
+        };
+        return 0;
+    }
+
+    while (nb_sectors > 0) {
+        run->allocated = is_allocated_sectors_min(buf, nb_sectors, &run->n,
+                                                  s->min_sparse, sector_num,
+                                                  s->alignment);
+        buf += run->n * BDRV_SECTOR_SIZE;
+        sector_num += run->n;
+        nb_sectors -= run->n;
+        run++;
+    }
+
+    return 0;
+}
+
+/*
+ * With fast storage, scanning for zeroes keeps the main thread busy, so it
+ * is done in the thread pool where the requests of all coroutines can be
+ * scanned in parallel.  @runs must have room for @nb_sectors entries.
+ */
+static void coroutine_fn
+convert_co_detect_zeroes(ImgConvertState *s, int64_t sector_num,
+                         int nb_sectors, const uint8_t *buf, ConvertRun *runs)
+{
+    ConvertDetectZeroes d = {
+        .s = s,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .buf = buf,
+        .runs = runs,
+    };
+
+    thread_pool_submit_co(convert_detect_zeroes, &d);
+}
+
 static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                                          int nb_sectors, uint8_t *buf,
-                                         enum ImgConvertBlockStatus status)
+                                         enum ImgConvertBlockStatus status,
+                                         const ConvertRun *runs)
 {
     int ret;
 
     while (nb_sectors > 0) {
         int n = nb_sectors;
+        bool allocated = true;
         BdrvRequestFlags flags = s->compressed ? BDRV_REQ_WRITE_COMPRESSED : 0;
 
         switch (status) {
@@ -1890,17 +2154,14 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
         case BLK_DATA:
             /* If we're told to keep the target fully allocated (-S 0) or there
              * is real non-zero data, we must write it. Otherwise we can treat
-             * it as zero sectors.
-             * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
-            if (!s->min_sparse ||
-                (!s->compressed &&
-                 is_allocated_sectors_min(buf, n, &n, s->min_sparse,
-                                          sector_num, s->alignment)) ||
-                (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
-            {
+             * it as zero sectors. The runs of each kind were found by
+             * convert_co_detect_zeroes(). */
+            if (s->min_sparse) {
+                n = runs->n;
+                allocated = runs->allocated;
+                runs++;
+            }
+            if (allocated) {
                 ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
                 if (ret < 0) {
@@ -1968,6 +2229,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
+    ConvertRun *runs = NULL;
     int ret, i;
     int index = -1;
 
@@ -1981,6 +2243,9 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 
     s->running_coroutines++;
     buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+    if (s->min_sparse) {
+        runs = g_new(ConvertRun, s->buf_sectors);
+    }
 
     while (1) {
         int n;
@@ -2026,6 +2291,8 @@ retry:
                 error_report("error while reading at byte %lld: %s",
                              sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
                 s->ret = ret;
+            } else if (s->min_sparse) {
+                convert_co_detect_zeroes(s, sector_num, n, buf, runs);
             }
         } else if (!s->min_sparse && status == BLK_ZERO) {
             status = BLK_DATA;
@@ -2051,7 +2318,7 @@ retry:
                     goto retry;
                 }
             } else {
-                ret = convert_co_write(s, sector_num, n, buf, status);
+                ret = convert_co_write(s, sector_num, n, buf, status, runs);
             }
             if (ret < 0) {
                 error_report("error while writing at byte %lld: %s",
@@ -2079,6 +2346,7 @@ retry:
     }
 
     qemu_vfree(buf);
+    g_free(runs);
     s->co[index] = NULL;
     s->running_coroutines--;
     if (!s->running_coroutines && s->ret == -EINPROGRESS) {
@@ -2249,6 +2517,7 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
     bool bitmaps = false;
     bool skip_broken = false;
     int64_t rate_limit = 0;
+    int64_t threads = 0;
 
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
@@ -2287,6 +2556,7 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {"rate-limit", required_argument, 0, 'r'},
             {"parallel", required_argument, 0, 'm'},
+            {"threads", required_argument, 0, OPTION_THREADS},
             {"oob-writes", no_argument, 0, 'W'},
             {"copy-range-offloading", no_argument, 0, 'C'},
             {"progress", no_argument, 0, 'p'},
@@ -2306,7 +2576,8 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
 "        [-O TGT_FMT | --target-image-opts] [-o TGT_FMT_OPTS] [-t TGT_CACHE]\n"
 "        [-b BACKING_FILE [-F BACKING_FMT]] [-S SPARSE_SIZE]\n"
 "        [-n] [--target-is-zero] [-c]\n"
-"        [-U] [-r RATE] [-m NUM_PARALLEL] [-W] [-C] [-p] [-q] [--object OBJDEF]\n"
+"        [-U] [-r RATE] [-m NUM_PARALLEL] [--threads NUM_THREADS] [-W] [-C]\n"
+"        [-p] [-q] [--object OBJDEF]\n"
 "        SRC_FILE [SRC_FILE2...] TGT_FILE\n"
 ,
 "  -f, --source-format SRC_FMT\n"
@@ -2351,7 +2622,10 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
 "  -r, --rate-limit RATE\n"
 "     I/O rate limit, in bytes per second\n"
 "  -m, --parallel NUM_PARALLEL\n"
-"     specify parallelism (default: 8)\n"
+"     specify number of requests in flight (default: 8, at most 64)\n"
+"  --threads NUM_THREADS\n"
+"     specify number of worker threads for zero detection and compression\n"
+"     (default: up to 64)\n"
 "  -C, --copy-range-offloading\n"
 "     try to use copy offloading\n"
 "  -W, --oob-writes\n"
@@ -2472,6 +2746,13 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
                 goto fail_getopt;
             }
             break;
+        case OPTION_THREADS:
+            threads = cvtnum_full("number of threads", optarg,
+                                  false, 1, MAX_CONVERT_THREADS);
+            if (threads < 0) {
+                goto fail_getopt;
+            }
+            break;
         case 'W':
             s.wr_in_order = false;
             break;
@@ -2773,7 +3054,15 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
         flags |= BDRV_O_RESIZE;
     }
 
-    if (skip_create) {
+    /* qcow2 compresses in the thread pool, let it use all the workers */
+    if (threads && !tgt_image_opts && !strcmp(out_fmt, "qcow2")) {
+        if (!open_opts) {
+            open_opts = qdict_new();
+        }
+        qdict_put_int(open_opts, "threads", threads);
+    }
+
+    if (tgt_image_opts) {
         s.target = img_open(tgt_image_opts, out_filename, out_fmt,
                             flags, writethrough, s.quiet, false);
     } else {
@@ -2785,6 +3074,9 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
         s.target = img_open_file(out_filename, open_opts, out_fmt,
                                  flags, writethrough, s.quiet, false);
         open_opts = NULL; /* blk_new_open will have freed it */
+        if (s.target && skip_create) {
+            blk_set_force_allow_inactivate(s.target);
+        }
     }
     if (!s.target) {
         ret = -1;
@@ -2863,6 +3155,12 @@ static int img_convert(const img_cmd_t *ccmd, int argc, char **argv)
         set_rate_limit(s.target, rate_limit);
     }
 
+    if (threads) {
+        /* Start all workers now */
+        aio_context_set_thread_pool_params(qemu_get_aio_context(), threads,
+                                           threads, &error_abort);
+    }
+
     ret = convert_do_copy(&s);
 
     /* Now copy the bitmaps */
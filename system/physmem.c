@@ -2419,6 +2419,75 @@ void qemu_ram_remap(ram_addr_t addr)
         }
     }
 }
+
+/*
+ * qemu_ram_map_file_private - map guest RAM copy-on-write from a file
+ *
+ * @block: the RAMBlock to map.
+ * @fd: the file to map.
+ * @offset: offset in the file of the first page of @block.
+ *
+ * Replaces the used part of @block by a private mapping of @fd, so that
+ * the pages are read from the file the first time they are accessed and
+ * guest writes never reach the file.  Used to restore guest RAM from a
+ * mapped-ram migration file without reading all of it upfront.
+ *
+ * Only anonymous, private RAM with host-sized pages can be mapped, and
+ * only while no device may have pinned it and the memory backend has no
+ * NUMA policy.
+ *
+ * Returns 0 on success, -ENOTSUP if @block can't be mapped, in which case
+ * it is left untouched, or a negative errno if mmap() failed, in which
+ * case the contents of @block are undefined.
+ */
+static bool qemu_ram_has_host_mem_policy(RAMBlock *block)
+{
+    HostMemoryBackend *backend = (HostMemoryBackend *)
+        object_dynamic_cast(memory_region_owner(block->mr),
+                            TYPE_MEMORY_BACKEND);
+
+    return backend && (backend->policy != HOST_MEM_POLICY_DEFAULT ||
+                       !bitmap_empty(backend->host_nodes, MAX_NODES));
+}
+
+int qemu_ram_map_file_private(RAMBlock *block, int fd, uint64_t offset)
+{
+    int flags = MAP_PRIVATE | MAP_FIXED;
+    void *area;
+
+    if (block->fd >= 0 || block->guest_memfd >= 0 ||
+        qemu_ram_is_shared(block) || xen_enabled() ||
+        (block->flags & (RAM_PREALLOC | RAM_READONLY)) ||
+        block->page_size != qemu_real_host_page_size() ||
+        !QEMU_IS_ALIGNED(offset, qemu_real_host_page_size())) {
+        return -ENOTSUP;
+    }
+
+    /*
+     * The new mapping replaces the pages at block->host.  Devices that
+     * disable RAM discard (VFIO, iommufd, ...) may have pinned or
+     * DMA-mapped the old pages already and would keep using them after
+     * the guest starts.  The new mapping would also lose the NUMA policy
+     * that the memory backend applied with mbind().  Let the caller copy
+     * the pages into the existing mapping instead.
+     */
+    if (ram_block_discard_is_disabled() ||
+        qemu_ram_has_host_mem_policy(block)) {
+        return -ENOTSUP;
+    }
+
+    flags |= block->flags & RAM_NORESERVE ? MAP_NORESERVE : 0;
+    area = mmap(block->host, block->used_length, PROT_READ | PROT_WRITE,
+                flags, fd, offset);
+    if (area != block->host) {
+        return -errno;
+    }
+
+    block->pages_file_mapped = true;
+    memory_try_enable_merging(block->host, block->used_length);
+    qemu_ram_setup_dump(block->host, block->used_length);
+    return 0;
+}
 #endif /* !_WIN32 */
 
 /*
@@ -3892,7 +3961,14 @@ int ram_block_discard_range(RAMBlock *rb, uint64_t start, size_t length)
              * fallocate'd away).
              */
 #if defined(CONFIG_MADVISE)
-            if (qemu_ram_is_shared(rb) && rb->fd < 0) {
+            if (rb->pages_file_mapped) {
+                /*
+                 * DONTNEED would bring back the contents of the migration
+                 * file, replace the range by anonymous memory instead.
+                 */
+                ret = qemu_ram_remap_mmap(rb, start, length);
+                errno = -ret;
+            } else if (qemu_ram_is_shared(rb) && rb->fd < 0) {
                 ret = madvise(host_startaddr, length, QEMU_MADV_REMOVE);
             } else {
                 ret = madvise(host_startaddr, length, QEMU_MADV_DONTNEED);
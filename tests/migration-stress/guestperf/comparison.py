@@ -171,4 +171,57 @@ def __init__(self, name, scenarios):
         Scenario("compr-multifd-compression-uadk",
                  multifd=True, multifd_channels=2, multifd_compression="uadk"),
     ]),
+
+    # Looking at effect of the way the guest dirties its
+    # memory on multifd
+    Comparison("multifd-dirty-pattern", scenarios = [
+        Scenario("multifd-dirty-pattern-uniform",
+                 multifd=True, multifd_channels=4, dirty_pattern="uniform"),
+        Scenario("multifd-dirty-pattern-hotset",
+                 multifd=True, multifd_channels=4, dirty_pattern="hotset"),
+        Scenario("multifd-dirty-pattern-zero",
+                 multifd=True, multifd_channels=4, dirty_pattern="zero"),
+        Scenario("multifd-dirty-pattern-compressible",
+                 multifd=True, multifd_channels=4,
+                 dirty_pattern="compressible"),
+    ]),
+
+    # Looking at effect of the zero page detection method
+    # on a guest writing mostly zero pages
+    Comparison("multifd-zero-page", scenarios = [
+        Scenario("multifd-zero-page-none",
+                 multifd=True, multifd_channels=4, dirty_pattern="zero",
+                 zero_page_detection="none"),
+        Scenario("multifd-zero-page-legacy",
+                 multifd=True, multifd_channels=4, dirty_pattern="zero",
+                 zero_page_detection="legacy"),
+        Scenario("multifd-zero-page-multifd",
+                 multifd=True, multifd_channels=4, dirty_pattern="zero",
+                 zero_page_detection="multifd"),
+    ]),
+
+    # Looking at effect of multifd compression with varying
+    # numbers of channels on a guest writing compressible data
+    Comparison("multifd-compression-channels", scenarios = [
+        Scenario("multifd-compression-none-channels-2",
+                 multifd=True, multifd_channels=2,
+                 dirty_pattern="compressible"),
+        Scenario("multifd-compression-none-channels-8",
+                 multifd=True, multifd_channels=8,
+                 dirty_pattern="compressible"),
+        Scenario("multifd-compression-zstd-channels-2",
+                 multifd=True, multifd_channels=2, multifd_compression="zstd",
+                 dirty_pattern="compressible"),
+        Scenario("multifd-compression-zstd-channels-8",
+                 multifd=True, multifd_channels=8, multifd_compression="zstd",
+                 dirty_pattern="compressible"),
+        Scenario("multifd-compression-adaptive-channels-2",
+                 multifd=True, multifd_channels=2,
+                 multifd_compression="adaptive",
+                 dirty_pattern="compressible"),
+        Scenario("multifd-compression-adaptive-channels-8",
+                 multifd=True, multifd_channels=8,
+                 multifd_compression="adaptive",
+                 dirty_pattern="compressible"),
+    ]),
 ]
@@ -32,7 +32,7 @@
 from qemu.machine import QEMUMachine
 
 # multifd supported compression algorithms
-MULTIFD_CMP_ALGS = ("zlib", "zstd", "qpl", "uadk")
+MULTIFD_CMP_ALGS = ("zlib", "zstd", "qpl", "uadk", "adaptive")
 
 class Engine(object):
 
@@ -78,6 +78,30 @@ def _cpu_timing(self, pid):
             utime = int(fields[14])
             return TimingRecord(pid, now, 1000 * (stime + utime) / jiffies_per_sec)
 
+    def _migration_cpu_time(self, pid, tid_list):
+        # CPU time of the QEMU process, minus that of the vCPUs
+        total = self._cpu_timing(pid)._value
+        for record in self._vcpu_timing(pid, tid_list):
+            total -= record._value
+        return total
+
+    def _migrate_result(self, progress, success,
+                        src_pid, src_threads, src_cpu_start,
+                        dst_pid, dst_cpu_start):
+        throughput = 0
+        if progress._duration > 0:
+            throughput = (progress._ram._transferred_bytes / (1024 * 1024) /
+                          (progress._duration / 1000.0))
+
+        src_cpu = (self._migration_cpu_time(src_pid, src_threads) -
+                   src_cpu_start)
+        dst_cpu = None
+        if dst_pid is not None:
+            dst_cpu = self._migration_cpu_time(dst_pid, []) - dst_cpu_start
+
+        return ReportResult(success, throughput, progress._downtime,
+                            progress._duration, src_cpu, dst_cpu)
+
     def _migrate_progress(self, vm):
         info = vm.cmd("query-migrate")
 
@@ -120,6 +144,9 @@ def _migrate(self, hardware, scenario, src,
             src_threads.append(vcpu["thread-id"])
 
         # XXX how to get dst timings on remote host ?
+        dst_pid = None
+        if self._dst_host == "localhost":
+            dst_pid = dst.get_pid()
 
         if self._verbose:
             print("Sleeping %d seconds for initial guest workload run" % self._sleep)
@@ -220,6 +247,10 @@ def _migrate(self, hardware, scenario, src,
                 resp = dst.cmd("migrate-set-parameters",
                     multifd_compression=scenario._multifd_compression)
 
+        if scenario._zero_page_detection:
+            resp = src.cmd("migrate-set-parameters",
+                           zero_page_detection=scenario._zero_page_detection)
+
         if scenario._dirty_limit:
             if not hardware._dirty_ring_size:
                 raise Exception("dirty ring size must be configured when "
@@ -235,6 +266,11 @@ def _migrate(self, hardware, scenario, src,
             resp = src.cmd("migrate-set-parameters",
                            vcpu_dirty_limit=scenario._vcpu_dirty_limit)
 
+        src_cpu_start = self._migration_cpu_time(src_pid, src_threads)
+        dst_cpu_start = 0
+        if dst_pid is not None:
+            dst_cpu_start = self._migration_cpu_time(dst_pid, [])
+
         if defer_migrate:
             resp = dst.cmd("migrate-incoming", uri=connect_uri)
         resp = src.cmd("migrate", uri=connect_uri)
@@ -261,6 +297,13 @@ def _migrate(self, hardware, scenario, src,
                 progress_history.append(progress)
 
             if progress._status in ("completed", "failed", "cancelled"):
+                result = ReportResult()
+                if progress._status == "completed":
+                    result = self._migrate_result(progress, not paused,
+                                                  src_pid, src_threads,
+                                                  src_cpu_start,
+                                                  dst_pid, dst_cpu_start)
+
                 if progress._status == "completed" and paused:
                     dst.cmd("cont")
                 if progress_history[-1] != progress:
@@ -276,10 +319,6 @@ def _migrate(self, hardware, scenario, src,
                         src_vcpu_time.extend(self._vcpu_timing(src_pid, src_threads))
                         sleep_secs -= 1
 
-                result = ReportResult()
-                if progress._status == "completed" and not paused:
-                    result = ReportResult(True)
-
                 return [progress_history, src_qemu_time, src_vcpu_time, result]
 
             if self._verbose and (loop % 20) == 0:
@@ -339,7 +378,7 @@ def _get_qemu_serial_args(self):
             return ["-chardev", "stdio,id=cdev0",
                     "-device", "isa-serial,chardev=cdev0"]
 
-    def _get_common_args(self, hardware, tunnelled=False):
+    def _get_common_args(self, hardware, scenario, tunnelled=False):
         args = [
             "noapic",
             "edd=off",
@@ -357,6 +396,8 @@ def _get_common_args(self, hardware, tunnelled=False):
             args.append("quiet")
 
         args.append("ramsize=%s" % hardware._mem)
+        args.append("stresspattern=%s" % scenario._dirty_pattern)
+        args.append("stresshotset=%s" % scenario._dirty_hotset)
 
         cmdline = " ".join(args)
         if tunnelled:
@@ -391,14 +432,14 @@ def _get_common_args(self, hardware, tunnelled=False):
 
         return argv
 
-    def _get_src_args(self, hardware):
-        return self._get_common_args(hardware)
+    def _get_src_args(self, hardware, scenario):
+        return self._get_common_args(hardware, scenario)
 
-    def _get_dst_args(self, hardware, uri, defer_migrate):
+    def _get_dst_args(self, hardware, scenario, uri, defer_migrate):
         tunnelled = False
         if self._dst_host != "localhost":
             tunnelled = True
-        argv = self._get_common_args(hardware, tunnelled)
+        argv = self._get_common_args(hardware, scenario, tunnelled)
 
         if defer_migrate:
             return argv + ["-incoming", "defer"]
@@ -474,13 +515,14 @@ def run(self, hardware, scenario, result_dir=os.getcwd()):
         srcmonaddr = "/var/tmp/qemu-src-%d-monitor.sock" % os.getpid()
 
         src = QEMUMachine(self._binary,
-                          args=self._get_src_args(hardware),
+                          args=self._get_src_args(hardware, scenario),
                           wrapper=self._get_src_wrapper(hardware),
                           name="qemu-src-%d" % os.getpid(),
                           monitor_address=srcmonaddr)
 
         dst = QEMUMachine(self._binary,
-                          args=self._get_dst_args(hardware, uri, defer_migrate),
+                          args=self._get_dst_args(hardware, scenario, uri,
+                                                defer_migrate),
                           wrapper=self._get_dst_wrapper(hardware),
                           name="qemu-dst-%d" % os.getpid(),
                           monitor_address=dstmonaddr)
@@ -26,18 +26,38 @@
 
 class ReportResult(object):
 
-    def __init__(self, success=False):
+    def __init__(self, success=False,
+                 throughput_mbs=0, downtime_ms=0, total_time_ms=0,
+                 src_cpu_ms=0, dst_cpu_ms=None):
         self._success = success
 
+        # Summary of a completed migration, for comparing runs
+        self._throughput_mbs = throughput_mbs # MiB per second
+        self._downtime_ms = downtime_ms
+        self._total_time_ms = total_time_ms
+        # CPU time spent by QEMU outside of the vCPU threads
+        self._src_cpu_ms = src_cpu_ms
+        self._dst_cpu_ms = dst_cpu_ms # None if not measurable
+
     def serialize(self):
         return {
             "success": self._success,
+            "throughput_mbs": self._throughput_mbs,
+            "downtime_ms": self._downtime_ms,
+            "total_time_ms": self._total_time_ms,
+            "src_cpu_ms": self._src_cpu_ms,
+            "dst_cpu_ms": self._dst_cpu_ms,
         }
 
     @classmethod
     def deserialize(cls, data):
         return cls(
-            data["success"])
+            data["success"],
+            data.get("throughput_mbs", 0),
+            data.get("downtime_ms", 0),
+            data.get("total_time_ms", 0),
+            data.get("src_cpu_ms", 0),
+            data.get("dst_cpu_ms", None))
 
 
 class Report(object):
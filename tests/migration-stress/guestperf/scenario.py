@@ -32,7 +32,8 @@ def __init__(self, name,
                  compression_xbzrle=False, compression_xbzrle_cache=10,
                  multifd=False, multifd_channels=2, multifd_compression="",
                  dirty_limit=False, x_vcpu_dirty_limit_period=500,
-                 vcpu_dirty_limit=1):
+                 vcpu_dirty_limit=1, zero_page_detection="",
+                 dirty_pattern="uniform", dirty_hotset=10):
 
         self._name = name
 
@@ -67,6 +68,13 @@ def __init__(self, name,
         self._x_vcpu_dirty_limit_period = x_vcpu_dirty_limit_period
         self._vcpu_dirty_limit = vcpu_dirty_limit
 
+        # Empty for QEMU's default
+        self._zero_page_detection = zero_page_detection
+
+        # How the guest workload dirties its RAM
+        self._dirty_pattern = dirty_pattern # see stress.c
+        self._dirty_hotset = dirty_hotset # percentage of guest RAM
+
     def serialize(self):
         return {
             "name": self._name,
@@ -90,6 +98,9 @@ def serialize(self):
             "dirty_limit": self._dirty_limit,
             "x_vcpu_dirty_limit_period": self._x_vcpu_dirty_limit_period,
             "vcpu_dirty_limit": self._vcpu_dirty_limit,
+            "zero_page_detection": self._zero_page_detection,
+            "dirty_pattern": self._dirty_pattern,
+            "dirty_hotset": self._dirty_hotset,
         }
 
     @classmethod
@@ -112,4 +123,10 @@ def deserialize(cls, data):
             data["compression_xbzrle_cache"],
             data["multifd"],
             data["multifd_channels"],
-            data["multifd_compression"])
+            data["multifd_compression"],
+            data.get("dirty_limit", False),
+            data.get("x_vcpu_dirty_limit_period", 500),
+            data.get("vcpu_dirty_limit", 1),
+            data.get("zero_page_detection", ""),
+            data.get("dirty_pattern", "uniform"),
+            data.get("dirty_hotset", 10))
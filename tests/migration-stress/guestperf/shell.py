@@ -20,6 +20,7 @@
 
 import argparse
 import fnmatch
+import json
 import os
 import os.path
 import platform
@@ -145,6 +146,17 @@ def __init__(self):
                             dest="vcpu_dirty_limit",
                             default=1, type=int)
 
+        parser.add_argument("--zero-page-detection",
+                            dest="zero_page_detection", default="",
+                            choices=["", "none", "legacy", "multifd"])
+
+        parser.add_argument("--dirty-pattern", dest="dirty_pattern",
+                            default="uniform",
+                            choices=["uniform", "hotset", "zero",
+                                     "compressible"])
+        parser.add_argument("--dirty-hotset", dest="dirty_hotset",
+                            default=10, type=int)
+
     def get_scenario(self, args):
         return Scenario(name="perfreport",
                         downtime=args.downtime,
@@ -174,7 +186,12 @@ def get_scenario(self, args):
                         dirty_limit=args.dirty_limit,
                         x_vcpu_dirty_limit_period=\
                             args.x_vcpu_dirty_limit_period,
-                        vcpu_dirty_limit=args.vcpu_dirty_limit)
+                        vcpu_dirty_limit=args.vcpu_dirty_limit,
+
+                        zero_page_detection=args.zero_page_detection,
+
+                        dirty_pattern=args.dirty_pattern,
+                        dirty_hotset=args.dirty_hotset)
 
     def run(self, argv):
         args = self._parser.parse_args(argv)
@@ -221,6 +238,7 @@ def run(self, argv):
 
         engine = self.get_engine(args)
         hardware = self.get_hardware(args)
+        summary = []
 
         try:
             for comparison in COMPARISONS:
@@ -242,10 +260,19 @@ def run(self, argv):
                     report = engine.run(hardware, scenario)
                     with open(filename, "w") as fh:
                         print(report.to_json(), file=fh)
+
+                    result = report._result.serialize()
+                    result["name"] = name
+                    summary.append(result)
         except Exception as e:
             print("Error: %s" % str(e), file=sys.stderr)
             if args.debug:
                 raise
+        finally:
+            # One record per scenario run, for comparing builds
+            if summary:
+                with open(os.path.join(args.output, "summary.json"), "w") as fh:
+                    print(json.dumps(summary, indent=4), file=fh)
 
 
 class PlotShell(object):
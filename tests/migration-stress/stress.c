@@ -29,6 +29,33 @@ const char *argv0;
 
 #define RAM_PAGE_SIZE 4096
 
+/*
+ * How the workload dirties guest RAM:
+ *
+ *  - uniform: all of it, with random looking data
+ *  - hotset: only the first 'hotset' percent of it, with random
+ *    looking data
+ *  - zero: all of it, but 7 pages out of 8 are zeroed
+ *  - compressible: all of it, with pages that are mostly one byte
+ *    repeated
+ */
+typedef enum {
+    STRESS_PATTERN_UNIFORM,
+    STRESS_PATTERN_HOTSET,
+    STRESS_PATTERN_ZERO,
+    STRESS_PATTERN_COMPRESSIBLE,
+} StressPattern;
+
+static const char *const stress_pattern_names[] = {
+    [STRESS_PATTERN_UNIFORM] = "uniform",
+    [STRESS_PATTERN_HOTSET] = "hotset",
+    [STRESS_PATTERN_ZERO] = "zero",
+    [STRESS_PATTERN_COMPRESSIBLE] = "compressible",
+};
+
+static StressPattern pattern = STRESS_PATTERN_UNIFORM;
+static unsigned long long hotsetPercent = 10;
+
 #ifndef CONFIG_GETTID
 static int gettid(void)
 {
@@ -156,16 +183,61 @@ static unsigned long long now(void)
     return (tv.tv_sec * 1000ull) + (tv.tv_usec / 1000ull);
 }
 
+static int parse_pattern(const char *name, StressPattern *val)
+{
+    size_t i;
+
+    for (i = 0; i < G_N_ELEMENTS(stress_pattern_names); i++) {
+        if (g_str_equal(name, stress_pattern_names[i])) {
+            *val = i;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "%s (%05d): ERROR: unknown stress pattern %s\n",
+            argv0, gettid(), name);
+    return -1;
+}
+
+static void stresspage(char *page, const char *data, size_t pageidx,
+                       unsigned long long pass)
+{
+    size_t len = RAM_PAGE_SIZE;
+    size_t k;
+
+    switch (pattern) {
+    case STRESS_PATTERN_ZERO:
+        if (pageidx % 8) {
+            memset(page, 0, RAM_PAGE_SIZE);
+            return;
+        }
+        break;
+    case STRESS_PATTERN_COMPRESSIBLE:
+        /* One byte repeated, with a random looking header */
+        memset(page, pass & 0xff, RAM_PAGE_SIZE);
+        len = 256;
+        break;
+    default:
+        break;
+    }
+
+    for (k = 0; k < len; k += sizeof(long long)) {
+        *(unsigned long long *)(page + k) ^=
+            *(unsigned long long *)(data + k);
+    }
+}
+
 static void stressone(unsigned long long ramsizeMB)
 {
     size_t pagesPerMB = 1024 * 1024 / RAM_PAGE_SIZE;
     g_autofree char *ram = g_malloc(ramsizeMB * 1024 * 1024);
     char *ramptr;
-    size_t i, j, k;
+    size_t i, j;
     g_autofree char *data = g_malloc(RAM_PAGE_SIZE);
-    char *dataptr;
     size_t nMB = 0;
     unsigned long long before, after;
+    unsigned long long dirtyMB = ramsizeMB;
+    unsigned long long pass;
 
     /* We don't care about initial state, but we do want
      * to fault it all into RAM, otherwise the first iter
@@ -178,19 +250,19 @@ static void stressone(unsigned long long ramsizeMB)
         return;
     }
 
+    if (pattern == STRESS_PATTERN_HOTSET) {
+        dirtyMB = MAX(ramsizeMB * hotsetPercent / 100, 1);
+    }
+
     before = now();
 
-    while (1) {
+    for (pass = 0;; pass++) {
 
         ramptr = ram;
-        for (i = 0; i < ramsizeMB; i++, nMB++) {
+        for (i = 0; i < dirtyMB; i++, nMB++) {
             for (j = 0; j < pagesPerMB; j++) {
-                dataptr = data;
-                for (k = 0; k < RAM_PAGE_SIZE; k += sizeof(long long)) {
-                    ramptr += sizeof(long long);
-                    dataptr += sizeof(long long);
-                    *(unsigned long long *)ramptr ^= *(unsigned long long *)dataptr;
-                }
+                stresspage(ramptr, data, j, pass);
+                ramptr += RAM_PAGE_SIZE;
             }
 
             if (nMB == 1024) {
@@ -266,13 +338,16 @@ int main(int argc, char **argv)
     char *end;
     int ch;
     int opt_ind = 0;
-    const char *sopt = "hr:c:";
+    const char *sopt = "hr:c:p:s:";
     struct option lopt[] = {
         { "help", no_argument, NULL, 'h' },
         { "ramsize", required_argument, NULL, 'r' },
         { "cpus", required_argument, NULL, 'c' },
+        { "pattern", required_argument, NULL, 'p' },
+        { "hotset", required_argument, NULL, 's' },
         { NULL, 0, NULL, 0 }
     };
+    g_autofree char *patternName = NULL;
     int ret;
     int ncpus = 0;
 
@@ -300,9 +375,27 @@ int main(int argc, char **argv)
             }
             break;
 
+        case 'p':
+            if (parse_pattern(optarg, &pattern) < 0) {
+                exit_failure();
+            }
+            break;
+
+        case 's':
+            errno = 0;
+            hotsetPercent = strtoll(optarg, &end, 10);
+            if (errno != 0 || *end || hotsetPercent > 100) {
+                fprintf(stderr, "%s (%05d): ERROR: Cannot parse hot set size %s\n",
+                        argv0, gettid(), optarg);
+                exit_failure();
+            }
+            break;
+
         case '?':
         case 'h':
-            fprintf(stderr, "%s: [--help][--ramsize GB][--cpus N]\n", argv0);
+            fprintf(stderr, "%s: [--help][--ramsize GB][--cpus N]"
+                    "[--pattern uniform|hotset|zero|compressible]"
+                    "[--hotset PERCENT]\n", argv0);
             exit_failure();
         }
     }
@@ -314,13 +407,22 @@ int main(int argc, char **argv)
         ret = get_command_arg_ull("ramsize", &ramsizeGB);
         if (ret < 0)
             exit_failure();
+
+        ret = get_command_arg_str("stresspattern", &patternName);
+        if (ret < 0 ||
+            (ret > 0 && parse_pattern(patternName, &pattern) < 0))
+            exit_failure();
+
+        ret = get_command_arg_ull("stresshotset", &hotsetPercent);
+        if (ret < 0 || hotsetPercent > 100)
+            exit_failure();
     }
 
     if (ncpus == 0)
         ncpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-    fprintf(stdout, "%s (%05d): INFO: RAM %llu GiB across %d CPUs\n",
-            argv0, gettid(), ramsizeGB, ncpus);
+    fprintf(stdout, "%s (%05d): INFO: RAM %llu GiB across %d CPUs, %s pattern\n",
+            argv0, gettid(), ramsizeGB, ncpus, stress_pattern_names[pattern]);
 
     stress(ramsizeGB, ncpus);
 
@@ -56,6 +56,26 @@ static void test_multifd_postcopy_tcp_zstd(void)
 
     test_precopy_common(&args);
 }
+
+static void *
+migrate_hook_start_precopy_tcp_multifd_adaptive(QTestState *from,
+                                                QTestState *to)
+{
+    return migrate_hook_start_precopy_tcp_multifd_common(from, to,
+                                                         "adaptive");
+}
+
+static void test_multifd_tcp_adaptive(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start = {
+            .caps[MIGRATION_CAPABILITY_MULTIFD] = true,
+        },
+        .start_hook = migrate_hook_start_precopy_tcp_multifd_adaptive,
+    };
+    test_precopy_common(&args);
+}
 #endif /* CONFIG_ZSTD */
 
 #ifdef CONFIG_QATZIP
@@ -132,6 +152,35 @@ migrate_hook_start_xbzrle(QTestState *from,
     return NULL;
 }
 
+static void *
+migrate_hook_start_precopy_tcp_multifd_xbzrle(QTestState *from,
+                                              QTestState *to)
+{
+    migrate_set_parameter_int(from, "xbzrle-cache-size", 33554432);
+
+    return migrate_hook_start_precopy_tcp_multifd_common(from, to, "none");
+}
+
+static void test_multifd_tcp_xbzrle(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start = {
+            .caps[MIGRATION_CAPABILITY_MULTIFD] = true,
+            .caps[MIGRATION_CAPABILITY_XBZRLE] = true,
+        },
+        .start_hook = migrate_hook_start_precopy_tcp_multifd_xbzrle,
+        .iterations = 2,
+        /*
+         * XBZRLE needs pages to be modified when they're migrated, or
+         * there's nothing for it to encode.
+         */
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
 static void test_precopy_unix_xbzrle(void)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -202,6 +251,8 @@ void migration_test_add_compression(MigrationTestEnv *env)
         migration_test_add("/migration/multifd+postcopy/tcp/plain/zstd",
                            test_multifd_postcopy_tcp_zstd);
     }
+    migration_test_add("/migration/multifd/tcp/plain/adaptive",
+                       test_multifd_tcp_adaptive);
 #endif
 
 #ifdef CONFIG_QATZIP
@@ -222,5 +273,7 @@ void migration_test_add_compression(MigrationTestEnv *env)
     if (g_test_slow()) {
         migration_test_add("/migration/precopy/unix/xbzrle",
                            test_precopy_unix_xbzrle);
+        migration_test_add("/migration/multifd/tcp/plain/xbzrle",
+                           test_multifd_tcp_xbzrle);
     }
 }
@@ -143,6 +143,120 @@ static void test_compute_wait(void)
     }
 }
 
+static void test_compute_budget(void)
+{
+    throttle_config_init(&cfg);
+    bkt = cfg.buckets[THROTTLE_BPS_TOTAL];
+
+    /* no operation limit set */
+    bkt.avg = 0;
+    bkt.level = 1.5;
+    g_assert(isinf(throttle_compute_budget(&bkt)));
+
+    /* without bkt.max the bucket holds a tenth of bkt.avg */
+    bkt.avg = 150;
+    bkt.max = 0;
+    bkt.level = 9;
+    g_assert(double_cmp(throttle_compute_budget(&bkt), 6));
+
+    /* using up the budget does not cause a wait, going beyond it does */
+    bkt.level += throttle_compute_budget(&bkt);
+    g_assert(!throttle_compute_wait(&bkt));
+    bkt.level += 1;
+    g_assert(throttle_compute_wait(&bkt));
+    g_assert(double_cmp(throttle_compute_budget(&bkt), 0));
+
+    /* the burst bucket is smaller than the main bucket */
+    bkt.avg = 10;
+    bkt.max = 200;
+    bkt.burst_length = 2;
+    bkt.level = 0;
+    bkt.burst_level = 5;
+    g_assert(double_cmp(throttle_compute_budget(&bkt), 200 / 10 - 5));
+}
+
+static void test_borrow(void)
+{
+    double size, units;
+
+    throttle_init(&ts);
+    ts.cfg.buckets[THROTTLE_BPS_TOTAL].avg = 1600;
+    ts.cfg.buckets[THROTTLE_OPS_READ].avg = 100;
+
+    /* a sixteenth of the smallest bucket of each kind */
+    throttle_borrow(&ts, THROTTLE_READ, 16, 1, 0, &size, &units);
+    g_assert(double_cmp(size, 160 / 16));
+    g_assert(double_cmp(units, 10.0 / 16));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, size));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_READ].level, size));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, units));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_READ].level, units));
+    g_assert(!throttle_compute_wait(&ts.cfg.buckets[THROTTLE_BPS_TOTAL]));
+
+    /* that was all of the sixteenth, whatever is left in the buckets */
+    g_assert(double_cmp(ts.borrowed[THROTTLE_BPS_TOTAL], 10));
+    throttle_borrow(&ts, THROTTLE_READ, 16, 1, 0, &size, &units);
+    g_assert(double_cmp(size, 0));
+    g_assert(double_cmp(units, 0));
+
+    /* giving it back restores the levels */
+    throttle_unborrow(&ts, THROTTLE_READ, 160 / 16, 10.0 / 16,
+                      160 / 16, 10.0 / 16);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 0));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_READ].level, 0));
+    g_assert(double_cmp(ts.borrowed[THROTTLE_BPS_TOTAL], 0));
+
+    /* there is no operation limit for writes */
+    throttle_borrow(&ts, THROTTLE_WRITE, 16, 1, 0, &size, &units);
+    g_assert(double_cmp(size, 160 / 16));
+    g_assert(isinf(units));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 0));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_WRITE].level, 0));
+
+    throttle_unborrow(&ts, THROTTLE_WRITE, size, units, size, units);
+
+    /* a tiny share is rounded up to one request of min_size... */
+    throttle_borrow(&ts, THROTTLE_READ, 2, 800, 64, &size, &units);
+    g_assert(double_cmp(size, 64));
+    g_assert(double_cmp(units, 1));
+
+    /* ...but only as long as the total stays below 1/divisor */
+    throttle_borrow(&ts, THROTTLE_READ, 2, 800, 64, &size, &units);
+    g_assert(double_cmp(size, 0));
+    g_assert(double_cmp(units, 0));
+    g_assert(double_cmp(ts.borrowed[THROTTLE_BPS_TOTAL], 64));
+    throttle_unborrow(&ts, THROTTLE_READ, 64, 1, 64, 1);
+
+    /* what was used stays accounted, but no longer counts as borrowed */
+    throttle_borrow(&ts, THROTTLE_READ, 16, 1, 0, &size, &units);
+    throttle_unborrow(&ts, THROTTLE_READ, size, units, 0, 0);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 10));
+    g_assert(double_cmp(ts.borrowed[THROTTLE_BPS_TOTAL], 0));
+    ts.cfg.buckets[THROTTLE_BPS_TOTAL].level = 0;
+    ts.cfg.buckets[THROTTLE_OPS_READ].level = 0;
+
+    /* nothing is borrowed if a request of min_size does not fit */
+    throttle_borrow(&ts, THROTTLE_READ, 1, 1600, 1024, &size, &units);
+    g_assert(double_cmp(size, 0));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 0));
+
+    /* with a burst limit the burst bucket is used instead */
+    ts.cfg.buckets[THROTTLE_BPS_TOTAL].max = 3200;
+    ts.cfg.buckets[THROTTLE_BPS_TOTAL].burst_length = 60;
+    throttle_borrow(&ts, THROTTLE_READ, 16, 1, 0, &size, &units);
+    g_assert(double_cmp(size, 320 / 16));
+    throttle_unborrow(&ts, THROTTLE_READ, size, units, size, units);
+    ts.cfg.buckets[THROTTLE_BPS_TOTAL].max = 0;
+    ts.cfg.buckets[THROTTLE_BPS_TOTAL].burst_length = 1;
+
+    /* nothing is left when the buckets are full */
+    ts.cfg.buckets[THROTTLE_BPS_TOTAL].level = 200;
+    throttle_borrow(&ts, THROTTLE_READ, 16, 1, 0, &size, &units);
+    g_assert(double_cmp(size, 0));
+    throttle_borrow(&ts, THROTTLE_READ, 16, 1, 64, &size, &units);
+    g_assert(double_cmp(size, 0));
+}
+
 /* functions to test ThrottleState initialization/destroy methods */
 static void read_timer_cb(void *opaque)
 {
@@ -801,6 +915,121 @@ static void test_groups(void)
     g_assert(tgm3->throttle_state == NULL);
 }
 
+typedef struct {
+    ThrottleGroupMember *tgm;
+    int64_t bytes;
+    bool done;
+    int order;      /* position in the order of completion */
+} GroupRequest;
+
+static int group_requests_done;
+
+static void coroutine_fn group_request_entry(void *opaque)
+{
+    GroupRequest *req = opaque;
+
+    throttle_group_co_io_limits_intercept(req->tgm, req->bytes, THROTTLE_READ);
+    req->done = true;
+    req->order = ++group_requests_done;
+}
+
+/* Start a read on @tgm, return whether it went through without waiting */
+static bool group_request_start(GroupRequest *req, ThrottleGroupMember *tgm,
+                                int64_t bytes)
+{
+    *req = (GroupRequest) { .tgm = tgm, .bytes = bytes };
+    qemu_coroutine_enter(qemu_coroutine_create(group_request_entry, req));
+    return req->done;
+}
+
+#define CACHE_GROUP_MEMBERS 200
+#define CACHE_GROUP_REQ     4096
+#define CACHE_GROUP_HELD    10  /* requests that fit in 1/16 of the bucket */
+
+static void test_groups_cache(void)
+{
+    BlockBackend *blk[CACHE_GROUP_MEMBERS];
+    ThrottleGroupMember *tgms[CACHE_GROUP_MEMBERS];
+    GroupRequest reqs[CACHE_GROUP_MEMBERS], req0;
+    LeakyBucket *bkt;
+    double level, held;
+    double bucket_size = 16 * CACHE_GROUP_HELD * CACHE_GROUP_REQ;
+    int i, n, holders, waiting = -1;
+
+    for (i = 0; i < CACHE_GROUP_MEMBERS; i++) {
+        blk[i] = blk_new(qemu_get_aio_context(), 0, BLK_PERM_ALL);
+        tgms[i] = &blk_get_public(blk[i])->throttle_group_member;
+        throttle_group_register_tgm(tgms[i], "cache", ctx);
+    }
+
+    /* A share of 1/16 of the bucket per member is only 204.8 bytes */
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = bucket_size * 10;
+    throttle_group_config(tgms[0], &cfg);
+    bkt = &tgms[0]->throttle_state->cfg.buckets[THROTTLE_BPS_TOTAL];
+
+    /* The first request borrows enough for one more of the same size... */
+    g_assert(group_request_start(&req0, tgms[0], CACHE_GROUP_REQ));
+    g_assert(double_cmp(tgms[0]->token_cache[THROTTLE_READ].bytes,
+                        CACHE_GROUP_REQ));
+    g_assert(double_cmp(bkt->level, 2 * CACHE_GROUP_REQ));
+
+    /* ...which goes through without touching the group */
+    level = bkt->level;
+    g_assert(group_request_start(&req0, tgms[0], CACHE_GROUP_REQ));
+    g_assert(double_cmp(tgms[0]->token_cache[THROTTLE_READ].bytes, 0));
+    g_assert(double_cmp(bkt->level, level));
+
+    /* Borrow again, this is still held when the others start waiting */
+    g_assert(group_request_start(&req0, tgms[0], CACHE_GROUP_REQ));
+    g_assert(double_cmp(tgms[0]->token_cache[THROTTLE_READ].bytes,
+                        CACHE_GROUP_REQ));
+
+    /* Members that go idle after one request keep what they borrowed, but
+     * all of it together stays within 1/16 of the bucket */
+    for (i = 1; i < CACHE_GROUP_MEMBERS / 2; i++) {
+        g_assert(group_request_start(&reqs[i], tgms[i], CACHE_GROUP_REQ));
+    }
+    held = 0;
+    holders = 0;
+    for (i = 0; i < CACHE_GROUP_MEMBERS; i++) {
+        held += tgms[i]->token_cache[THROTTLE_READ].bytes;
+        holders += tgms[i]->token_cache[THROTTLE_READ].bytes > 0;
+    }
+    g_assert(held <= bucket_size / 16);
+    g_assert(holders == CACHE_GROUP_HELD);
+    g_assert(double_cmp(tgms[CACHE_GROUP_MEMBERS / 2 - 1]->
+                        token_cache[THROTTLE_READ].bytes, 0));
+
+    /* The budget held by the members counts against the limits */
+    for (n = 0; n < 100 * CACHE_GROUP_MEMBERS; n++) {
+        i = CACHE_GROUP_MEMBERS / 2 + n % (CACHE_GROUP_MEMBERS / 2);
+        if (!group_request_start(&reqs[i], tgms[i], CACHE_GROUP_REQ)) {
+            waiting = i;
+            break;
+        }
+        g_assert(bkt->level <= bucket_size + CACHE_GROUP_REQ);
+    }
+    g_assert(waiting > 0);
+
+    /* While a request waits the borrowed budget is not used, so the
+     * others take their turn in the round robin and it is given back */
+    g_assert(!group_request_start(&req0, tgms[0], CACHE_GROUP_REQ));
+    g_assert(tgms[0]->pending_reqs[THROTTLE_READ] == 1);
+    g_assert(double_cmp(tgms[0]->token_cache[THROTTLE_READ].bytes, 0));
+
+    while (!reqs[waiting].done || !req0.done) {
+        aio_poll(ctx, true);
+    }
+    g_assert(reqs[waiting].order < req0.order);
+    g_assert(bkt->level <= bucket_size + CACHE_GROUP_REQ);
+
+    for (i = 0; i < CACHE_GROUP_MEMBERS; i++) {
+        throttle_group_unregister_tgm(tgms[i]);
+        blk_unref(blk[i]);
+    }
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -814,6 +1043,8 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/throttle/leak_bucket",        test_leak_bucket);
     g_test_add_func("/throttle/compute_wait",       test_compute_wait);
+    g_test_add_func("/throttle/compute_budget",     test_compute_budget);
+    g_test_add_func("/throttle/borrow",             test_borrow);
     g_test_add_func("/throttle/init",               test_init);
     g_test_add_func("/throttle/init_readonly",      test_init_readonly);
     g_test_add_func("/throttle/init_writeonly",     test_init_writeonly);
@@ -830,6 +1061,7 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/groups/cache",       test_groups_cache);
     return g_test_run();
 }
 
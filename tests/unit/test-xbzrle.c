@@ -173,6 +173,38 @@ static void test_encode_decode(void)
     }
 }
 
+/* Modified runs around the sizes the decoder copies in one go */
+static void test_encode_decode_runs(void)
+{
+    uint8_t *old = g_malloc0(XBZRLE_PAGE_SIZE);
+    uint8_t *new = g_malloc0(XBZRLE_PAGE_SIZE);
+    uint8_t *test = g_malloc0(XBZRLE_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    int len, start, dlen, rc;
+
+    for (len = 1; len <= 130; len++) {
+        start = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE - 2 * len - 1);
+
+        memset(new, 0, XBZRLE_PAGE_SIZE);
+        memset(new + start, 0x5a, len);
+        memset(new + start + len + 1, 0xa5, len);
+
+        dlen = xbzrle_encode_buffer(old, new, XBZRLE_PAGE_SIZE, compressed,
+                                    XBZRLE_PAGE_SIZE);
+        g_assert(dlen > 0);
+
+        memset(test, 0, XBZRLE_PAGE_SIZE);
+        rc = xbzrle_decode_buffer(compressed, dlen, test, XBZRLE_PAGE_SIZE);
+        g_assert(rc > 0 && rc <= XBZRLE_PAGE_SIZE);
+        g_assert(memcmp(test, new, XBZRLE_PAGE_SIZE) == 0);
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(test);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -185,6 +217,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_runs", test_encode_decode_runs);
 
     return g_test_run();
 }
@@ -194,6 +194,8 @@ static void main_loop_update_params(EventLoopBase *base, Error **errp)
     }
 
     aio_context_set_aio_params(qemu_aio_context, base->aio_max_batch);
+    aio_context_set_io_uring_params(qemu_aio_context,
+                                    base->io_uring_sqpoll_idle);
 
     aio_context_set_thread_pool_params(qemu_aio_context, base->thread_pool_min,
                                        base->thread_pool_max, errp);
@@ -23,6 +23,7 @@
  */
 
 #include "qemu/osdep.h"
+#include <math.h>
 #include "qapi/error.h"
 #include "qemu/throttle.h"
 #include "qemu/timer.h"
@@ -87,6 +88,29 @@ static int64_t throttle_do_compute_wait(double limit, double extra)
     return wait;
 }
 
+/* Compute the sizes of the buckets of a leaky bucket with a limit
+ *
+ * @bkt:               the leaky bucket we operate on
+ * @bucket_size:       I/O before throttling to bkt->avg
+ * @burst_bucket_size: I/O before throttling to bkt->max
+ */
+static void throttle_bucket_sizes(LeakyBucket *bkt, double *bucket_size,
+                                  double *burst_bucket_size)
+{
+    if (!bkt->max) {
+        /* If bkt->max is 0 we still want to allow short bursts of I/O
+         * from the guest, otherwise every other request will be throttled
+         * and performance will suffer considerably. */
+        *bucket_size = (double) bkt->avg / 10;
+        *burst_bucket_size = 0;
+    } else {
+        /* If we have a burst limit then we have to wait until all I/O
+         * at burst rate has finished before throttling to bkt->avg */
+        *bucket_size = bkt->max * bkt->burst_length;
+        *burst_bucket_size = (double) bkt->max / 10;
+    }
+}
+
 /* This function compute the wait time in ns that a leaky bucket should trigger
  *
  * @bkt: the leaky bucket we operate on
@@ -102,18 +126,7 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
         return 0;
     }
 
-    if (!bkt->max) {
-        /* If bkt->max is 0 we still want to allow short bursts of I/O
-         * from the guest, otherwise every other request will be throttled
-         * and performance will suffer considerably. */
-        bucket_size = (double) bkt->avg / 10;
-        burst_bucket_size = 0;
-    } else {
-        /* If we have a burst limit then we have to wait until all I/O
-         * at burst rate has finished before throttling to bkt->avg */
-        bucket_size = bkt->max * bkt->burst_length;
-        burst_bucket_size = (double) bkt->max / 10;
-    }
+    throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
 
     /* If the main bucket is full then we have to wait */
     extra = bkt->level - bucket_size;
@@ -134,6 +147,32 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
     return 0;
 }
 
+/* This function computes how many units can be added to a leaky bucket
+ * before throttle_compute_wait() returns a non-zero wait time
+ *
+ * @bkt: the leaky bucket we operate on
+ * @ret: the number of units, or INFINITY if the bucket has no limit
+ */
+double throttle_compute_budget(LeakyBucket *bkt)
+{
+    double bucket_size;
+    double burst_bucket_size;
+    double budget;
+
+    if (!bkt->avg) {
+        return INFINITY;
+    }
+
+    throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
+
+    budget = bucket_size - bkt->level;
+    if (bkt->burst_length > 1) {
+        budget = MIN(budget, burst_bucket_size - bkt->burst_level);
+    }
+
+    return MAX(budget, 0);
+}
+
 /* This function compute the time that must be waited while this IO
  *
  * @direction:  throttle direction
@@ -405,6 +444,7 @@ void throttle_config(ThrottleState *ts,
     for (i = 0; i < BUCKETS_COUNT; i++) {
         ts->cfg.buckets[i].level = 0;
         ts->cfg.buckets[i].burst_level = 0;
+        ts->borrowed[i] = 0;
     }
 
     ts->previous_leak = qemu_clock_get_ns(clock_type);
@@ -462,46 +502,184 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
-/* do the accounting for this operation
+static const BucketType bucket_types_size[THROTTLE_MAX][2] = {
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+};
+static const BucketType bucket_types_units[THROTTLE_MAX][2] = {
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+};
+
+/* add bytes and operations to the buckets of a direction
  *
  * @direction: throttle direction
- * @size:     the size of the operation
+ * @size:      the number of bytes, may be negative
+ * @units:     the number of operations, may be negative
  */
-void throttle_account(ThrottleState *ts, ThrottleDirection direction,
-                      uint64_t size)
+static void throttle_do_account(ThrottleState *ts, ThrottleDirection direction,
+                                double size, double units)
 {
-    static const BucketType bucket_types_size[THROTTLE_MAX][2] = {
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
-    };
-    static const BucketType bucket_types_units[THROTTLE_MAX][2] = {
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
-    };
-    double units = 1.0;
     unsigned i;
 
-    assert(direction < THROTTLE_MAX);
-    /* if cfg.op_size is defined and smaller than size we compute unit count */
-    if (ts->cfg.op_size && size > ts->cfg.op_size) {
-        units = (double) size / ts->cfg.op_size;
-    }
-
     for (i = 0; i < ARRAY_SIZE(bucket_types_size[THROTTLE_READ]); i++) {
         LeakyBucket *bkt;
 
         bkt = &ts->cfg.buckets[bucket_types_size[direction][i]];
-        bkt->level += size;
+        bkt->level = MAX(bkt->level + size, 0);
         if (bkt->burst_length > 1) {
-            bkt->burst_level += size;
+            bkt->burst_level = MAX(bkt->burst_level + size, 0);
         }
 
         bkt = &ts->cfg.buckets[bucket_types_units[direction][i]];
-        bkt->level += units;
+        bkt->level = MAX(bkt->level + units, 0);
+        if (bkt->burst_length > 1) {
+            bkt->burst_level = MAX(bkt->burst_level + units, 0);
+        }
+    }
+}
+
+/* return the number of operations that a request of @size bytes counts as
+ *
+ * @op_size: the configured size of an operation, or 0
+ * @size:    the size of the request
+ */
+double throttle_units(uint64_t op_size, uint64_t size)
+{
+    /* if op_size is defined and smaller than size we compute unit count */
+    if (op_size && size > op_size) {
+        return (double) size / op_size;
+    }
+    return 1.0;
+}
+
+/* do the accounting for this operation
+ *
+ * @direction: throttle direction
+ * @size:     the size of the operation
+ */
+void throttle_account(ThrottleState *ts, ThrottleDirection direction,
+                      uint64_t size)
+{
+    assert(direction < THROTTLE_MAX);
+    throttle_do_account(ts, direction, size,
+                        throttle_units(ts->cfg.op_size, size));
+}
+
+/* compute how much of a budget of the buckets of a kind can be borrowed
+ *
+ * @types:   the two buckets to check
+ * @divisor: everything borrowed from a bucket is at most 1/divisor of it
+ * @shares:  take 1/shares of that...
+ * @min:     ...or @min if that is more
+ * @ret:     the budget, or INFINITY if none of the buckets has a limit
+ */
+static double throttle_budget_for(ThrottleState *ts, const BucketType *types,
+                                  unsigned divisor, unsigned shares,
+                                  double min)
+{
+    double budget = INFINITY;
+    unsigned i;
+
+    for (i = 0; i < 2; i++) {
+        LeakyBucket *bkt = &ts->cfg.buckets[types[i]];
+        double bucket_size, burst_bucket_size, cap;
+
+        if (!bkt->avg) {
+            continue;
+        }
+        throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
+        /* Borrowed budget can be used at any time, so it must also fit in
+         * the burst bucket */
         if (bkt->burst_length > 1) {
-            bkt->burst_level += units;
+            bucket_size = MIN(bucket_size, burst_bucket_size);
         }
+        cap = bucket_size / divisor;
+        budget = MIN(budget, throttle_compute_budget(bkt));
+        budget = MIN(budget, MAX(cap / shares, min));
+        budget = MIN(budget, cap - ts->borrowed[types[i]]);
     }
+
+    return MAX(budget, 0);
+}
+
+/* add @amount to what is borrowed from the limited buckets of a kind */
+static void throttle_add_borrowed(ThrottleState *ts, const BucketType *types,
+                                  double amount)
+{
+    unsigned i;
+
+    if (isinf(amount)) {
+        return;
+    }
+    for (i = 0; i < 2; i++) {
+        if (ts->cfg.buckets[types[i]].avg) {
+            ts->borrowed[types[i]] += amount;
+        }
+    }
+}
+
+/* account bytes and operations for requests that have not been submitted
+ * yet, so that they can later be performed without checking the limits
+ *
+ * The amounts are chosen so that accounting them does not make
+ * throttle_compute_wait() return a non-zero wait time.  An amount is
+ * INFINITY if the corresponding buckets have no limit.
+ *
+ * What has been borrowed and not given back yet stays below 1/divisor of
+ * each bucket (and of its burst bucket), however long it is held, so it
+ * can never add up to a burst beyond what the limits allow.
+ *
+ * @direction: throttle direction
+ * @divisor:   borrow at most 1/divisor of each bucket in total
+ * @shares:    take 1/shares of that, or...
+ * @min_size:  ...enough for a request of this size if that is more.  If
+ *             that much is not left, nothing is borrowed
+ * @size:      the number of bytes that were accounted
+ * @units:     the number of operations that were accounted
+ */
+void throttle_borrow(ThrottleState *ts, ThrottleDirection direction,
+                     unsigned divisor, unsigned shares, uint64_t min_size,
+                     double *size, double *units)
+{
+    double min_units = min_size ? throttle_units(ts->cfg.op_size, min_size) : 0;
+
+    assert(direction < THROTTLE_MAX);
+    assert(divisor > 0 && shares > 0);
+
+    *size = throttle_budget_for(ts, bucket_types_size[direction], divisor,
+                                shares, min_size);
+    *units = throttle_budget_for(ts, bucket_types_units[direction], divisor,
+                                 shares, min_units);
+    if (*size < min_size || *units < min_units) {
+        *size = 0;
+        *units = 0;
+        return;
+    }
+
+    throttle_add_borrowed(ts, bucket_types_size[direction], *size);
+    throttle_add_borrowed(ts, bucket_types_units[direction], *units);
+    throttle_do_account(ts, direction, isinf(*size) ? 0 : *size,
+                        isinf(*units) ? 0 : *units);
+}
+
+/* end a throttle_borrow(), giving back what was accounted and not used
+ *
+ * @direction:  throttle direction
+ * @size:       the number of bytes that throttle_borrow() returned
+ * @units:      the number of operations that throttle_borrow() returned
+ * @left_size:  the number of bytes that were not used
+ * @left_units: the number of operations that were not used
+ */
+void throttle_unborrow(ThrottleState *ts, ThrottleDirection direction,
+                       double size, double units,
+                       double left_size, double left_units)
+{
+    assert(direction < THROTTLE_MAX);
+    throttle_add_borrowed(ts, bucket_types_size[direction], -size);
+    throttle_add_borrowed(ts, bucket_types_units[direction], -units);
+    throttle_do_account(ts, direction, isinf(left_size) ? 0 : -left_size,
+                        isinf(left_units) ? 0 : -left_units);
 }
 
 /* return a ThrottleConfig based on the options in a ThrottleLimits